@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <errno.h>
 #include <termios.h>
@@ -6,6 +7,21 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <regex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <malloc.h>
  
 // getting ctrl combinations
 #define CTRL_KEY(c) (c & (31))
@@ -21,12 +37,24 @@
 #define  WHITE       "\x1b[37m" 
 #define  COLOR_RESET "\x1b[0m" 
 #define  VISUAL_BG   "\x1b[48;5;24m"   
+#define  DIFF_ADD_BG    "\x1b[48;5;22m"
+#define  DIFF_CHANGE_BG "\x1b[48;5;17m"
+#define  DIFF_TEXT_BG   "\x1b[48;5;88m" // the part of a changed line that differs
 
 #define BOLD_ON  "\x1b[1m"
+#define REVERSE  "\x1b[7m"
 
 
 // some useful macros
 #define ESC '\x1b' // Escape Sequence
+#define MAX_THREADS 64
+#define IOV_BATCH 1024 // iovec entries per writev call
+#define LOAD_CHUNK_MIN (1 << 20) // bytes a loader thread should get at least
+#define REGISTER_COUNT 27 // the unnamed register and "a to "z
+#define STDIN_CHUNK (1 << 16) // bytes read from stdin at once
+#define STDIN_SPILL_AFTER (64 << 20) // stdin bytes kept on the heap, the rest goes to a spill file
+#define SPILL_RESERVE (1ULL << 36) // address space mapped for the spill file
+#define INDEX_CACHE_MIN (64 << 20) // files smaller than this are read fast enough without a cached index
 
 // math utils
 int ceil_d(int a, int b) {
@@ -159,9 +187,64 @@ typedef struct
 {
     char* str;
     size_t size;
-    size_t capacity;
+    size_t capacity; // 0 when str points into memory the string doesn't own
+    int refs; // owners of the string, registers share lines with the buffer
+    int packed; // str is in a LineArena, the compaction put it there
 } String;
 
+_Thread_local int string_growth = 200; // :set growth, what a string grows to in percent of the room it needs
+
+// Short lines are packed into arenas by the idle compaction, saving the malloc overhead and slack of each line.
+// A packed line is borrowed like a mapped one, so it's copied out before a change. An arena is freed when its
+// last line leaves it, arenas are aligned on their size so a line finds its arena from its address
+#define ARENA_SIZE (1 << 16)
+#define ARENA_LINE_MAX 256 // longer lines keep their own allocation
+
+typedef struct
+{
+    int live; // lines still in the arena
+    size_t used;
+    char text[];
+} LineArena;
+
+_Thread_local LineArena* line_arena; // the arena being filled
+_Thread_local size_t arena_count;
+
+// Copy len chars into the arena being filled, a new one is started when it's full
+char* ArenaCopy(const char* text, size_t len) {
+    if (line_arena == NULL || line_arena->used + len + 1 > ARENA_SIZE - sizeof(LineArena)) {
+        if (line_arena != NULL && line_arena->live == 0) {
+            free(line_arena);
+            arena_count--;
+        }
+        line_arena = aligned_alloc(ARENA_SIZE, ARENA_SIZE);
+        if (line_arena == NULL) {
+            ShowError("Memory couldn't be allocated");
+        }
+        line_arena->live = 0;
+        line_arena->used = 0;
+        arena_count++;
+    }
+    char* copy = &line_arena->text[line_arena->used];
+    memcpy(copy, text, len);
+    copy[len] = 0;
+    line_arena->used += len + 1;
+    line_arena->live++;
+    return copy;
+}
+
+void ArenaRelease(const char* text) {
+    LineArena* arena = (LineArena*)((size_t)text & ~(size_t)(ARENA_SIZE - 1));
+    if (--arena->live > 0) 
+        return;
+    if (arena == line_arena) {
+        arena->used = 0;
+    } else {
+        free(arena);
+        arena_count--;
+    }
+}
+
 String* StringInit() {
     String* string = malloc(sizeof(String));
     if (string == NULL) {
@@ -171,6 +254,8 @@ String* StringInit() {
     // init
     string->size = 0;
     string->capacity = 10;
+    string->refs = 1;
+    string->packed = 0;
     string->str = malloc(string->capacity);    
 
     // Exit the program with error message if memory wasn't allocated
@@ -199,61 +284,47 @@ void StringExpandCapacity(String* string, size_t new_capacity) {
     }
 }
 
-void StringAppend(String *string, const char* add) {
-    size_t add_len = strlen(add);
-    if (string->capacity <= (string->size + add_len)) {
-        StringExpandCapacity(string, (string->size + add_len) * 2);
-    }
+// Make room for size chars and the terminator, with the slack the growth policy gives
+void StringReserve(String* string, size_t size) {
+    if (size < string->capacity) 
+        return;
+    size_t grown = size / 100 * string_growth + size % 100 * string_growth / 100;
+    StringExpandCapacity(string, (grown > size) ? grown : size + 1);
+}
+
+void StringAppendN(String *string, const char* add, size_t add_len) {
+    StringReserve(string, string->size + add_len);
 
     memcpy(&string->str[string->size], add, add_len);
     string->size += add_len;
     string->str[string->size] = 0;
 }
 
-void StringInsert(String* string, size_t pos, const char* add) {
+void StringAppend(String *string, const char* add) {
+    StringAppendN(string, add, strlen(add));
+}
+
+void StringInsertN(String* string, size_t pos, const char* add, size_t add_len) {
     if (pos > string->size) {
         ShowError("Out of bound");
         return;
-    } else if (pos == string->size) {
-        StringAppend(string, add);
-        return;
     }
 
-    size_t add_len = strlen(add);
-    if (string->capacity <= (string->size + add_len)) {
-        StringExpandCapacity(string, (string->size + add_len) * 2);
-    }
+    StringReserve(string, string->size + add_len);
 
     // move the current string after pos to the right
-    for (size_t i = string->size - 1; i >= pos; i--) {
-        string->str[i+add_len] = string->str[i];
-    }
-
+    memmove(&string->str[pos + add_len], &string->str[pos], string->size - pos);
     memcpy(&string->str[pos], add, add_len);
     string->size += add_len;
     string->str[string->size] = 0;
 }
 
-void StringInsertChar(String* string, int pos, const char add) {
-    if (pos > (int)string->size) {
-        ShowError("Out of bound");
-        return;
-    }
-
-    if (string->capacity <= string->size + 1) {        
-        StringExpandCapacity(string, (string->size + 1) * 2);
-    }
-
-    // shift chars right
-    for (int i = string->size - 1; i >= pos; i--) {
-        string->str[i+1] = string->str[i];
-    }
-
-    string->str[pos] = add;
-    string->size++;
+void StringInsert(String* string, size_t pos, const char* add) {
+    StringInsertN(string, pos, add, strlen(add));
+}
 
-    // add nullptr
-    string->str[string->size] = 0;
+void StringInsertChar(String* string, int pos, const char add) {
+    StringInsertN(string, pos, &add, 1);
 }
 
 void StringDeleteChar(String* string, int pos) {
@@ -262,40 +333,129 @@ void StringDeleteChar(String* string, int pos) {
         return;
     }
 
-    // shift chars left
-    for (int i = pos; i < (int)string->size - 1; i++) {
-        string->str[i] = string->str[i + 1];
-    }
+    // shift chars left, the null terminator comes along
+    memmove(&string->str[pos], &string->str[pos + 1], string->size - pos);
     string->size--;
-    string->str[string->size] = 0;
-
 }
 
 void StringResize(String* string, size_t new_size) {
-    if (new_size > string->size) {
-        StringExpandCapacity(string, new_size + 10);
-    }
+    StringReserve(string, new_size);
     string->size = new_size;
     string->str[string->size] = 0;
 }
 
-void StringAssign(String* string ,const char* new_string) {
-    size_t new_len = strlen(new_string);
-    if (string->capacity <= (new_len)) {
-        StringExpandCapacity(string, new_len * 2);
-    }
+void StringAssignN(String* string, const char* new_string, size_t new_len) {
+    StringReserve(string, new_len);
 
     memcpy(string->str, new_string, new_len);
     string->size = new_len;
     string->str[string->size] = 0;
 }
 
+void StringAssign(String* string ,const char* new_string) {
+    StringAssignN(string, new_string, strlen(new_string));
+}
+
+// make a string holding a copy of len bytes, with no room to spare
+String* StringFromBuffer(const char* buffer, size_t len) {
+    String* string = malloc(sizeof(String));
+    if (string == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+
+    string->size = len;
+    string->capacity = len + 1;
+    string->refs = 1;
+    string->packed = 0;
+    string->str = malloc(string->capacity);
+    if (string->str == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+
+    memcpy(string->str, buffer, len);
+    string->str[len] = 0;
+    return string;
+}
+
+String* StringDuplicate(const String* string) {
+    String* copy = StringInit();
+    StringAppendN(copy, string->str, string->size);
+    return copy;
+}
+
+// exchange the contents of two strings without copying them
+void StringSwap(String* a, String* b) {
+    String tmp = *a;
+    a->str = b->str, a->size = b->size, a->capacity = b->capacity, a->packed = b->packed;
+    b->str = tmp.str, b->size = tmp.size, b->capacity = tmp.capacity, b->packed = tmp.packed;
+}
+
 void StringClear(String* string) {
     StringResize(string, 0);
 }
 
+// pad a string with spaces up to size
+void StringPad(String* string, size_t size) {
+    if (size <= string->size) 
+        return;
+    StringReserve(string, size);
+
+    memset(&string->str[string->size], ' ', size - string->size);
+    string->size = size;
+    string->str[string->size] = 0;
+}
+
+// A string over text it doesn't own (a spilled stdin line), it's copied before any change
+String* StringBorrow(const char* buffer, size_t len) {
+    String* string = malloc(sizeof(String));
+    if (string == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+
+    string->str = (char*)buffer;
+    string->size = len;
+    string->capacity = 0;
+    string->refs = 1;
+    string->packed = 0;
+    return string;
+}
+
+// Copy the text of a borrowed string, every holder of the string sees the copy
+void StringOwn(String* string) {
+    if (string->capacity > 0) 
+        return;
+    char* text = malloc(string->size + 1);
+    if (text == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    memcpy(text, string->str, string->size);
+    text[string->size] = 0;
+    if (string->packed) 
+        ArenaRelease(string->str);
+    string->str = text;
+    string->capacity = string->size + 1;
+    string->packed = 0;
+}
+
+// the text can't be changed in place: a register shares it or it's borrowed
+int StringShared(const String* string) {
+    return string->refs > 1 || string->capacity == 0;
+}
+
+// take another reference to a string
+String* StringRetain(String* string) {
+    string->refs++;
+    return string;
+}
+
+// drop a reference, the string is freed with the last one
 void StringDestroy(String* string) {
-    free(string->str);
+    if (--string->refs > 0)
+        return;
+    if (string->capacity > 0)
+        free(string->str);
+    else if (string->packed) 
+        ArenaRelease(string->str);
     free(string);
 }
 
@@ -308,10 +468,18 @@ typedef struct
     String** array;
 } Array;
 
-Array* array_buffer;
+_Thread_local Array* array_buffer; // thread local so batch mode can edit a file per thread
+
+// Folds follow the lines of the buffer, the array functions report how they moved
+void LinesMoved(Array* array, size_t pos, size_t removed, size_t added);
+void LinesCompacted(Array* array, const char* marks, size_t old_size);
+// and the word index the lines they count in and out
+void WordsCounted(Array* array, String* line, int sign);
+void WordsFlush(Array* array); // before lines move
+void WordsEditing(Array* array, size_t pos); // before a line changes in place
 
 Array* ArrayInit() {
-    Array* array = (Array*)malloc(sizeof(array));
+    Array* array = (Array*)malloc(sizeof(Array));
     if (array == NULL) {
         ShowError("Memory couldn't be allocated");
     }
@@ -340,52 +508,100 @@ void ArrayAppend(Array* array, String* add) {
         ArrayExpandCapacity(array);
     
     array->array[array->size++] = add; 
+    WordsCounted(array, add, 1);
 }
 
-void s_ArrayAppend(Array* array, const char* add) {
+void s_ArrayAppendN(Array* array, const char* add, size_t len) {
     if (array->size == array->capacity) 
         ArrayExpandCapacity(array);
     
-    String* add_line = StringInit();
-    StringAssign(add_line, add);
-    array->array[array->size++] = add_line; 
+    array->array[array->size++] = StringFromBuffer(add, len); 
+    WordsCounted(array, array->array[array->size - 1], 1);
+}
+
+void s_ArrayAppend(Array* array, const char* add) {
+    s_ArrayAppendN(array, add, strlen(add));
 }
 
 void ArrayDelete(Array* array, size_t pos) {
     if (pos >= array->size) {
         ShowError("Out of bound");
     }
+    WordsFlush(array);
+    WordsCounted(array, array->array[pos], -1);
 
     for (size_t i = pos; (i + 1) < array->size; i++) {
         array->array[i] = array->array[i+1];
     }
     array->size--;
+    LinesMoved(array, pos, 1, 0);
+}
+
+// The line at pos ready for an in-place edit, cloned first if a register still shares it
+String* ArrayMutableLine(Array* array, size_t pos) {
+    WordsEditing(array, pos);
+    String* line = array->array[pos];
+    if (StringShared(line)) {
+        array->array[pos] = StringDuplicate(line);
+        StringDestroy(line);
+    }
+    return array->array[pos];
+}
+
+// Give the line at pos the contents of text and text the old contents.
+// A shared line is replaced by a copy instead, so the register keeps its text
+void ArraySwapLine(Array* array, size_t pos, String* text) {
+    WordsEditing(array, pos);
+    String* line = array->array[pos];
+    if (StringShared(line)) {
+        array->array[pos] = StringDuplicate(text);
+        StringDestroy(line);
+    } else {
+        StringSwap(line, text);
+    }
+}
+
+// Cut the columns [from, to) out of the line at pos with one memmove,
+// a shared line is rebuilt without them instead of being cloned first
+void ArrayCutLine(Array* array, size_t pos, size_t from, size_t to) {
+    WordsEditing(array, pos);
+    String* line = array->array[pos];
+    if (StringShared(line)) {
+        String* cut = StringFromBuffer(line->str, from);
+        StringAppendN(cut, &line->str[to], line->size - to);
+        array->array[pos] = cut;
+        StringDestroy(line);
+    } else {
+        memmove(&line->str[from], &line->str[to], line->size - to);
+        StringResize(line, line->size - (to - from));
+    }
 }
 
 void ArraySplitLine(Array* array, int idx_row, int idx_col) {
     if (array->size == array->capacity) 
         ArrayExpandCapacity(array);
+    String* cur_line = ArrayMutableLine(array, idx_row);
     
     // Shift right rows
     for (int i = array->size - 1; i > idx_row; i--) {
         array->array[i+1] = array->array[i];
     }
     array->size++;
-
-    String* cur_line = array->array[idx_row];
     
     // insert new line
-    String* new_line = StringInit();
-    StringAssign(new_line, &cur_line->str[idx_col]);
+    String* new_line = StringFromBuffer(&cur_line->str[idx_col], cur_line->size - idx_col);
     array->array[idx_row+1] = new_line;
+    WordsCounted(array, new_line, 1);
 
     // resize current line
     StringResize(cur_line, idx_col);
+    LinesMoved(array, idx_row + 1, 0, 1);
 }
 
 void ArrayMergeLines(Array* array, int idx_row) { // Delete a line
-    String *cur_line = array->array[idx_row-1], 
+    String *cur_line = ArrayMutableLine(array, idx_row-1), 
            *next_line = array->array[idx_row];
+    WordsCounted(array, next_line, -1);
 
     // Shift left lines
     for (size_t i = idx_row; i + 1 < array->size; i++) {
@@ -394,9 +610,10 @@ void ArrayMergeLines(Array* array, int idx_row) { // Delete a line
     array->size--;
 
 
-    StringAppend(cur_line, next_line->str);
+    StringAppendN(cur_line, next_line->str, next_line->size);
 
     StringDestroy(next_line);
+    LinesMoved(array, idx_row, 1, 0);
 }
 
 void ArrayDestroy(Array* array) {
@@ -406,777 +623,7152 @@ void ArrayDestroy(Array* array) {
     free(array->array);
 }
 
+void ArrayReserve(Array* array, size_t capacity) {
+    if (capacity <= array->capacity)
+        return;
 
-// Editor Modes
-enum MODE {
-    NORMAL = 0,
-    INSERT,
-    COMMAND_LINE,
-    VISUAL
-};
-
-// Editor Configuration
-typedef struct
-{
-    struct termios default_term;
-    enum MODE mode;
-    size_t window_rows, window_cols;
-    int cursor_x, cursor_y;
-    int file_opened;
-    int buffer_modified;
-    int start_line, end_line;
-    int cur_line, cur_column;
-    int max_column;
-    String* status_message;
-    String* file_name;
-    String* command;
-    String* yanked;
-    int command_cursor_pos;
-    int motion_count;
-    int v_start_line;
-    int v_start_col;
-} Editor;
-
-Editor editor;
-
-void EditorInit() {
-    if (tcgetattr(STDIN_FILENO, &editor.default_term) == -1) {
-        ShowError("tcgetattr");
+    while (array->capacity < capacity)
+        array->capacity *= 2;
+    array->array = (String**)realloc(array->array, array->capacity * sizeof(String*));
+    if (array->array == NULL) {
+        ShowError("Memory couldn't be allocated");
     }
-    editor.mode = NORMAL;
-    GetWindowSize(&editor.window_rows, &editor.window_cols);
-    editor.cursor_x = editor.cursor_y = 1;
-    editor.file_opened = 0;
-    editor.buffer_modified = 0;
-    editor.start_line = editor.end_line = 0;
-    editor.cur_line = editor.cur_column = 0;
-    editor.max_column = 0;
-    editor.status_message = StringInit();
-    editor.file_name = StringInit();
-    editor.command = StringInit();
-    editor.yanked = StringInit();
-    editor.command_cursor_pos = 0;
-    editor.motion_count = 0;
 }
 
-void EditorDestroy() {
-    StringDestroy(editor.status_message);
-    StringDestroy(editor.file_name);
-    StringDestroy(editor.command);
-    StringDestroy(editor.yanked);
+// Insert count lines before pos with a single shift of the rows after it
+void ArrayInsertLines(Array* array, size_t pos, String** lines, size_t count) {
+    if (pos > array->size) {
+        ShowError("Out of bound");
+    }
+    ArrayReserve(array, array->size + count);
+    WordsFlush(array);
+    for (size_t i = 0; i < count; i++) {
+        WordsCounted(array, lines[i], 1);
+    }
+
+    memmove(&array->array[pos + count], &array->array[pos], (array->size - pos) * sizeof(String*));
+    memcpy(&array->array[pos], lines, count * sizeof(String*));
+    array->size += count;
+    LinesMoved(array, pos, 0, count);
 }
 
-void DisableRawMode () {
-    tcsetattr(STDIN_FILENO, TCIFLUSH, &editor.default_term);
+// Remove the lines [from, to], the removed lines are handed to removed if given, destroyed otherwise
+void ArrayRemoveRange(Array* array, size_t from, size_t to, Array* removed) {
+    if (from > to || to >= array->size) {
+        ShowError("Out of bound");
+    }
+
+    size_t count = to - from + 1;
+    WordsFlush(array);
+    for (size_t i = from; i <= to; i++) {
+        WordsCounted(array, array->array[i], -1);
+        if (removed != NULL) {
+            ArrayAppend(removed, array->array[i]);
+        } else {
+            StringDestroy(array->array[i]);
+        }
+    }
+    memmove(&array->array[from], &array->array[to + 1], (array->size - to - 1) * sizeof(String*));
+    array->size -= count;
+    LinesMoved(array, from, count, 0);
 }
 
-void EnableRawMode () {
-    atexit(DisableRawMode);
-    
-    struct termios raw = editor.default_term;
+// Remove every marked line in one pass over the array, keeping the order of the others.
+// Returns the number of removed lines
+size_t ArrayCompact(Array* array, const char* marks, Array* removed) {
+    size_t kept = 0;
+    WordsFlush(array);
+    for (size_t i = 0; i < array->size; i++) {
+        if (!marks[i]) {
+            array->array[kept++] = array->array[i];
+            continue;
+        }
+        WordsCounted(array, array->array[i], -1);
+        if (removed != NULL) {
+            ArrayAppend(removed, array->array[i]);
+        } else {
+            StringDestroy(array->array[i]);
+        }
+    }
 
-    raw.c_iflag &= ~(IXON | ICRNL);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    size_t count = array->size - kept;
+    LinesCompacted(array, marks, array->size);
+    array->size = kept;
+    return count;
+}
 
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
 
+// Sorting lines, the items carry the line pointer and a numeric key for :sort n
+typedef struct
+{
+    String* line;
+    long long key;
+    int has_key;
+} SortItem;
+
+enum SORT_FLAGS {
+    SORT_NUMERIC = 1,
+    SORT_REVERSE = 2,
+    SORT_UNIQUE = 4
+};
 
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+int CompareSortItems(const SortItem* a, const SortItem* b, int flags) {
+    int result;
+    if (flags & SORT_NUMERIC) { // lines without a number go first
+        if (a->has_key != b->has_key) 
+            result = a->has_key - b->has_key;
+        else 
+            result = (a->key > b->key) - (a->key < b->key);
+    } else {
+        size_t len = (a->line->size < b->line->size) ? a->line->size : b->line->size;
+        result = memcmp(a->line->str, b->line->str, len);
+        if (result == 0) 
+            result = (a->line->size > b->line->size) - (a->line->size < b->line->size);
+    }
+    return (flags & SORT_REVERSE) ? -result : result;
 }
 
-void UpdateMotionCount(int digit) {
-    if (editor.motion_count < 1e5) // why whould anyone need more than this? If someone really does, I don't care
-        editor.motion_count = editor.motion_count * 10 + digit;
+// stable merge of the sorted runs [0, mid) and [mid, count) of items into out
+void MergeSortItems(SortItem* items, size_t mid, size_t count, SortItem* out, int flags) {
+    size_t i = 0, j = mid, k = 0;
+    while (i < mid && j < count) {
+        if (CompareSortItems(&items[j], &items[i], flags) < 0) 
+            out[k++] = items[j++];
+        else 
+            out[k++] = items[i++];
+    }
+    memcpy(&out[k], &items[i], (mid - i) * sizeof(SortItem));
+    k += mid - i;
+    memcpy(&out[k], &items[j], (count - j) * sizeof(SortItem));
 }
 
-void DrawTildes() {
-    const char* tilde_cursor_pos = "\x1b[H";
-    String* tildes = StringInit();
-    StringAppend(tildes, tilde_cursor_pos);
-
-    // color the tildes blue
-    StringAppend(tildes, BLUE);
-    StringAppend(tildes, BOLD_ON);
-
-    for (size_t i = 0; i < editor.window_rows - 1; i++) {
-        StringAppend(tildes ,"\x1b[K");
-        if (i == editor.window_rows - 2) {
-            StringAppend(tildes, "~");
-        } else {
-            StringAppend(tildes, "~\r\n");
+// bottom up merge sort, the result ends in items
+void SortItems(SortItem* items, SortItem* tmp, size_t count, int flags) {
+    SortItem *from = items, *to = tmp;
+    for (size_t width = 1; width < count; width *= 2) {
+        for (size_t i = 0; i < count; i += 2 * width) {
+            size_t mid = (i + width < count) ? i + width : count;
+            size_t end = (i + 2 * width < count) ? i + 2 * width : count;
+            MergeSortItems(&from[i], mid - i, end - i, &to[i], flags);
         }
+        SortItem* swap_tmp = from;
+        from = to, to = swap_tmp;
     }
-    
-    // reset the original color
-    StringAppend(tildes, COLOR_RESET);
+    if (from != items) 
+        memcpy(items, from, count * sizeof(SortItem));
+}
 
-    write(STDOUT_FILENO, tildes->str, tildes->size);
-    StringDestroy(tildes);        
-}    
+typedef struct
+{
+    SortItem* items;
+    SortItem* tmp;
+    size_t mid, count;
+    int flags;
+} SortJob;
+
+void* SortWorker(void* arg) {
+    SortJob* job = arg;
+    if (job->mid == 0) {
+        SortItems(job->items, job->tmp, job->count, job->flags);
+    } else {
+        MergeSortItems(job->items, job->mid, job->count, job->tmp, job->flags);
+        memcpy(job->items, job->tmp, job->count * sizeof(SortItem));
+    }
+    return NULL;
+}
 
-void StatusBar() {
-    String* message = StringInit();
+// number of threads worth starting for work items, at least min_work each
+int ThreadCount(size_t work, size_t min_work) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = work / min_work;
+    if (cpus < 1) cpus = 1;
+    if (threads > (size_t)cpus) threads = cpus;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    return threads ? threads : 1;
+}
 
-    char message_pos[20];
-    snprintf(message_pos, sizeof(message_pos), "\x1b[%zu;%dH", editor.window_rows, 2);
+// Sort the items with every chunk sorted on its own thread, then merge the chunks pairwise in parallel
+void ParallelSortItems(SortItem* items, size_t count, int flags) {
+    if (count < 2) 
+        return;
 
-    StringAppend(message, message_pos);
-    StringAppend(message ,"\x1b[2K");
+    SortItem* tmp = malloc(count * sizeof(SortItem));
+    if (tmp == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
 
-    StringAppend(message, CYAN);
-    StringAppend(message, BOLD_ON);
-    switch (editor.mode)
-    {
-    case NORMAL:
-        if (editor.status_message->size < 40) {
-            StringAppend(message, editor.status_message->str);
+    int threads = ThreadCount(count, 1 << 15);
+    size_t chunk = (count + threads - 1) / threads;
+    pthread_t workers[MAX_THREADS];
+    SortJob jobs[MAX_THREADS];
+
+    // the first round sorts the chunks, every following round merges pairs of sorted runs
+    for (size_t run = 0; run < count; run = (run ? run * 2 : chunk)) {
+        size_t step = run ? 2 * run : chunk;
+        int started = 0;
+        for (size_t i = 0; i < count; i += step) {
+            if (run && i + run >= count) 
+                continue; // nothing to merge with, already sorted
+
+            SortJob* job = &jobs[started];
+            job->items = &items[i], job->tmp = &tmp[i];
+            job->mid = run;
+            job->count = ((i + step < count) ? i + step : count) - i;
+            job->flags = flags;
+
+            if (threads == 1 || pthread_create(&workers[started], NULL, SortWorker, job) != 0) {
+                SortWorker(job);
+                continue;
+            }
+            started++;
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
         }
-        break;
-    case INSERT:
-        StringAppend(message, "-- INSERT MODE --");
-        break;
-    case VISUAL:
-        StringAppend(message, "-- VIUSAL MODE --");
-        break;
-    case COMMAND_LINE:
-        StringAppend(message, ":");
-        StringAppend(message, editor.command->str);
-        break;
-    default:
-        break;
     }
-    StringAppend(message, COLOR_RESET);
-    write(STDOUT_FILENO, message->str, message->size);
+    free(tmp);
+}
 
-    if (editor.motion_count > 0 && (editor.mode == NORMAL || editor.mode == VISUAL)) { // show motion count 
-        String* count_message = StringInit();
+// Registers share the lines of the buffer instead of copying them,
+// the text runs from first_col of the first line to last_col of the last one
+// Linewise registers use every line whole, block registers take the columns [first_col, last_col) of every line
+enum REGISTER_TYPE {
+    REGISTER_CHARS = 0,
+    REGISTER_LINES,
+    REGISTER_BLOCK
+};
 
-        char count[10];
-        snprintf(count, sizeof(count), "%d", editor.motion_count);
+typedef struct
+{
+    Array* lines;
+    size_t first_col, last_col;
+    enum REGISTER_TYPE type;
+} Register;
 
-        char count_pos[20];
-        snprintf(count_pos, sizeof(count_pos), "\x1b[%zu;%zuH", editor.window_rows, editor.window_cols - 10 - strlen(count));
+void RegisterClear(Register* reg) {
+    if (reg->lines == NULL)
+        return;
+    ArrayDestroy(reg->lines);
+    free(reg->lines);
+    reg->lines = NULL;
+}
 
-        StringAppend(count_message, count_pos);
-        StringAppend(count_message, count);
-    
-        write(STDOUT_FILENO, count_message->str, count_message->size);
-        StringDestroy(count_message);
+// make dst share the text of src
+void RegisterCopy(Register* dst, const Register* src) {
+    RegisterClear(dst);
+    dst->lines = ArrayInit();
+    ArrayReserve(dst->lines, src->lines->size);
+    for (size_t i = 0; i < src->lines->size; i++) {
+        ArrayAppend(dst->lines, StringRetain(src->lines->array[i]));
     }
+    dst->first_col = src->first_col;
+    dst->last_col = src->last_col;
+    dst->type = src->type;
+}
 
-    if (editor.mode != COMMAND_LINE) { // show cursor position when Command line mode is off
-        String* status_buffer = StringInit();
-        char status[40];
-        snprintf(status, sizeof(status), "%d,%d", editor.cur_line + 1, editor.cur_column + 1);
-        
-        char status_pos[20];
-        snprintf(status_pos, sizeof(status_pos), "\x1b[%zu;%zuH", editor.window_rows, editor.window_cols - 3 - strlen(status));
-    
-        StringAppend(status_buffer, status_pos);
-        StringAppend(status_buffer, status);
-    
-        write(STDOUT_FILENO, status_buffer->str, status_buffer->size);
+// Keys of a recorded macro or of the last change, special keys keep their enum values
+typedef struct
+{
+    size_t size;
+    size_t capacity;
+    int* keys;
+} KeyList;
+
+void KeyListAppend(KeyList* list, int key) {
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->keys = realloc(list->keys, list->capacity * sizeof(int));
+        if (list->keys == NULL) {
+            ShowError("Memory couldn't be allocated");
+        }
+    }
+    list->keys[list->size++] = key;
+}
 
-        StringDestroy(status_buffer);
+void KeyListCopy(KeyList* dst, const KeyList* src) {
+    dst->size = 0;
+    for (size_t i = 0; i < src->size; i++) {
+        KeyListAppend(dst, src->keys[i]);
     }
+}
 
-    StringDestroy(message);
+void KeyListDestroy(KeyList* list) {
+    free(list->keys);
+    list->keys = NULL;
+    list->size = list->capacity = 0;
 }
 
-void ShowWelcomeMessage() {
-    const char* message = "~ Welcome To notvim. Made with <3 By Abdullah ~";
-    int y_pos = (editor.window_rows / 2);
-    int x_pos = (editor.window_cols / 2) - strlen(message) / 2;
-
-    String* message_buffer = StringInit();
-    char message_pos[20];
-    snprintf(message_pos, 20, "\x1b[%d;%dH", y_pos, x_pos);
-    StringAppend(message_buffer, message_pos);
-    StringAppend(message_buffer, message);
+// :grep walks the paths and searches the files on a pool of threads, any thread lists a directory
+// or searches a file taken from a shared queue. Matches stream into the quickfix list as files finish
+enum GREP_ITEM {
+    GREP_FILE,
+    GREP_DIR
+};
 
-    write(STDOUT_FILENO, message_buffer->str, message_buffer->size);
+typedef struct
+{
+    String* path;
+    enum GREP_ITEM type;
+} GrepItem;
 
-    StringDestroy(message_buffer);
-}
+typedef struct
+{
+    size_t size;
+    size_t capacity;
+    GrepItem* items;
+} GrepQueue;
 
+typedef struct
+{
+    String* file; // owned by the files of the list
+    size_t line, column;
+} QuickfixEntry;
 
-void ShowTextFromBuffer() {
-    int highlight_visual = 0;
-    size_t st_l, st_c, en_l, en_c;
-    if (editor.mode == VISUAL) {
-        st_l = editor.v_start_line, st_c = editor.v_start_col;
-        en_l = editor.cur_line, en_c = editor.cur_column;
-        
-        if (en_l < st_l) {
-            swap(&st_l, &en_l);
-            swap(&st_c, &en_c);
-        } else if (en_l == st_l && en_c < st_c) {
-            swap(&st_c, &en_c);
-        }
-        if ((st_l != en_l) || (st_c != en_c)) {
-            highlight_visual = 1;
+typedef struct
+{
+    pthread_mutex_t lock; // guards the entries, the files and the queue while a search runs
+    pthread_cond_t wake; // the queue got items or the search is over
+    QuickfixEntry* entries;
+    size_t size, capacity;
+    Array* files;
+    long current; // entry :cn and :cp move from, -1 before the first jump
+    size_t reported; // matches shown in the status bar
+    int running;
+    int thread_count;
+    pthread_t threads[MAX_THREADS];
+    GrepQueue queue; // files and directories left to search
+    int busy; // threads working on an item, they may still queue more
+    atomic_int cancel;
+    atomic_size_t searched;
+    String* pattern;
+    char literal[64]; // text every match contains, looked up with memmem before running the regex
+    size_t literal_len;
+} Quickfix;
+
+void GrepQueuePush(GrepQueue* queue, String* path, enum GREP_ITEM type) {
+    if (queue->size == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->items = realloc(queue->items, queue->capacity * sizeof(GrepItem));
+        if (queue->items == NULL) {
+            ShowError("Memory couldn't be allocated");
         }
     }
+    queue->items[queue->size++] = (GrepItem){path, type};
+}
 
-    int lines_needed = 0;
-    String* lines = StringInit();
-    StringAppend(lines,  "\x1b[H");
-    for (size_t line = editor.start_line; line < array_buffer->size; line++) {
-        String* cur_line = array_buffer->array[line];
-
-        // calculate number of lines in the terminal needed to render the current line
-        int needed = (cur_line->size ? ceil_d(cur_line->size, editor.window_cols) : 1);
-
-        // stop rendering when the terminal is full
-        lines_needed += needed;
-        if (lines_needed >= (int)editor.window_rows) break;
-        
-        // mark the last line rendered
-        editor.end_line = line;
+// The literal text a pattern starts with, 0 if it starts with a special char.
+// Alternatives and groups don't need it, those patterns get none
+size_t GrepLiteral(const char* pattern, char* literal, size_t capacity) {
+    size_t len = 0;
+    if (strstr(pattern, "\\|") || strstr(pattern, "\\("))
+        return 0;
+    if (*pattern == '^') pattern++;
+    while (*pattern && strchr(".[*^$\\", *pattern) == NULL && len < capacity) {
+        literal[len++] = *pattern++;
+    }
+    // a repeat applies to the char before it, matches may not have that one
+    if (len > 0 && (*pattern == '*' || (*pattern == '\\' && pattern[1] && strchr("?+{", pattern[1])))) 
+        len--;
+    return len;
+}
 
-        StringAppend(lines ,"\x1b[K"); // clear 
+// Search a file, its matches (the first one of every line) are added together so they stay in order.
+// Lines are only matched with the regex around the places the literal shows up
+void GrepFile(Quickfix* qf, regex_t* regex, String* path) {
+    int fd = open(path->str, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) 
+        return;
 
-        // highlight selection in visual mode
-        if (highlight_visual && line == st_l && line == en_l) {
-            for (size_t c = 0; c < cur_line->size; c++) {
-                if (c == st_c) {
-                    StringAppend(lines, VISUAL_BG);
-                }
-                if (c == en_c) {
-                    StringAppend(lines, COLOR_RESET);
-                }
-                StringInsertChar(lines, lines->size, cur_line->str[c]);
-            }
-            if (en_c == cur_line->size) {
-                StringAppend(lines, COLOR_RESET);
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = file_stat.st_size;
+    char* text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) 
+        return;
+    atomic_fetch_add(&qf->searched, 1);
+
+    QuickfixEntry* found = NULL;
+    size_t count = 0, capacity = 0;
+
+    // like grep -I, a NUL near the start means a binary file
+    if (memchr(text, 0, (size < 4096) ? size : 4096) == NULL) {
+        madvise(text, size, MADV_SEQUENTIAL);
+        const char* end = text + size;
+        const char* p = text; // start of the next line to search
+        const char* counted = text; // newlines before it are counted in line
+        size_t line = 0;
+
+        while (p < end) {
+            const char* line_start = p;
+            if (qf->literal_len > 0) {
+                const char* hit = memmem(p, end - p, qf->literal, qf->literal_len);
+                if (hit == NULL) 
+                    break;
+                const char* newline = memrchr(p, '\n', hit - p);
+                line_start = newline ? newline + 1 : p;
             }
-            highlight_visual = 0;
-        } 
+            const char* line_end = memchr(line_start, '\n', end - line_start);
+            if (line_end == NULL) 
+                line_end = end;
+
+            regmatch_t match = {0, line_end - line_start};
+            if (regexec(regex, line_start, 1, &match, REG_STARTEND) == 0) {
+                for (const char* newline; (newline = memchr(counted, '\n', line_start - counted)) != NULL; counted = newline + 1) {
+                    line++;
+                }
 
-        else if (highlight_visual && line == st_l) {
-            for (size_t c = 0; c < cur_line->size; c++) {
-                if (c == st_c) {
-                    StringAppend(lines, VISUAL_BG);
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 16;
+                    found = realloc(found, capacity * sizeof(QuickfixEntry));
+                    if (found == NULL) {
+                        ShowError("Memory couldn't be allocated");
+                    }
                 }
-                StringInsertChar(lines, lines->size, cur_line->str[c]);
+                found[count++] = (QuickfixEntry){NULL, line, match.rm_so};
             }
-            StringAppend(lines, COLOR_RESET);
+            if (line_end == end || atomic_load(&qf->cancel)) 
+                break;
+            p = line_end + 1;
         }
-        else if (highlight_visual && line == en_l) {
-            StringAppend(lines, VISUAL_BG);
-            for (size_t c = 0; c < cur_line->size; c++) {
-                if (c == en_c) {
-                    StringAppend(lines, COLOR_RESET);
-                }
-                StringInsertChar(lines, lines->size, cur_line->str[c]);
-            }
-            if (en_c == cur_line->size) {
-                StringAppend(lines, COLOR_RESET);
-            }
-            highlight_visual = 0;
-        } 
-        else if (highlight_visual && line > st_l && line < en_l) {
-            StringAppend(lines, VISUAL_BG);
-            StringAppend(lines ,cur_line->str);
-            StringAppend(lines, COLOR_RESET);
-        } 
-        else { // no selection
-            StringAppend(lines ,cur_line->str);
+    }
+    munmap(text, size);
+    if (count == 0) 
+        return;
+
+    String* file = StringFromBuffer(path->str, path->size);
+    pthread_mutex_lock(&qf->lock);
+    ArrayAppend(qf->files, file);
+    if (qf->size + count > qf->capacity) {
+        qf->capacity = max(qf->capacity * 2, qf->size + count);
+        qf->entries = realloc(qf->entries, qf->capacity * sizeof(QuickfixEntry));
+        if (qf->entries == NULL) {
+            ShowError("Memory couldn't be allocated");
         }
-    
-        StringAppend(lines, "\r\n");
     }
-    write(STDOUT_FILENO ,lines->str, lines->size);
-    StringDestroy(lines);
+    for (size_t i = 0; i < count; i++) {
+        found[i].file = file;
+        qf->entries[qf->size++] = found[i];
+    }
+    pthread_mutex_unlock(&qf->lock);
+    free(found);
 }
 
-void ReadFileToBuffer(const char *filename) { 
-    
-    // change the global state for the file
-    editor.file_opened = 1;
-    StringAssign(editor.file_name, filename);
-    StringAssign(editor.status_message, filename);
-    
-    FILE *fptr;
-    char* buffer = NULL; 
-    size_t len;
-
-    // Open the file in read mode
-    fptr = fopen(filename, "r");
-
-    if (fptr == NULL) { // The file doesn't exist
-        s_ArrayAppend(array_buffer ,"");
+// Queue what a directory holds. Hidden entries (.git and such) are skipped, links are only followed to files
+void GrepDirectory(Quickfix* qf, String* path) {
+    DIR* dir = opendir(path->str);
+    if (dir == NULL) 
         return;
-    }
 
-    int last_line = 1;
-    while (getline(&buffer, &len, fptr) != -1) {
-        size_t sz = strlen(buffer);
-        if (buffer[sz-1] == '\n') {
-            buffer[strlen(buffer) - 1] = '\0';
-        } else {
-            last_line = 0;
+    GrepQueue children = {0, 0, NULL};
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && !atomic_load(&qf->cancel)) {
+        if (entry->d_name[0] == '.') 
+            continue;
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat file_stat;
+            if (fstatat(dirfd(dir), entry->d_name, &file_stat, (type == DT_LNK) ? 0 : AT_SYMLINK_NOFOLLOW) == -1) 
+                continue;
+            if (S_ISREG(file_stat.st_mode)) 
+                type = DT_REG;
+            else if (S_ISDIR(file_stat.st_mode) && type == DT_UNKNOWN) 
+                type = DT_DIR;
         }
-
-        s_ArrayAppend(array_buffer, buffer);
+        if (type != DT_REG && type != DT_DIR) 
+            continue;
+
+        String* child = StringInit();
+        if (strcmp(path->str, ".") != 0) {
+            StringAppendN(child, path->str, path->size);
+            if (path->str[path->size - 1] != '/') 
+                StringAppend(child, "/");
+        }
+        StringAppend(child, entry->d_name);
+        GrepQueuePush(&children, child, (type == DT_DIR) ? GREP_DIR : GREP_FILE);
     }
+    closedir(dir);
 
-    if (last_line) {
-        s_ArrayAppend(array_buffer, "");
+    pthread_mutex_lock(&qf->lock);
+    for (size_t i = 0; i < children.size; i++) {
+        GrepQueuePush(&qf->queue, children.items[i].path, children.items[i].type);
     }
-    fclose(fptr);
+    pthread_cond_broadcast(&qf->wake);
+    pthread_mutex_unlock(&qf->lock);
+    free(children.items);
 }
 
-void EditorClearScreen() {
-    DrawTildes();
-    StatusBar();
-    if (!editor.file_opened && !editor.buffer_modified) {
-        ShowWelcomeMessage();
-    }
-    ShowTextFromBuffer();
-    char cursor_pos[20];
-    if (editor.mode == COMMAND_LINE) {
-        snprintf(cursor_pos, sizeof(cursor_pos), "\x1b[%zu;%dH", editor.window_rows, editor.command_cursor_pos + 3);
-    } else {
-        snprintf(cursor_pos, sizeof(cursor_pos), "\x1b[%d;%dH", editor.cursor_y, editor.cursor_x);
-    }
-    write(STDOUT_FILENO, cursor_pos, strlen(cursor_pos));
-}
+// Take items until the queue is empty and no thread can add more
+void* GrepWorker(void* arg) {
+    Quickfix* qf = arg;
 
-int EditorReadKey() {
-    int read_ret;
-    char c;
-   
-    if ((read_ret = read(STDIN_FILENO, &c, 1)) == 0) return -1;
+    // threads matching with the same compiled regex take turns, so every thread compiles its own
+    regex_t regex;
+    if (regcomp(&regex, qf->pattern->str, 0) != 0) 
+        return NULL;
 
-    if (read_ret == -1 && errno != EAGAIN) {
-        ShowError("read");
-    }
-    if (c == ESC) {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return ESC;
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return ESC;
+    pthread_mutex_lock(&qf->lock);
+    while (1) {
+        while (qf->queue.size == 0 && qf->busy > 0 && !atomic_load(&qf->cancel)) {
+            pthread_cond_wait(&qf->wake, &qf->lock);
+        }
+        if (qf->queue.size == 0 || atomic_load(&qf->cancel)) 
+            break;
 
-        if (seq[0] == '[') {
-            switch (seq[1]) {
-                case 'A': return CURSOR_UP;
-                case 'B': return CURSOR_DOWN;
-                case 'C': return CURSOR_RIGHT;
-                case 'D': return CURSOR_LEFT;
-                case 'H': return HOME;
-                case 'F': return END;
-            }
-            if (seq[1] >= '1' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return ESC;
+        GrepItem item = qf->queue.items[--qf->queue.size];
+        qf->busy++;
+        pthread_mutex_unlock(&qf->lock);
 
-                if (seq[2] == '~' && seq[1] == '5') return PAGE_UP;
-                else if (seq[2] == '~' && seq[1] == '6') return PAGE_DOWN;
-                else if (seq[2] == '~' && seq[1] == '3') return DELETE;
-                else return ESC;
-            }
-        }
-        return ESC;
+        if (item.type == GREP_DIR) 
+            GrepDirectory(qf, item.path);
+        else 
+            GrepFile(qf, &regex, item.path);
+        StringDestroy(item.path);
+
+        pthread_mutex_lock(&qf->lock);
+        qf->busy--;
+        if (qf->busy == 0 && qf->queue.size == 0) 
+            pthread_cond_broadcast(&qf->wake);
     }
-    return c;
+    pthread_mutex_unlock(&qf->lock);
+    regfree(&regex);
+    return NULL;
 }
 
-void CalculateCursorX() {
-    editor.cursor_x = (editor.cur_column % editor.window_cols) + 1;
+// by file, then line
+int CompareQuickfixEntries(const void* a, const void* b) {
+    const QuickfixEntry* x = a, *y = b;
+    int order = strcmp(x->file->str, y->file->str);
+    if (order != 0) 
+        return order;
+    return (x->line > y->line) - (x->line < y->line);
 }
 
-void CalculateCursorY() {
-    editor.cursor_y = 1;
-    for (int line = editor.start_line; line < editor.cur_line; line++) {
-        String* cur_line = array_buffer->array[line];
-        // number of lines needed to render a line
-        int needed = (cur_line->size ? ceil_d(cur_line->size, editor.window_cols) : 1);
-        
-        editor.cursor_y += needed;
-    }
-    editor.cursor_y += (editor.cur_column / editor.window_cols);
-
+void QuickfixInit(Quickfix* qf) {
+    pthread_mutex_init(&qf->lock, NULL);
+    pthread_cond_init(&qf->wake, NULL);
+    qf->entries = NULL;
+    qf->size = qf->capacity = 0;
+    qf->files = ArrayInit();
+    qf->current = -1;
+    qf->reported = 0;
+    qf->running = 0;
+    qf->queue = (GrepQueue){0, 0, NULL};
+    qf->busy = 0;
+    qf->pattern = StringInit();
 }
 
-void ScrollUp() {
-    if (editor.start_line > 0 && editor.cursor_y <= 5) { // scroll up
-        editor.cur_line--;
-        editor.start_line--;
-        editor.end_line--;
-    } else {
-        editor.cur_line--;
+// Join the threads of a search that is over or cancelled
+void JoinGrep(Quickfix* qf) {
+    for (int i = 0; i < qf->thread_count; i++) {
+        pthread_join(qf->threads[i], NULL);
     }
-}
-
-void ScrollDown() {
-    if (((array_buffer->size) >= editor.window_rows) && (editor.end_line + 1) < ((int)array_buffer->size) &&  editor.cursor_y >= ((int)editor.window_rows - 6)) { // scroll down
-        editor.cur_line++;
-        editor.start_line++;
-        editor.end_line++;
-    } else {
-        editor.cur_line++;
+    for (size_t i = 0; i < qf->queue.size; i++) {
+        StringDestroy(qf->queue.items[i].path);
     }
+    qf->queue.size = 0;
+    qf->running = 0;
 }
 
-void GoToFileEnd() {
-    if (array_buffer->size <= 1) 
+void StopGrep(Quickfix* qf) {
+    if (!qf->running) 
         return;
+    atomic_store(&qf->cancel, 1);
+    pthread_mutex_lock(&qf->lock);
+    pthread_cond_broadcast(&qf->wake);
+    pthread_mutex_unlock(&qf->lock);
+    JoinGrep(qf);
+}
 
-    editor.start_line = editor.cur_line = array_buffer->size - 1; // in case of the number of lines is less than window size
+void QuickfixClear(Quickfix* qf) {
+    StopGrep(qf);
+    qf->size = 0;
+    qf->current = -1;
+    qf->reported = 0;
+    ArrayDestroy(qf->files);
+    free(qf->files);
+    qf->files = ArrayInit();
+}
 
-    int lines_needed = 0;
-    while (editor.start_line) {
-        String* cur_line = array_buffer->array[editor.start_line];
+void QuickfixDestroy(Quickfix* qf) {
+    StopGrep(qf);
+    free(qf->entries);
+    ArrayDestroy(qf->files);
+    free(qf->files);
+    free(qf->queue.items);
+    StringDestroy(qf->pattern);
+    pthread_mutex_destroy(&qf->lock);
+    pthread_cond_destroy(&qf->wake);
+}
 
-        // calculate number of lines in the terminal needed to render the current line
-        int needed = (cur_line->size ? ceil_d(cur_line->size, editor.window_cols) : 1);
-        lines_needed += needed;
+// Start searching paths for an already checked pattern, the matches replace the list.
+// Returns 0 if none of the paths exists
+int StartGrep(Quickfix* qf, const char* pattern, Array* paths) {
+    QuickfixClear(qf);
+    StringAssign(qf->pattern, pattern);
+    qf->literal_len = GrepLiteral(pattern, qf->literal, sizeof(qf->literal));
+
+    for (size_t i = 0; i < paths->size; i++) {
+        struct stat file_stat;
+        if (stat(paths->array[i]->str, &file_stat) == -1 || !(S_ISREG(file_stat.st_mode) || S_ISDIR(file_stat.st_mode))) 
+            continue;
+        GrepQueuePush(&qf->queue, StringDuplicate(paths->array[i]), S_ISDIR(file_stat.st_mode) ? GREP_DIR : GREP_FILE);
+    }
+    if (qf->queue.size == 0) 
+        return 0;
 
-        if (lines_needed + 1 >= (int)editor.window_rows)
-            break;
-        editor.start_line--;
+    atomic_store(&qf->cancel, 0);
+    atomic_store(&qf->searched, 0);
+    qf->busy = 0;
+    qf->running = 1;
+    qf->thread_count = 0;
+    int threads = ThreadCount(MAX_THREADS, 1);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&qf->threads[qf->thread_count], NULL, GrepWorker, qf) == 0) 
+            qf->thread_count++;
     }
-    
-    editor.cur_column = editor.max_column = 0;
-    CalculateCursorX();
-    CalculateCursorY();
+    if (qf->thread_count == 0) 
+        GrepWorker(qf);
+    return 1;
 }
 
-void GoToFileStart() {
-    if (array_buffer->size == 0) 
-        return;
+// Folds are intervals of lines kept sorted by start (outer folds first on a tie) in an array read as a
+// balanced tree: the root of [lo, hi) is at (lo + hi) / 2. Every node keeps the largest end of a closed
+// fold in its subtree, so the outermost closed fold holding a line is found in O(log n)
+typedef struct
+{
+    int start, end; // first and last line, both included
+    int closed;
+    int max_end; // largest end of a closed fold in the subtree, -1 if none
+} Fold;
 
-    editor.start_line = editor.cur_line = 0; // in case of the number of lines is less than window size
-    editor.cur_column = editor.max_column = 0;
-    CalculateCursorX();
-    CalculateCursorY();
+typedef struct
+{
+    size_t size;
+    size_t capacity;
+    Fold* folds;
+} FoldTree;
+
+int CompareFolds(const void* a, const void* b) {
+    const Fold* x = a, *y = b;
+    if (x->start != y->start) 
+        return (x->start > y->start) - (x->start < y->start);
+    return (x->end < y->end) - (x->end > y->end);
 }
 
-void MoveCursorAndScroll(int move) {
-    if (array_buffer->size == 0) return;
-    String* cur_line = array_buffer->array[editor.cur_line];
+// Recompute max_end of the subtree [lo, hi), only along the path to node when it's in range
+int FoldTreeFix(FoldTree* tree, size_t lo, size_t hi, size_t node) {
+    if (lo >= hi) 
+        return -1;
+
+    size_t mid = (lo + hi) / 2;
+    Fold* fold = &tree->folds[mid];
+    int left = (lo < mid) ? tree->folds[(lo + mid) / 2].max_end : -1;
+    int right = (mid + 1 < hi) ? tree->folds[(mid + 1 + hi) / 2].max_end : -1;
+    if (node >= hi || node < mid) 
+        left = FoldTreeFix(tree, lo, mid, node);
+    if (node >= hi || node > mid) 
+        right = FoldTreeFix(tree, mid + 1, hi, node);
+
+    fold->max_end = max(fold->closed ? fold->end : -1, max(left, right));
+    return fold->max_end;
+}
 
-    switch (move)
-    {
-    case CURSOR_UP:
-    case 'k':
-        if (editor.cur_line > 0) {
-            ScrollUp();
-            cur_line = array_buffer->array[editor.cur_line];
-        }
-        break;
-    case CURSOR_DOWN:
-    case 'j':
-        if (editor.cur_line < ((int)array_buffer->size - 1)) {
-            ScrollDown();
-            cur_line = array_buffer->array[editor.cur_line];
-        }
-        break;
-    case CURSOR_RIGHT:
-    case 'l':
-        cur_line = array_buffer->array[editor.cur_line];
-        if (editor.cur_column < (int)cur_line->size)
-            editor.max_column = editor.cur_column + 1;
-        else if ((editor.cur_line + 1) < (int)array_buffer->size) {
-            MoveCursorAndScroll(CURSOR_DOWN);
-            cur_line = array_buffer->array[editor.cur_line];
-            editor.max_column = 0;
-        }
-        break;
-    case CURSOR_LEFT:
-    case 'h':
-        if (editor.cur_column > 0)
-            editor.max_column = editor.cur_column - 1;
-        else if (editor.cur_line > 0) {
-            MoveCursorAndScroll(CURSOR_UP);
-            cur_line = array_buffer->array[editor.cur_line];
-            editor.max_column = cur_line->size;
-        }
-        break;
-    case PAGE_UP:
-        for (size_t i = 0; i < editor.window_rows; i++) {
-            MoveCursorAndScroll(CURSOR_UP);
-        }
-        cur_line = array_buffer->array[editor.cur_line];
-        break;
-    case PAGE_DOWN:
-        for (size_t i = 0; i < editor.window_rows; i++) {
-            MoveCursorAndScroll(CURSOR_DOWN);
-        }
-        cur_line = array_buffer->array[editor.cur_line];
-        break;
-    case HOME:
-        editor.max_column = 0;
-        break;
-    case END:
-        editor.max_column = cur_line->size;
-        break;
-    default:
-        ShowError("Not a valid move");
-        break;
+// Sort the folds again after they were added to or moved, dropping empty and repeated ones
+void FoldTreeBuild(FoldTree* tree) {
+    qsort(tree->folds, tree->size, sizeof(Fold), CompareFolds);
+    size_t kept = 0;
+    for (size_t i = 0; i < tree->size; i++) {
+        Fold* fold = &tree->folds[i];
+        if (fold->end < fold->start) 
+            continue;
+        if (kept > 0 && tree->folds[kept - 1].start == fold->start && tree->folds[kept - 1].end == fold->end) 
+            continue;
+        tree->folds[kept++] = *fold;
     }
-    editor.cur_column = min(editor.max_column, cur_line->size);
-
-    CalculateCursorX();
-    CalculateCursorY();
-
+    tree->size = kept;
+    FoldTreeFix(tree, 0, tree->size, tree->size);
 }
 
-void MoveForward() {
-    int found_separtor = 0;
-    while ((editor.cur_line + 1) < (int)array_buffer->size || (editor.cur_column + 1) < (int)array_buffer->array[editor.cur_line]->size) {
-        char c = array_buffer->array[editor.cur_line]->str[editor.cur_column];
-        if (!IsKeyword(c)) {
-            found_separtor = 1;
+// Lines moved under the folds: that keeps their starts in order, so they're only sorted again
+// when one lost all its lines or two ended up the same
+void FoldTreeMoved(FoldTree* tree) {
+    for (size_t i = 0; i < tree->size; i++) {
+        const Fold* fold = &tree->folds[i];
+        if (fold->end < fold->start || (i > 0 && CompareFolds(&tree->folds[i - 1], fold) >= 0)) {
+            FoldTreeBuild(tree);
+            return;
         }
-        if (found_separtor && IsKeyword(c)) {
-            break;
+    }
+    FoldTreeFix(tree, 0, tree->size, tree->size);
+}
+
+void FoldTreeAdd(FoldTree* tree, int start, int end, int closed) {
+    if (tree->size == tree->capacity) {
+        tree->capacity = tree->capacity ? tree->capacity * 2 : 16;
+        tree->folds = realloc(tree->folds, tree->capacity * sizeof(Fold));
+        if (tree->folds == NULL) {
+            ShowError("Memory couldn't be allocated");
         }
-        MoveCursorAndScroll(CURSOR_RIGHT);
     }
+    tree->folds[tree->size++] = (Fold){start, end, closed, -1};
 }
 
-void MoveBackward() {
-    int found_separtor = 0;
-    while (editor.cur_line > 0 || editor.cur_column > 0) {
-        char c = array_buffer->array[editor.cur_line]->str[editor.cur_column];
-        if (!IsKeyword(c)) {
-            found_separtor = 1;
+// The outermost closed fold holding line, -1 if there is none
+long FoldTreeClosedAt(const FoldTree* tree, int line) {
+    size_t lo = 0, hi = tree->size;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const Fold* fold = &tree->folds[mid];
+        if (fold->start > line) { // so do the ones after it
+            hi = mid;
+            continue;
         }
-        if (found_separtor && IsKeyword(c)) {
-            break;
+        // a closed fold on the left reaching line holds it and starts before this one
+        if (lo < mid && tree->folds[(lo + mid) / 2].max_end >= line) {
+            hi = mid;
+            continue;
         }
-        MoveCursorAndScroll(CURSOR_LEFT);
+        if (fold->closed && fold->end >= line) 
+            return mid;
+        lo = mid + 1;
     }
+    return -1;
 }
 
-void Motion(int key) {
-    switch (key)
-    {
-    case 'g':   
-        GoToFileStart();
-        break;
-    case 'G':
-        GoToFileEnd();
-        break;
-    case 'w':
-        editor.motion_count = max(1, editor.motion_count);
-        for (int i = 0; i < editor.motion_count; i++) {
+// The innermost fold holding line that is open (or any, with closed set), -1 if there is none
+long FoldTreeInnermost(const FoldTree* tree, int line, int closed) {
+    size_t lo = 0, hi = tree->size;
+    while (lo < hi) { // past the last fold starting at or before line
+        size_t mid = (lo + hi) / 2;
+        if (tree->folds[mid].start <= line) 
+            lo = mid + 1;
+        else 
+            hi = mid;
+    }
+    for (size_t i = lo; i-- > 0; ) {
+        const Fold* fold = &tree->folds[i];
+        if (fold->end >= line && (closed || !fold->closed)) 
+            return i;
+    }
+    return -1;
+}
+
+void FoldTreeClear(FoldTree* tree) {
+    tree->size = 0;
+}
+
+void FoldTreeDestroy(FoldTree* tree) {
+    free(tree->folds);
+    tree->folds = NULL;
+    tree->size = tree->capacity = 0;
+}
+
+// Editor Modes
+enum MODE {
+    NORMAL = 0,
+    INSERT,
+    COMMAND_LINE,
+    VISUAL,
+    VISUAL_LINE,
+    VISUAL_BLOCK
+};
+
+// The words of a buffer for Ctrl-N and Ctrl-P: its keyword tokens in a trie. A node counts the occurrences
+// of the word ending at it and the distinct words under it, so the n-th word after a prefix is found on the
+// way down. Nodes stay when their word goes away, the trie only grows with words it hasn't seen.
+// It's built with the first completion in the buffer
+#define WORD_MIN 2 // shorter tokens aren't worth completing
+#define WORD_MAX 48 // longer ones are ids and blobs, they'd fill the trie
+#define WORD_MAX_NODES (1 << 21) // new words are left out past it
+#define WORD_SCAN_LINES (1 << 20) // lines around the cursor indexed in a file read through its mapping or from stdin
+#define WORD_WAIT_LINES 100000 // the first completion waits for the index of a buffer this small
+
+typedef struct
+{
+    int child, sibling; // first child and the next one in letter order, 0 for none. Node 0 is the root
+    int count; // occurrences of the word ending here
+    int words; // distinct words in the subtree
+    char letter;
+} WordNode;
+
+typedef struct
+{
+    WordNode* nodes;
+    size_t size, capacity;
+    int pending; // line being changed in place, its words are counted again with the next change. -1 if none
+    Array* snapshot; // the lines a thread is counting, NULL once it's done
+    Array* added, *removed; // lines counted in and out meanwhile, they're applied when the thread is done
+} WordIndex;
+
+#define TABLE_SAMPLE 64 // lines measured when a table is shown, from the top and spread through the file
+#define TABLE_MAX_WIDTH 40 // longer fields are cut
+#define TABLE_CACHE 512 // lines whose fields are kept
+#define TABLE_GAP 3 // " | " between columns
+
+// Where the fields of a line start, kept in the slot of its line number until the line changes
+typedef struct
+{
+    int line; // -1 if the slot is free
+    int count, capacity;
+    int* starts;
+} TableRow;
+
+// The table view of a delimited file: lines are split at the delimiter outside double quotes and
+// every column is as wide as its widest field seen so far, no pass over the whole file is made
+typedef struct
+{
+    char delimiter;
+    int* widths;
+    int columns, capacity;
+    unsigned long tick; // bumped when a column widens, the windows showing the table are drawn again
+    TableRow rows[TABLE_CACHE];
+} Table;
+
+// Formats a file is read and saved in, the compressed ones go through the gzip and zstd commands
+enum COMPRESSION {
+    UNCOMPRESSED = 0,
+    GZIP,
+    ZSTD
+};
+
+// A file of the buffer list. The buffer of the active window keeps its state in the editor fields
+// and array_buffer, the others keep it here. Lines are read when the buffer is first shown,
+// a buffer no window shows drops them again while they match the file
+typedef struct
+{
+    int number; // as :ls and :b know it
+    Array* lines; // NULL while they aren't in memory
+    String* file_name;
+    int file_opened, from_stdin;
+    int buffer_modified, dirty_line;
+    struct stat disk_stat;
+    int disk_stat_valid;
+    int watch_fd;
+    enum COMPRESSION compression;
+    FoldTree folds;
+    int changed_line, changed_end;
+    int last_line, last_column, last_start; // view when it was last shown
+    char* mapped; // the file, for lines built from its cached index. Never unmapped, registers may borrow from it
+    size_t mapped_size;
+    struct stat mapped_stat;
+    int mapping; // slot of the mapping in mapped_files
+    WordIndex* words; // NULL while the lines aren't in memory
+    Table* table; // NULL if the buffer isn't shown as a table
+} Buffer;
+
+// What a window shows on the terminal, the next frame is compared with it to send only what changed
+typedef struct
+{
+    int valid; // 0 forces a full repaint
+    int start_line;
+    int text_rows; // rows taken by lines, tildes fill the rest of the text area
+    int end_line, to_end; // last line drawn, the end of the buffer was in view
+    enum MODE mode;
+    size_t window_rows, window_cols;
+    int top, left;
+    int welcome;
+    int v_start_line, v_start_col, cur_line, cur_column; // the selection of visual modes
+    unsigned long table_tick; // of the table drawn, 0 if none
+    int table_left;
+    String* status; // status line of the window as sent, shown when the screen is split
+} Frame;
+
+// A view on the buffer. The active window keeps its view in the editor fields, the others keep it here
+typedef struct
+{
+    int start_line, end_line;
+    int cur_line, cur_column, max_column;
+    int cursor_x, cursor_y;
+    int table_left;
+    int top, left; // screen position, from 0
+    size_t rows, cols; // text area and status line, a vertical separator comes right of cols
+    Frame frame;
+    Buffer* buffer;
+    struct Layout* node;
+} Window;
+
+// The screen split into windows: a node stacks its children or puts them side by side,
+// they share its area equally. Windows are the leaves
+typedef struct Layout
+{
+    struct Layout* parent;
+    struct Layout** children;
+    size_t size;
+    int vertical; // children side by side
+    Window* window; // leaves only
+} Layout;
+
+// A run of lines that differs between the two sides of a diff, a side without lines
+// in it has the other side's lines missing before its line start
+typedef struct
+{
+    int start[2], count[2];
+} DiffHunk;
+
+// Diff mode compares two buffers, or a buffer with its file on disk
+typedef struct
+{
+    Buffer* side[2]; // side[1] is NULL when side[0] is compared with its file
+    Array* disk; // the lines of the file then
+    struct stat disk_stat;
+    DiffHunk* hunks; // in line order on both sides
+    size_t size, capacity;
+    int stale; // lines changed since the hunks were made
+} Diff;
+
+void DiffClear(Diff* diff) {
+    if (diff->disk) {
+        ArrayDestroy(diff->disk);
+        free(diff->disk);
+    }
+    free(diff->hunks);
+    memset(diff, 0, sizeof(Diff));
+}
+
+// Editor Configuration
+typedef struct
+{
+    struct termios default_term;
+    enum MODE mode;
+    size_t screen_rows, screen_cols;
+    size_t window_rows, window_cols; // the active window, its status line included
+    int cursor_x, cursor_y;
+    int file_opened;
+    int from_stdin; // the buffer holds what was read from stdin
+    int buffer_modified;
+    int dirty_line; // lowest line changed since the file was read or saved, -1 if none
+    struct stat disk_stat; // the file as it was when read or saved
+    int disk_stat_valid;
+    int watch_fd; // inotify instance watching the directory of the file
+    enum COMPRESSION compression; // the format the file was read in, it's saved in it too
+    int compress_level; // :set complevel, 0 for the compressor's default
+    int start_line, end_line;
+    int cur_line, cur_column;
+    int max_column;
+    String* status_message;
+    String* file_name;
+    String* command;
+    Register registers[REGISTER_COUNT];
+    int register_name; // register picked with " for the next yank or paste, 0 is the unnamed one
+    int pending_key; // first key of a two key command, 0 if none
+    int block_line, block_bottom; // lines getting the text typed after a block I or A, block_bottom is -1 if none
+    int block_column, block_pad;
+    size_t block_line_size; // size of block_line before the typing started
+    KeyList macros[REGISTER_COUNT];
+    int recording; // register recorded into with q, -1 if none
+    int last_macro; // register replayed by @@, -1 if none
+    KeyList change; // keys typed since normal mode was last idle
+    KeyList last_change; // keys repeated by .
+    unsigned long change_tick; // counts buffer edits
+    unsigned long change_start_tick;
+    int change_open;
+    int replaying; // keys come from a macro or ., the view is fixed up once at the end
+    Frame frame;
+    Layout* layout;
+    Window** windows; // in screen order
+    size_t window_count;
+    Window* window; // the active one
+    Buffer** buffers;
+    size_t buffer_count;
+    Buffer* buffer; // the one in the editor fields
+    Buffer* stdin_buffer; // NULL if stdin isn't read
+    int last_buffer_number;
+    int changed_line, changed_end; // lines changed or moved since the last frame, changed_line is INT_MAX if none
+    Buffer* compact_buffer; // where the idle compaction is, it starts over in another buffer
+    size_t compact_next;
+    int idle_ticks; // WaitForInput timeouts since the last key
+    String* shown_status; // status bar as sent
+    String* shown_cursor; // cursor position as sent
+    String* last_pattern; // of the last :s or :g, an empty pattern stands for it
+    Quickfix quickfix; // :grep matches
+    Diff diff;
+    FoldTree folds;
+    WordIndex* words;
+    Table* table;
+    int table_left; // first column of the table in the window
+    String* completion; // the prefix Ctrl-N and Ctrl-P complete, NULL before the first completion
+    int completion_line, completion_start, completion_end, completion_choice; // choice -1 when nothing matched
+    unsigned long completion_tick; // change_tick after the completed word went in, typing ends the completion
+    int headless; // batch mode, no terminal
+    int quit; // set by :q in batch mode instead of exiting
+    int command_failed; // a command reported an error
+    int command_cursor_pos;
+    int motion_count;
+    int v_start_line;
+    int v_start_col;
+} Editor;
+
+_Thread_local Editor editor;
+
+// The child of a node for a letter, made if create is set. Returns 0 if there is none
+int WordChild(WordIndex* index, int node, char letter, int create) {
+    int prev = -1, next = index->nodes[node].child;
+    while (next != 0 && index->nodes[next].letter < letter) {
+        prev = next;
+        next = index->nodes[next].sibling;
+    }
+    if (next != 0 && index->nodes[next].letter == letter)
+        return next;
+    if (!create || index->size == WORD_MAX_NODES)
+        return 0;
+
+    if (index->size == index->capacity) {
+        index->capacity *= 2;
+        index->nodes = realloc(index->nodes, index->capacity * sizeof(WordNode));
+        if (index->nodes == NULL) {
+            ShowError("Memory couldn't be allocated");
+        }
+    }
+    int added = index->size++;
+    index->nodes[added] = (WordNode){0, next, 0, 0, letter};
+    if (prev == -1)
+        index->nodes[node].child = added;
+    else
+        index->nodes[prev].sibling = added;
+    return added;
+}
+
+// Count an occurrence of a word in (sign 1) or out (-1)
+void WordCount(WordIndex* index, const char* word, size_t len, int sign) {
+    int node = 0;
+    for (size_t i = 0; i < len; i++) {
+        node = WordChild(index, node, word[i], sign > 0);
+        if (node == 0)
+            return;
+    }
+    WordNode* end = &index->nodes[node];
+    if (sign < 0 && end->count == 0)
+        return;
+    end->count += sign;
+    if (end->count != (sign > 0))
+        return;
+
+    // the word appeared or went away, so it does in the subtrees on its way
+    index->nodes[0].words += sign;
+    node = 0;
+    for (size_t i = 0; i < len; i++) {
+        node = WordChild(index, node, word[i], 0);
+        index->nodes[node].words += sign;
+    }
+}
+
+void WordCountLine(WordIndex* index, const String* line, int sign) {
+    const char* text = line->str;
+    for (size_t i = 0; i < line->size; ) {
+        if (!IsKeyword(text[i])) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < line->size && IsKeyword(text[i])) i++;
+        if (i - start >= WORD_MIN && i - start <= WORD_MAX)
+            WordCount(index, &text[start], i - start, sign);
+    }
+}
+
+// The word index of a buffer is built on a thread from a snapshot of its lines, one at a time
+typedef struct
+{
+    pthread_t thread;
+    int running;
+    atomic_int done;
+    atomic_int cancel; // the index is dropped, the thread stops at the next line
+    WordIndex* index;
+} WordJob;
+
+_Thread_local WordJob word_job;
+
+void* WordWorker(void* arg) {
+    WordJob* job = arg;
+    Array* lines = job->index->snapshot;
+    for (size_t i = 0; i < lines->size && !atomic_load(&job->cancel); i++) {
+        WordCountLine(job->index, lines->array[i], 1);
+    }
+    atomic_store(&job->done, 1);
+    return NULL;
+}
+
+void WordsDropSnapshot(WordIndex* index) {
+    Array* arrays[3] = {index->snapshot, index->added, index->removed};
+    for (int i = 0; i < 3; i++) {
+        ArrayDestroy(arrays[i]);
+        free(arrays[i]);
+    }
+    index->snapshot = index->added = index->removed = NULL;
+}
+
+// the lines that changed while the thread ran are counted once it's done
+void WordsCatchUp(WordIndex* index) {
+    for (size_t i = 0; i < index->added->size; i++) {
+        WordCountLine(index, index->added->array[i], 1);
+    }
+    for (size_t i = 0; i < index->removed->size; i++) {
+        WordCountLine(index, index->removed->array[i], -1);
+    }
+    WordsDropSnapshot(index);
+}
+
+// Finish the index when the thread is done, waiting for it if wait is set
+void FinishWords(int wait) {
+    WordJob* job = &word_job;
+    if (!job->running || (!wait && !atomic_load(&job->done)))
+        return;
+    pthread_join(job->thread, NULL);
+    job->running = 0;
+    WordsCatchUp(job->index);
+}
+
+void WordIndexDestroy(WordIndex* index) {
+    if (index == NULL)
+        return;
+    if (word_job.running && word_job.index == index) {
+        atomic_store(&word_job.cancel, 1);
+        pthread_join(word_job.thread, NULL);
+        word_job.running = 0;
+    }
+    if (index->snapshot != NULL)
+        WordsDropSnapshot(index);
+    free(index->nodes);
+    free(index);
+}
+
+// Stop the thread and drop the index it was building, the next completion in its buffer starts over
+void CancelWords() {
+    WordJob* job = &word_job;
+    if (!job->running)
+        return;
+    WordIndex* index = job->index;
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        if (editor.buffers[i]->words == index)
+            editor.buffers[i]->words = NULL;
+    }
+    if (editor.words == index)
+        editor.words = NULL;
+    WordIndexDestroy(index);
+}
+
+// Start indexing the words of the buffer in the editor fields
+void StartWords() {
+    CancelWords();
+    WordIndex* index = malloc(sizeof(WordIndex));
+    if (index == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    index->capacity = 1024;
+    index->nodes = malloc(index->capacity * sizeof(WordNode));
+    if (index->nodes == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    index->nodes[0] = (WordNode){0, 0, 0, 0, 0};
+    index->size = 1;
+    index->pending = -1;
+
+    // a large file read through its mapping or from stdin is only paged in where it's looked at,
+    // the lines around the cursor are indexed instead of all of it
+    size_t first = 0, last = array_buffer->size;
+    if ((editor.buffer->mapped || editor.from_stdin) && array_buffer->size > WORD_SCAN_LINES) {
+        first = ((size_t)editor.cur_line > WORD_SCAN_LINES / 2) ? editor.cur_line - WORD_SCAN_LINES / 2 : 0;
+        if (first > array_buffer->size - WORD_SCAN_LINES)
+            first = array_buffer->size - WORD_SCAN_LINES;
+        last = first + WORD_SCAN_LINES;
+    }
+
+    // the snapshot holds a reference to every line, edits clone them instead of changing them under the thread
+    index->snapshot = ArrayInit();
+    ArrayReserve(index->snapshot, last - first);
+    for (size_t i = first; i < last; i++) {
+        index->snapshot->array[i - first] = StringRetain(array_buffer->array[i]);
+    }
+    index->snapshot->size = last - first;
+    index->added = ArrayInit();
+    index->removed = ArrayInit();
+    editor.words = index;
+
+    WordJob* job = &word_job;
+    job->index = index;
+    atomic_store(&job->done, 0);
+    atomic_store(&job->cancel, 0);
+    job->running = (pthread_create(&job->thread, NULL, WordWorker, job) == 0);
+    if (!job->running) {
+        WordWorker(job);
+        WordsCatchUp(index);
+    }
+}
+
+// The array functions report the lines they add, remove or change in place, the words of the buffer follow them
+void WordsCounted(Array* array, String* line, int sign) {
+    WordIndex* index = editor.words;
+    if (array != array_buffer || index == NULL)
+        return;
+    if (index->snapshot != NULL)
+        ArrayAppend((sign > 0) ? index->added : index->removed, StringRetain(line));
+    else
+        WordCountLine(index, line, sign);
+}
+
+// the line changed in place last is counted again, before lines move
+void WordsFlush(Array* array) {
+    WordIndex* index = editor.words;
+    if (array != array_buffer || index == NULL || index->pending == -1)
+        return;
+    int pending = index->pending;
+    index->pending = -1;
+    if ((size_t)pending < array->size)
+        WordsCounted(array, array->array[pending], 1);
+}
+
+// a line is about to change in place, its words are counted out until the next change
+void WordsEditing(Array* array, size_t pos) {
+    WordIndex* index = editor.words;
+    if (array != array_buffer || index == NULL || index->pending == (int)pos)
+        return;
+    WordsFlush(array);
+    WordsCounted(array, array->array[pos], -1);
+    index->pending = pos;
+}
+
+// The lines [first, last] changed, their fields are split again
+void TableForget(Table* table, int first, int last) {
+    for (int i = 0; i < TABLE_CACHE; i++) {
+        if (table->rows[i].line >= first && table->rows[i].line <= last) 
+            table->rows[i].line = -1;
+    }
+}
+
+void TableDestroy(Table* table) {
+    if (table == NULL) 
+        return;
+    for (int i = 0; i < TABLE_CACHE; i++) {
+        free(table->rows[i].starts);
+    }
+    free(table->widths);
+    free(table);
+}
+
+size_t TableFieldSize(const TableRow* row, int field, const String* text) {
+    size_t end = (field + 1 < row->count) ? (size_t)row->starts[field + 1] - 1 : text->size;
+    return end - row->starts[field];
+}
+
+// The fields of a line of the buffer in the editor fields, the columns widen to fit them
+TableRow* TableRowOf(size_t line) {
+    Table* table = editor.table;
+    TableRow* row = &table->rows[line % TABLE_CACHE];
+    if (row->line == (int)line) 
+        return row;
+
+    const String* text = array_buffer->array[line];
+    row->line = line;
+    row->count = 0;
+    int quoted = 0;
+    for (size_t i = 0; i <= text->size; i++) {
+        if (i == 0 || (!quoted && text->str[i - 1] == table->delimiter)) {
+            if (row->count == row->capacity) {
+                row->capacity = row->capacity ? row->capacity * 2 : 16;
+                row->starts = realloc(row->starts, row->capacity * sizeof(int));
+                if (row->starts == NULL) {
+                    ShowError("Memory couldn't be allocated");
+                }
+            }
+            row->starts[row->count++] = i;
+        }
+        // tab separated files don't quote
+        if (i < text->size && text->str[i] == '"' && table->delimiter != '\t') 
+            quoted = !quoted;
+    }
+
+    if (row->count > table->capacity) {
+        table->capacity = max(row->count, table->capacity * 2);
+        table->widths = realloc(table->widths, table->capacity * sizeof(int));
+        if (table->widths == NULL) {
+            ShowError("Memory couldn't be allocated");
+        }
+    }
+    for (int field = 0; field < row->count; field++) {
+        if (field == table->columns) {
+            table->widths[table->columns++] = 0;
+            table->tick++;
+        }
+        int width = min(TableFieldSize(row, field, text), TABLE_MAX_WIDTH);
+        if (width > table->widths[field]) {
+            table->widths[field] = width;
+            table->tick++;
+        }
+    }
+    return row;
+}
+
+// Show the buffer as a table split at the delimiter every one of the first lines has the most of.
+// Returns 0 if there is none
+int TableStart() {
+    const char* delimiters = "\t,;|";
+    char delimiter = 0;
+    int best = 0;
+    for (const char* d = delimiters; *d; d++) {
+        int fewest = INT_MAX;
+        for (size_t i = 0; i < array_buffer->size && i < TABLE_SAMPLE; i++) {
+            const String* line = array_buffer->array[i];
+            if (line->size == 0) 
+                continue;
+            int count = 0;
+            for (const char* p = line->str; (p = memchr(p, *d, line->str + line->size - p)) != NULL; p++) {
+                count++;
+            }
+            fewest = min(fewest, count);
+        }
+        if (fewest != INT_MAX && fewest > best) {
+            best = fewest;
+            delimiter = *d;
+        }
+    }
+    if (delimiter == 0) 
+        return 0;
+
+    Table* table = calloc(1, sizeof(Table));
+    if (table == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    table->delimiter = delimiter;
+    table->tick = 1;
+    for (int i = 0; i < TABLE_CACHE; i++) {
+        table->rows[i].line = -1;
+    }
+    editor.table = table;
+    editor.table_left = 0;
+
+    // the first frame is drawn with the widths of a sample, the lines shown later widen them
+    size_t size = array_buffer->size;
+    for (size_t i = 0; i < TABLE_SAMPLE && i < size; i++) {
+        TableRowOf(i);
+        TableRowOf(i * size / TABLE_SAMPLE);
+    }
+    return 1;
+}
+
+// Files named *.csv or *.tsv are shown as tables when they're read
+void TableAuto() {
+    const String* name = editor.file_name;
+    if (editor.headless || editor.table != NULL || name->size < 4) 
+        return;
+    const char* extension = &name->str[name->size - 4];
+    if (strcasecmp(extension, ".csv") == 0 || strcasecmp(extension, ".tsv") == 0) 
+        TableStart();
+}
+
+Buffer* BufferInit(const char* filename) {
+    Buffer* buffer = malloc(sizeof(Buffer));
+    if (buffer == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    memset(buffer, 0, sizeof(Buffer));
+    buffer->number = ++editor.last_buffer_number;
+    buffer->file_name = StringInit();
+    StringAssign(buffer->file_name, filename);
+    buffer->dirty_line = -1;
+    buffer->watch_fd = -1;
+    buffer->changed_line = INT_MAX;
+    buffer->changed_end = -1;
+
+    editor.buffers = realloc(editor.buffers, (editor.buffer_count + 1) * sizeof(Buffer*));
+    if (editor.buffers == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    editor.buffers[editor.buffer_count++] = buffer;
+    return buffer;
+}
+
+// Free a buffer that isn't in the editor fields
+void BufferDestroy(Buffer* buffer) {
+    if (buffer->lines) {
+        ArrayDestroy(buffer->lines);
+        free(buffer->lines);
+    }
+    if (buffer->watch_fd != -1) 
+        close(buffer->watch_fd);
+    StringDestroy(buffer->file_name);
+    FoldTreeDestroy(&buffer->folds);
+    WordIndexDestroy(buffer->words);
+    TableDestroy(buffer->table);
+    free(buffer);
+}
+
+// Keep the state of the buffer in the editor fields in it before another one is loaded
+void BufferSave(Buffer* buffer) {
+    buffer->lines = array_buffer;
+    buffer->file_opened = editor.file_opened;
+    buffer->from_stdin = editor.from_stdin;
+    buffer->buffer_modified = editor.buffer_modified;
+    buffer->dirty_line = editor.dirty_line;
+    buffer->disk_stat = editor.disk_stat;
+    buffer->disk_stat_valid = editor.disk_stat_valid;
+    buffer->watch_fd = editor.watch_fd;
+    buffer->compression = editor.compression;
+    buffer->folds = editor.folds;
+    buffer->words = editor.words;
+    buffer->table = editor.table;
+    buffer->changed_line = editor.changed_line;
+    buffer->changed_end = editor.changed_end;
+}
+
+void BufferLoad(Buffer* buffer) {
+    editor.buffer = buffer;
+    array_buffer = buffer->lines;
+    editor.file_name = buffer->file_name;
+    editor.file_opened = buffer->file_opened;
+    editor.from_stdin = buffer->from_stdin;
+    editor.buffer_modified = buffer->buffer_modified;
+    editor.dirty_line = buffer->dirty_line;
+    editor.disk_stat = buffer->disk_stat;
+    editor.disk_stat_valid = buffer->disk_stat_valid;
+    editor.watch_fd = buffer->watch_fd;
+    editor.compression = buffer->compression;
+    editor.folds = buffer->folds;
+    editor.words = buffer->words;
+    editor.table = buffer->table;
+    editor.changed_line = buffer->changed_line;
+    editor.changed_end = buffer->changed_end;
+}
+
+// Put a buffer in the editor fields, the view stays the one of the active window
+void SwitchBuffer(Buffer* buffer) {
+    if (buffer == editor.buffer) 
+        return;
+    BufferSave(editor.buffer);
+    BufferLoad(buffer);
+}
+
+Window* WindowInit() {
+    Window* window = malloc(sizeof(Window));
+    if (window == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    memset(window, 0, sizeof(Window));
+    window->cursor_x = window->cursor_y = 1;
+    window->frame.status = StringInit();
+    return window;
+}
+
+void WindowDestroy(Window* window) {
+    StringDestroy(window->frame.status);
+    free(window);
+}
+
+Layout* LayoutInit(Window* window) {
+    Layout* node = malloc(sizeof(Layout));
+    if (node == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    node->parent = NULL;
+    node->children = NULL;
+    node->size = 0;
+    node->vertical = 0;
+    node->window = window;
+    if (window) 
+        window->node = node;
+    return node;
+}
+
+void LayoutDestroy(Layout* node) {
+    for (size_t i = 0; i < node->size; i++) {
+        LayoutDestroy(node->children[i]);
+    }
+    free(node->children);
+    free(node);
+}
+
+// Keep the view of the active window in it before another one is loaded
+void WindowSave(Window* window) {
+    window->start_line = editor.start_line;
+    window->end_line = editor.end_line;
+    window->cur_line = editor.cur_line;
+    window->cur_column = editor.cur_column;
+    window->max_column = editor.max_column;
+    window->cursor_x = editor.cursor_x;
+    window->cursor_y = editor.cursor_y;
+    window->table_left = editor.table_left;
+    window->frame = editor.frame;
+}
+
+// Put the view of a window and its buffer in the editor fields, lines it was on may be gone since
+void WindowLoad(Window* window) {
+    SwitchBuffer(window->buffer);
+    int last = max(0, (int)array_buffer->size - 1);
+    editor.window = window;
+    editor.window_rows = window->rows;
+    editor.window_cols = window->cols;
+    editor.start_line = min(window->start_line, last);
+    editor.end_line = window->end_line;
+    editor.cur_line = min(window->cur_line, last);
+    editor.cur_column = window->cur_column;
+    if (array_buffer->size > 0) 
+        editor.cur_column = min(editor.cur_column, array_buffer->array[editor.cur_line]->size);
+    editor.max_column = window->max_column;
+    editor.cursor_x = window->cursor_x;
+    editor.cursor_y = window->cursor_y;
+    editor.table_left = window->table_left;
+    editor.frame = window->frame;
+}
+
+// Remember where a window is in its buffer, the view goes back there when the buffer is shown again
+void BufferKeepView(Window* window) {
+    Buffer* buffer = window->buffer;
+    int active = (window == editor.window);
+    buffer->last_line = active ? editor.cur_line : window->cur_line;
+    buffer->last_column = active ? editor.cur_column : window->cur_column;
+    buffer->last_start = active ? editor.start_line : window->start_line;
+}
+
+// Give a node its area and share it between its children, side by side windows have a separator column between them
+void LayoutPlace(Layout* node, int top, int left, int rows, int cols) {
+    if (node->window) {
+        Window* window = node->window;
+        window->top = top;
+        window->left = left;
+        window->rows = max(rows, 2);
+        window->cols = max(cols, 1);
+        return;
+    }
+    int count = node->size;
+    int total = max(node->vertical ? cols - (count - 1) : rows, count);
+    for (int i = 0; i < count; i++) {
+        int size = total / count + (i < total % count);
+        if (node->vertical) {
+            LayoutPlace(node->children[i], top, left, rows, size);
+            left += size + 1;
+        } else {
+            LayoutPlace(node->children[i], top, left, size, cols);
+            top += size;
+        }
+    }
+}
+
+// Place the windows on the screen. Once it's split every window has a status line
+// and the bottom row is left to the status bar
+void LayoutWindows() {
+    LayoutPlace(editor.layout, 0, 0, editor.screen_rows - (editor.window_count > 1), editor.screen_cols);
+    editor.window_rows = editor.window->rows;
+    editor.window_cols = editor.window->cols;
+}
+
+void StoreCachedView(Buffer* buffer); // the view goes in the cached index of a large file
+void DiffOff(); // the diff ends with a side going away
+
+// A buffer no window shows drops its lines while they match its file, they're read again when it's shown.
+// An empty buffer without a name goes away, and so does the diff it's a side of
+void BufferHidden(Buffer* buffer) {
+    if (buffer == editor.buffer) 
+        return;
+    for (size_t i = 0; i < editor.window_count; i++) {
+        if (editor.windows[i]->buffer == buffer) 
+            return;
+    }
+    if (buffer == editor.diff.side[0] || buffer == editor.diff.side[1]) 
+        DiffOff();
+
+    if (buffer->file_name->size == 0 && !buffer->from_stdin && !buffer->buffer_modified) {
+        size_t i = 0;
+        while (editor.buffers[i] != buffer) i++;
+        memmove(&editor.buffers[i], &editor.buffers[i + 1], (editor.buffer_count - i - 1) * sizeof(Buffer*));
+        editor.buffer_count--;
+        BufferDestroy(buffer);
+        return;
+    }
+    if (buffer->lines == NULL || buffer->buffer_modified || buffer->from_stdin || !buffer->disk_stat_valid) 
+        return;
+
+    StoreCachedView(buffer);
+
+    WordIndexDestroy(buffer->words);
+    buffer->words = NULL;
+    if (buffer->table) 
+        TableForget(buffer->table, 0, INT_MAX);
+    ArrayDestroy(buffer->lines);
+    free(buffer->lines);
+    buffer->lines = NULL;
+    if (buffer->watch_fd != -1) {
+        close(buffer->watch_fd);
+        buffer->watch_fd = -1;
+    }
+    malloc_trim(0); // the freed lines go back to the system
+}
+
+// Draw every window again, the screen was cleared or something they all show changed
+void RedrawWindows() {
+    editor.frame.valid = 0;
+    for (size_t i = 0; i < editor.window_count; i++) {
+        editor.windows[i]->frame.valid = 0;
+    }
+    StringClear(editor.shown_status);
+}
+
+void EditorInit(int headless) {
+    editor.headless = headless;
+    editor.quit = 0;
+    editor.command_failed = 0;
+    if (headless) {
+        editor.screen_rows = 24, editor.screen_cols = 80;
+    } else {
+        if (tcgetattr(STDIN_FILENO, &editor.default_term) == -1) {
+            ShowError("tcgetattr");
+        }
+        GetWindowSize(&editor.screen_rows, &editor.screen_cols);
+    }
+    editor.mode = NORMAL;
+    editor.cursor_x = editor.cursor_y = 1;
+    editor.file_opened = 0;
+    editor.from_stdin = 0;
+    editor.buffer_modified = 0;
+    editor.dirty_line = -1;
+    editor.disk_stat_valid = 0;
+    editor.watch_fd = -1;
+    editor.compression = UNCOMPRESSED;
+    editor.compress_level = 0;
+    editor.start_line = editor.end_line = 0;
+    editor.cur_line = editor.cur_column = 0;
+    editor.max_column = 0;
+    editor.status_message = StringInit();
+    editor.buffers = NULL;
+    editor.buffer_count = 0;
+    editor.last_buffer_number = 0;
+    editor.buffer = BufferInit("");
+    editor.stdin_buffer = NULL;
+    editor.file_name = editor.buffer->file_name;
+    editor.command = StringInit();
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        editor.registers[i].lines = NULL;
+    }
+    editor.register_name = 0;
+    editor.pending_key = 0;
+    editor.block_bottom = -1;
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        editor.macros[i] = (KeyList){0, 0, NULL};
+    }
+    editor.recording = editor.last_macro = -1;
+    editor.change = editor.last_change = (KeyList){0, 0, NULL};
+    editor.change_tick = editor.change_start_tick = 0;
+    editor.change_open = 0;
+    editor.replaying = 0;
+    Window* window = WindowInit();
+    window->buffer = editor.buffer;
+    editor.frame = window->frame;
+    editor.layout = LayoutInit(window);
+    editor.windows = malloc(sizeof(Window*));
+    if (editor.windows == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    editor.windows[0] = editor.window = window;
+    editor.window_count = 1;
+    LayoutWindows();
+    editor.changed_line = INT_MAX;
+    editor.changed_end = -1;
+    editor.compact_buffer = NULL;
+    editor.compact_next = 0;
+    editor.idle_ticks = 0;
+    editor.shown_status = StringInit();
+    editor.shown_cursor = StringInit();
+    editor.last_pattern = StringInit();
+    QuickfixInit(&editor.quickfix);
+    memset(&editor.diff, 0, sizeof(Diff));
+    editor.folds = (FoldTree){0, 0, NULL};
+    editor.words = NULL;
+    editor.table = NULL;
+    editor.table_left = 0;
+    editor.completion = NULL;
+    editor.completion_line = -1;
+    editor.command_cursor_pos = 0;
+    editor.motion_count = 0;
+}
+
+void EditorDestroy() {
+    StringDestroy(editor.status_message);
+    StringDestroy(editor.file_name);
+    StringDestroy(editor.command);
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        RegisterClear(&editor.registers[i]);
+        KeyListDestroy(&editor.macros[i]);
+    }
+    KeyListDestroy(&editor.change);
+    KeyListDestroy(&editor.last_change);
+    WindowSave(editor.window);
+    for (size_t i = 0; i < editor.window_count; i++) {
+        WindowDestroy(editor.windows[i]);
+    }
+    free(editor.windows);
+    LayoutDestroy(editor.layout);
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        if (editor.buffers[i] != editor.buffer) 
+            BufferDestroy(editor.buffers[i]);
+    }
+    free(editor.buffer);
+    free(editor.buffers);
+    StringDestroy(editor.shown_status);
+    StringDestroy(editor.shown_cursor);
+    StringDestroy(editor.last_pattern);
+    QuickfixDestroy(&editor.quickfix);
+    DiffClear(&editor.diff);
+    FoldTreeDestroy(&editor.folds);
+    WordIndexDestroy(editor.words);
+    TableDestroy(editor.table);
+    if (editor.completion) 
+        StringDestroy(editor.completion);
+}
+
+void DisableRawMode () {
+    tcsetattr(STDIN_FILENO, TCIFLUSH, &editor.default_term);
+}
+
+void EnableRawMode () {
+    static int registered = 0;
+    if (!registered) {
+        atexit(DisableRawMode);
+        registered = 1;
+    }
+    
+    struct termios raw = editor.default_term;
+
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 1;
+
+
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+}
+
+// report a failed command, batch mode turns it into a failed exit status for the file
+void CommandError(const char* message) {
+    StringAssign(editor.status_message, message);
+    editor.command_failed = 1;
+}
+
+int IsVisualMode() {
+    return editor.mode == VISUAL || editor.mode == VISUAL_LINE || editor.mode == VISUAL_BLOCK;
+}
+
+// the windows showing one of the lines from first to last are drawn again
+void LinesChanged(int first, int last) {
+    if (first < editor.changed_line) 
+        editor.changed_line = first;
+    if (last > editor.changed_end) 
+        editor.changed_end = last;
+    // changed lines are compacted again
+    if ((size_t)first < editor.compact_next) 
+        editor.compact_next = first;
+    // and diffed again once the keys stop
+    if (editor.buffer == editor.diff.side[0] || editor.buffer == editor.diff.side[1])
+        editor.diff.stale = 1;
+    // and split into fields again
+    if (editor.table) 
+        TableForget(editor.table, first, last);
+}
+
+// remember that lines from first to last changed, the lines before first still match the file on disk
+void MarkLinesDirty(int first, int last) {
+    LinesChanged(first, last);
+    editor.buffer_modified = 1;
+    editor.change_tick++;
+    if (editor.dirty_line == -1 || first < editor.dirty_line) 
+        editor.dirty_line = first;
+}
+
+// same for the lines from line to the end
+void MarkDirty(int line) {
+    MarkLinesDirty(line, INT_MAX);
+}
+
+// The outermost closed fold holding line, NULL if the line is shown
+Fold* ClosedFold(int line) {
+    long fold = FoldTreeClosedAt(&editor.folds, line);
+    return (fold == -1) ? NULL : &editor.folds.folds[fold];
+}
+
+// The line standing for line on screen: the first one of the closed fold hiding it, or itself
+int VisibleLine(int line) {
+    Fold* fold = ClosedFold(line);
+    return fold ? fold->start : line;
+}
+
+// The first line shown after line, a closed fold is skipped whole
+int NextLine(int line) {
+    Fold* fold = ClosedFold(line);
+    return (fold ? fold->end : line) + 1;
+}
+
+int PrevLine(int line) {
+    return VisibleLine(line - 1);
+}
+
+// lines of [pos, pos + count) that come before line
+long LinesBefore(long line, long pos, long count) {
+    return (line < pos) ? 0 : (line - pos > count) ? count : line - pos;
+}
+
+// where a line ends up after old_count lines at first were replaced by new_count lines
+int AnchorLine(int line, size_t first, size_t old_count, size_t new_count) {
+    if ((size_t)line >= first + old_count) 
+        return line + (int)new_count - (int)old_count;
+    if ((size_t)line >= first + new_count) 
+        return max(0, (int)(first + new_count) - 1);
+    return line;
+}
+
+// Move the other windows and the folds with the lines of the buffer: removed lines at pos were replaced by added ones.
+// A fold losing all its lines goes away, lines added inside a fold make it grow
+void LinesMoved(Array* array, size_t pos, size_t removed, size_t added) {
+    if (array != array_buffer) 
+        return;
+    LinesChanged(pos, INT_MAX);
+    for (size_t i = 0; i < editor.window_count; i++) {
+        Window* window = editor.windows[i];
+        if (window != editor.window && window->buffer == editor.buffer) {
+            window->start_line = AnchorLine(window->start_line, pos, removed, added);
+            window->cur_line = AnchorLine(window->cur_line, pos, removed, added);
+        }
+    }
+    if (editor.folds.size == 0) 
+        return;
+
+    for (size_t i = 0; i < editor.folds.size; i++) {
+        Fold* fold = &editor.folds.folds[i];
+        long start = fold->start, after = fold->end + 1; 
+        start -= LinesBefore(start, pos, removed);
+        after -= LinesBefore(after, pos, removed);
+        if (start >= (long)pos) 
+            start += added;
+        if (after > (long)pos) 
+            after += added;
+        fold->start = start;
+        fold->end = after - 1;
+    }
+    FoldTreeMoved(&editor.folds);
+}
+
+// Same for the marked lines of the buffer removed by ArrayCompact
+void LinesCompacted(Array* array, const char* marks, size_t old_size) {
+    if (array != array_buffer) 
+        return;
+    size_t first = 0;
+    while (first < old_size && !marks[first]) first++;
+    LinesChanged(first, INT_MAX);
+    if (editor.folds.size == 0 && editor.window_count == 1) 
+        return;
+
+    size_t* removed = malloc((old_size + 1) * sizeof(size_t)); // marked lines before every line
+    if (removed == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    removed[0] = 0;
+    for (size_t i = 0; i < old_size; i++) {
+        removed[i + 1] = removed[i] + (marks[i] != 0);
+    }
+    for (size_t i = 0; i < editor.window_count; i++) {
+        Window* window = editor.windows[i];
+        if (window != editor.window && window->buffer == editor.buffer) {
+            window->start_line -= removed[min(window->start_line, (int)old_size)];
+            window->cur_line -= removed[min(window->cur_line, (int)old_size)];
+        }
+    }
+    for (size_t i = 0; i < editor.folds.size; i++) {
+        Fold* fold = &editor.folds.folds[i];
+        fold->end = fold->end + 1 - removed[fold->end + 1] - 1;
+        fold->start -= removed[fold->start];
+    }
+    free(removed);
+    FoldTreeMoved(&editor.folds);
+}
+
+void UpdateMotionCount(int digit) {
+    if (editor.motion_count < 1e5) // why whould anyone need more than this? If someone really does, I don't care
+        editor.motion_count = editor.motion_count * 10 + digit;
+}
+
+// The cursor is still after the word Ctrl-N / Ctrl-P put in (or tried to)
+int Completing() {
+    return editor.completion_tick == editor.change_tick && editor.completion_line == editor.cur_line 
+        && editor.completion_end == editor.cur_column;
+}
+
+// Build the status bar into message, the caller sends it only if it changed
+void StatusBar(String* message) {
+    char message_pos[20];
+    snprintf(message_pos, sizeof(message_pos), "\x1b[%zu;%dH", editor.screen_rows, 2);
+
+    StringAppend(message, message_pos);
+    StringAppend(message ,"\x1b[2K");
+
+    StringAppend(message, CYAN);
+    StringAppend(message, BOLD_ON);
+    switch (editor.mode)
+    {
+    case NORMAL:
+        if (editor.status_message->size < 40) {
+            StringAppendN(message, editor.status_message->str, editor.status_message->size);
+        }
+        break;
+    case INSERT:
+        StringAppend(message, "-- INSERT MODE --");
+        // with what Ctrl-N / Ctrl-P found until the next key moves or types
+        if (Completing() && editor.status_message->size < 40) {
+            StringAppend(message, " ");
+            StringAppendN(message, editor.status_message->str, editor.status_message->size);
+        }
+        break;
+    case VISUAL:
+        StringAppend(message, "-- VIUSAL MODE --");
+        break;
+    case VISUAL_LINE:
+        StringAppend(message, "-- VISUAL LINE MODE --");
+        break;
+    case VISUAL_BLOCK:
+        StringAppend(message, "-- VISUAL BLOCK MODE --");
+        break;
+    case COMMAND_LINE:
+        StringAppend(message, ":");
+        StringAppendN(message, editor.command->str, editor.command->size);
+        break;
+    default:
+        break;
+    }
+    if (editor.recording > 0 && editor.mode != COMMAND_LINE) {
+        char recording[20];
+        snprintf(recording, sizeof(recording), "  recording @%c", 'a' + editor.recording - 1);
+        StringAppend(message, recording);
+    }
+    StringAppend(message, COLOR_RESET);
+
+    if (editor.motion_count > 0 && (editor.mode == NORMAL || IsVisualMode())) { // show motion count 
+        char count[10];
+        snprintf(count, sizeof(count), "%d", editor.motion_count);
+
+        char count_pos[20];
+        snprintf(count_pos, sizeof(count_pos), "\x1b[%zu;%zuH", editor.screen_rows, editor.screen_cols - 10 - strlen(count));
+
+        StringAppend(message, count_pos);
+        StringAppend(message, count);
+    }
+
+    if (editor.mode != COMMAND_LINE) { // show cursor position when Command line mode is off
+        char status[40];
+        snprintf(status, sizeof(status), "%d,%d", editor.cur_line + 1, editor.cur_column + 1);
+        
+        char status_pos[20];
+        snprintf(status_pos, sizeof(status_pos), "\x1b[%zu;%zuH", editor.screen_rows, editor.screen_cols - 3 - strlen(status));
+    
+        StringAppend(message, status_pos);
+        StringAppend(message, status);
+    }
+}
+
+// Move to a row and a column of the active window, both from 0
+void WindowMoveTo(String* out, int row, int col) {
+    char pos[32];
+    snprintf(pos, sizeof(pos), "\x1b[%d;%dH", editor.window->top + row + 1, editor.window->left + col + 1);
+    StringAppend(out, pos);
+}
+
+// Clear a row of the window after the used columns, a window with a neighbour on its right is padded instead
+void ClearRow(String* out, size_t used) {
+    if (editor.window->left + editor.window_cols >= editor.screen_cols) 
+        StringAppend(out, "\x1b[K");
+    else 
+        StringPad(out, out->size + editor.window_cols - min(used, editor.window_cols));
+}
+
+void ShowWelcomeMessage(String* out) {
+    const char* message = "~ Welcome To notvim. Made with <3 By Abdullah ~";
+    int len = strlen(message);
+    if (len > (int)editor.window_cols) 
+        return;
+
+    WindowMoveTo(out, editor.window_rows / 2 - 1, max(0, editor.window_cols / 2 - len / 2 - 1));
+    StringAppend(out, message);
+}
+
+
+// Styled spans: every rendered line gets a sorted list of runs to draw with an attribute,
+// the renderer copies the text of a run at once and only emits escapes at its edges
+typedef struct
+{
+    size_t start, end; // columns [start, end) of the line
+    const char* attr;
+} Span;
+
+typedef struct
+{
+    size_t size;
+    size_t capacity;
+    Span* spans;
+} SpanList;
+
+SpanList* SpanListInit() {
+    SpanList* list = malloc(sizeof(SpanList));
+    if (list == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    list->size = 0;
+    list->capacity = 4;
+    list->spans = malloc(list->capacity * sizeof(Span));
+    if (list->spans == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    return list;
+}
+
+// add a run keeping the list sorted by start, empty runs are dropped
+void SpanListAdd(SpanList* list, size_t start, size_t end, const char* attr) {
+    if (start >= end) 
+        return;
+
+    if (list->size == list->capacity) {
+        list->capacity *= 2;
+        list->spans = realloc(list->spans, list->capacity * sizeof(Span));
+        if (list->spans == NULL) {
+            ShowError("Memory couldn't be allocated");
+        }
+    }
+
+    size_t i = list->size++;
+    while (i > 0 && list->spans[i - 1].start > start) {
+        list->spans[i] = list->spans[i - 1];
+        i--;
+    }
+    list->spans[i].start = start;
+    list->spans[i].end = end;
+    list->spans[i].attr = attr;
+}
+
+void SpanListClear(SpanList* list) {
+    list->size = 0;
+}
+
+void SpanListDestroy(SpanList* list) {
+    free(list->spans);
+    free(list);
+}
+
+// The visual selection in text order, returns 0 when nothing is selected
+int VisualSelection(size_t* st_l, size_t* st_c, size_t* en_l, size_t* en_c) {
+    *st_l = editor.v_start_line, *st_c = editor.v_start_col;
+    *en_l = editor.cur_line, *en_c = editor.cur_column;
+
+    if (*en_l < *st_l) {
+        swap(st_l, en_l);
+        swap(st_c, en_c);
+    } else if (*en_l == *st_l && *en_c < *st_c) {
+        swap(st_c, en_c);
+    }
+    return (*st_l != *en_l) || (*st_c != *en_c);
+}
+
+// The block selection, lines [top, bottom] and columns [left, right) with the cursor column included
+void VisualBlock(size_t* top, size_t* bottom, size_t* left, size_t* right) {
+    *top = min(editor.v_start_line, editor.cur_line);
+    *bottom = max(editor.v_start_line, editor.cur_line);
+    *left = min(editor.v_start_col, editor.cur_column);
+    *right = max(editor.v_start_col, editor.cur_column) + 1;
+}
+
+// The side of the diff the buffer in the editor fields is, -1 if it isn't diffed
+int DiffSide() {
+    if (editor.diff.side[0] == NULL)
+        return -1;
+    if (editor.buffer == editor.diff.side[0])
+        return 0;
+    return (editor.buffer == editor.diff.side[1]) ? 1 : -1;
+}
+
+// The lines of a side, NULL if its buffer dropped them
+Array* DiffLines(int side) {
+    Buffer* buffer = editor.diff.side[side];
+    if (buffer == NULL)
+        return editor.diff.disk;
+    return (buffer == editor.buffer) ? array_buffer : buffer->lines;
+}
+
+// The line a hunk is marked on: its first one, or the one after the lines missing on that side
+int DiffHunkLine(const DiffHunk* hunk, int side, int size) {
+    return (hunk->count[side] == 0 && hunk->start[side] >= size) ? size - 1 : hunk->start[side];
+}
+
+// The hunk marked on a line of a side, NULL if the line is the same on both sides
+const DiffHunk* DiffHunkAt(int side, int line, int size) {
+    const Diff* diff = &editor.diff;
+    size_t low = 0, high = diff->size;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (DiffHunkLine(&diff->hunks[mid], side, size) <= line)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == 0)
+        return NULL;
+    const DiffHunk* hunk = &diff->hunks[low - 1];
+    if (line == DiffHunkLine(hunk, side, size) || line < hunk->start[side] + hunk->count[side])
+        return hunk;
+    return NULL;
+}
+
+// columns taken by the diff markers left of the text
+size_t DiffGutter() {
+    return (DiffSide() >= 0 && editor.window_cols > 4) ? 2 : 0;
+}
+
+// columns of the window the text wraps at
+size_t TextCols() {
+    return editor.window_cols - DiffGutter();
+}
+
+// Append the marker of a line: + for lines the other side doesn't have, ! for changed ones and
+// - where lines of the other side are missing. Wrapped rows get a blank one
+void DrawGutter(String* out, int line, int first_row) {
+    int side = DiffSide();
+    const DiffHunk* hunk = first_row ? DiffHunkAt(side, line, array_buffer->size) : NULL;
+    if (hunk == NULL) {
+        StringAppend(out, "  ");
+    } else if (hunk->count[side] == 0) {
+        StringAppend(out, RED "-" COLOR_RESET " ");
+    } else if (hunk->count[!side] == 0) {
+        StringAppend(out, GREEN "+" COLOR_RESET " ");
+    } else {
+        StringAppend(out, YELLOW "!" COLOR_RESET " ");
+    }
+}
+
+// Highlight a line of a hunk: added lines whole, changed ones around the text that differs from
+// the line they're paired with on the other side
+void DiffSpans(size_t line, SpanList* spans) {
+    int side = DiffSide();
+    const DiffHunk* hunk = DiffHunkAt(side, line, array_buffer->size);
+    if (hunk == NULL || (int)line < hunk->start[side] || (int)line >= hunk->start[side] + hunk->count[side])
+        return;
+
+    const String* text = array_buffer->array[line];
+    if (hunk->count[!side] == 0) {
+        SpanListAdd(spans, 0, text->size, DIFF_ADD_BG);
+        return;
+    }
+    Array* other_lines = DiffLines(!side);
+    size_t other = hunk->start[!side] + (line - hunk->start[side]);
+    if (other_lines == NULL || (int)(line - hunk->start[side]) >= hunk->count[!side] || other >= other_lines->size) {
+        SpanListAdd(spans, 0, text->size, DIFF_CHANGE_BG);
+        return;
+    }
+
+    const String* pair = other_lines->array[other];
+    size_t shortest = min(text->size, pair->size), prefix = 0, suffix = 0;
+    while (prefix < shortest && text->str[prefix] == pair->str[prefix]) prefix++;
+    while (suffix < shortest - prefix && text->str[text->size - 1 - suffix] == pair->str[pair->size - 1 - suffix]) suffix++;
+    SpanListAdd(spans, 0, prefix, DIFF_CHANGE_BG);
+    SpanListAdd(spans, prefix, text->size - suffix, DIFF_TEXT_BG);
+    SpanListAdd(spans, text->size - suffix, text->size, DIFF_CHANGE_BG);
+}
+
+// collect the highlighted runs of a line
+void LineSpans(size_t line, SpanList* spans) {
+    SpanListClear(spans);
+    size_t size = array_buffer->array[line]->size;
+
+    size_t st_l, st_c, en_l, en_c;
+    if (editor.mode == VISUAL && VisualSelection(&st_l, &st_c, &en_l, &en_c) && line >= st_l && line <= en_l) {
+        SpanListAdd(spans, (line == st_l) ? st_c : 0, (line == en_l) ? en_c : size, VISUAL_BG);
+    } 
+    else if (editor.mode == VISUAL_LINE || editor.mode == VISUAL_BLOCK) {
+        size_t top, bottom, left, right;
+        VisualBlock(&top, &bottom, &left, &right);
+        if (line >= top && line <= bottom) 
+            SpanListAdd(spans, (editor.mode == VISUAL_LINE) ? 0 : left, (editor.mode == VISUAL_LINE) ? size : right, VISUAL_BG);
+    }
+    // the selection hides the diff highlights
+    if (spans->size == 0 && DiffSide() >= 0) 
+        DiffSpans(line, spans);
+}
+
+// Append the columns [from, to) of a line drawing its runs with their attributes, overlapping runs are cut at the previous end
+void RenderLine(String* out, const String* line, const SpanList* spans, size_t from, size_t to) {
+    size_t pos = from;
+    to = (to < line->size) ? to : line->size;
+    for (size_t i = 0; i < spans->size; i++) {
+        const Span* span = &spans->spans[i];
+        size_t start = (span->start > pos) ? span->start : pos;
+        size_t end = (span->end < to) ? span->end : to;
+        if (start >= end) 
+            continue;
+
+        StringAppendN(out, &line->str[pos], start - pos);
+        StringAppend(out, span->attr);
+        StringAppendN(out, &line->str[start], end - start);
+        StringAppend(out, COLOR_RESET);
+        pos = end;
+    }
+    if (pos < to) 
+        StringAppendN(out, &line->str[pos], to - pos);
+}
+
+// Screen columns of the table left of a column
+size_t TableColumnX(int column) {
+    size_t x = 0;
+    for (int i = 0; i < column && i < editor.table->columns; i++) {
+        x += editor.table->widths[i] + TABLE_GAP;
+    }
+    return x;
+}
+
+// The field of a line holding a byte column, a delimiter goes with the field before it
+int TableFieldAt(const TableRow* row, size_t column) {
+    int field = 0;
+    while (field + 1 < row->count && (size_t)row->starts[field + 1] <= column) field++;
+    return field;
+}
+
+// The screen column of a byte column of a line in the table, from the left edge of the table
+size_t TableX(size_t line, size_t column) {
+    const TableRow* row = TableRowOf(line);
+    int field = TableFieldAt(row, column);
+    size_t width = editor.table->widths[field], offset = column - row->starts[field];
+    size_t size = TableFieldSize(row, field, array_buffer->array[line]);
+    if (offset == size && field + 1 < row->count) // the delimiter is shown as the separator
+        return TableColumnX(field) + width + 1;
+    if (size > width) // past the cut
+        offset = min(offset, width - 1);
+    return TableColumnX(field) + offset;
+}
+
+// The cursor's column in the window showing a table. The window scrolls by whole columns to keep it in sight
+size_t TableCursorX() {
+    const TableRow* row = TableRowOf(editor.cur_line);
+    int field = TableFieldAt(row, editor.cur_column);
+    size_t x = TableX(editor.cur_line, editor.cur_column), cols = TextCols();
+    if (field < editor.table_left) 
+        editor.table_left = field;
+    while (editor.table_left < field && x - TableColumnX(editor.table_left) >= cols) editor.table_left++;
+    return min(x - TableColumnX(editor.table_left), cols - 1);
+}
+
+// Draw a line as a row of the table from the window's first column, cut at cols. Returns the columns used
+size_t RenderTableRow(String* out, size_t line, const SpanList* spans, size_t cols) {
+    const String* text = array_buffer->array[line];
+    const TableRow* row = TableRowOf(line);
+    size_t used = 0;
+    for (int field = editor.table_left; field < row->count && used < cols; field++) {
+        if (field > editor.table_left) {
+            size_t gap = min(TABLE_GAP, cols - used);
+            StringAppend(out, BLUE);
+            StringAppendN(out, " | ", gap);
+            StringAppend(out, COLOR_RESET);
+            used += gap;
+        }
+        size_t width = editor.table->widths[field], size = TableFieldSize(row, field, text);
+        size_t start = row->starts[field], shown = min(min(size, width), cols - used);
+        // a field too wide for its column ends with a > mark
+        int cut = (size > width && shown == width);
+        shown -= cut;
+        RenderLine(out, text, spans, start, start + shown);
+        used += shown;
+        if (cut) {
+            StringAppend(out, CYAN ">" COLOR_RESET);
+            used++;
+        }
+        // the last field isn't padded, the row is cleared after it
+        if (field + 1 < row->count && used < cols) {
+            size_t pad = min(width - shown - cut, cols - used);
+            StringPad(out, out->size + pad);
+            used += pad;
+        }
+    }
+    return used;
+}
+
+// Split the lines in view before they're drawn, so the columns are as wide as they'll be
+void TableFit() {
+    int rows = 0;
+    for (size_t line = editor.start_line; line < array_buffer->size && rows < (int)editor.window_rows - 1; line = NextLine(line)) {
+        TableRowOf(line);
+        rows++;
+    }
+}
+
+// number of terminal rows needed to render a line
+int LineRows(size_t line) {
+    String* cur_line = array_buffer->array[line];
+    if (editor.table) // rows of a table are cut, not wrapped
+        return 1;
+    if (editor.folds.size > 0 && ClosedFold(line) != NULL) // a closed fold takes one row
+        return 1;
+    return (cur_line->size ? ceil_d(cur_line->size, TextCols()) : 1);
+}
+
+// The row standing for a closed fold: its size and its first line. Returns the columns used
+size_t RenderFold(String* out, const Fold* fold) {
+    String* first = array_buffer->array[fold->start];
+    size_t skip = 0;
+    while (skip < first->size && (first->str[skip] == ' ' || first->str[skip] == '\t')) skip++;
+
+    char head[48];
+    int len = snprintf(head, sizeof(head), "+--%4d lines: ", fold->end - fold->start + 1);
+    StringAppend(out, CYAN);
+    size_t cols = TextCols();
+    size_t used = min(len, cols);
+    StringAppendN(out, head, used);
+    if ((size_t)len < cols) {
+        StringAppendN(out, &first->str[skip], min(first->size - skip, cols - len));
+        used += min(first->size - skip, cols - len);
+    }
+    StringAppend(out, COLOR_RESET);
+    return used;
+}
+
+// Draw the lines whose first row falls in [from_row, to_row) and the tildes after the last line,
+// rows count from 0 at the top of the window. A line is drawn whole or not at all, a row at a time
+// so it wraps at the edge of the window. Returns the rows taken by lines
+int DrawTextRows(String* out, int from_row, int to_row, SpanList* spans) {
+    int text_area = editor.window_rows - 1;
+    int row = 0;
+    size_t cols = TextCols(), gutter = DiffGutter();
+
+    for (size_t line = editor.start_line; line < array_buffer->size; line = NextLine(line)) {
+        String* cur_line = array_buffer->array[line];
+        Fold* fold = ClosedFold(line);
+        int needed = LineRows(line);
+
+        // stop rendering when the terminal is full
+        if (row + needed > text_area) break;
+
+        // mark the last line rendered
+        editor.end_line = line;
+
+        if (row >= from_row && row < to_row && fold) {
+            WindowMoveTo(out, row, 0);
+            if (gutter) 
+                DrawGutter(out, line, 1);
+            ClearRow(out, gutter + RenderFold(out, fold));
+        } 
+        else if (row >= from_row && row < to_row && editor.table) {
+            LineSpans(line, spans);
+            WindowMoveTo(out, row, 0);
+            if (gutter) 
+                DrawGutter(out, line, 1);
+            ClearRow(out, gutter + RenderTableRow(out, line, spans, cols));
+        }
+        else if (row >= from_row && row < to_row) {
+            // draw the line with its highlighted runs, clearing what's left of its last row
+            LineSpans(line, spans);
+            for (int i = 0; i < needed; i++) {
+                size_t from = i * cols;
+                WindowMoveTo(out, row + i, 0);
+                if (gutter) 
+                    DrawGutter(out, line, i == 0);
+                RenderLine(out, cur_line, spans, from, from + cols);
+                if (from + cols > cur_line->size) 
+                    ClearRow(out, gutter + cur_line->size - from);
+            }
+        }
+        row += needed;
+    }
+
+    int text_rows = row;
+    if (row < from_row) 
+        row = from_row;
+    if (row < to_row) {
+        StringAppend(out, BLUE);
+        StringAppend(out, BOLD_ON);
+        for (; row < to_row; row++) {
+            WindowMoveTo(out, row, 0);
+            StringAppend(out, "~");
+            ClearRow(out, 1);
+        }
+        StringAppend(out, COLOR_RESET);
+    }
+    return text_rows;
+}
+
+// When start_line moved by a few lines, shift the window inside a scroll region
+// and draw only the rows that came into view. Returns 0 if a full repaint is needed.
+// A scroll region takes whole rows, so it's only used by windows as wide as the screen
+int ScrollText(String* out, SpanList* spans) {
+    Frame* frame = &editor.frame;
+    int text_area = editor.window_rows - 1;
+    int top = editor.window->top;
+    if (editor.window->left != 0 || editor.window_cols != editor.screen_cols) 
+        return 0;
+
+    int from = min(frame->start_line, editor.start_line), to = max(frame->start_line, editor.start_line);
+    int shift = 0;
+    for (int line = from; line < to && shift < text_area; line = NextLine(line)) {
+        shift += LineRows(line);
+    }
+    if (shift >= text_area) 
+        return 0;
+
+    char seq[40];
+    if (editor.start_line > frame->start_line) {
+        // the lines below the old text come up from the bottom
+        snprintf(seq, sizeof(seq), "\x1b[%d;%dr\x1b[%dS\x1b[r", top + 1, top + text_area, shift);
+        StringAppend(out, seq);
+        frame->text_rows = DrawTextRows(out, max(0, frame->text_rows - shift), text_area, spans);
+    } else {
+        // new lines on top, a line pushed partly out of the bottom turns into tildes
+        snprintf(seq, sizeof(seq), "\x1b[%d;%dr\x1b[%dT\x1b[r", top + 1, top + text_area, shift);
+        StringAppend(out, seq);
+        frame->text_rows = DrawTextRows(out, 0, shift, spans);
+        DrawTextRows(out, frame->text_rows, text_area, spans);
+    }
+    return 1;
+}
+
+typedef struct
+{
+    const char* begin;
+    const char* end;
+    Array* lines;
+} LoadJob;
+
+// Split a chunk of newline terminated lines into strings
+void* LoadWorker(void* arg) {
+    LoadJob* job = arg;
+    const char* p = job->begin;
+    while (p < job->end) {
+        const char* newline = memchr(p, '\n', job->end - p);
+        ArrayAppend(job->lines, StringFromBuffer(p, newline - p));
+        p = newline + 1;
+    }
+    return NULL;
+}
+
+// Split text into lines appended to lines: it's cut into one chunk per thread on line boundaries,
+// every thread builds the lines of its own chunk and the results are joined in order
+void LoadLines(const char* text, size_t size, Array* lines) {
+    // what follows the last newline is the last line, it's empty when the file ends with a newline
+    const char* last_newline = memrchr(text, '\n', size);
+    size_t body = last_newline ? (size_t)(last_newline - text) + 1 : 0;
+
+    // batch mode already runs one editor per core, more loaders would only oversubscribe them
+    int threads = editor.headless ? 1 : ThreadCount(body, LOAD_CHUNK_MIN);
+    LoadJob jobs[MAX_THREADS];
+    pthread_t workers[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    const char* begin = text;
+    for (int i = 0; i < threads; i++) {
+        const char* end = text + body;
+        if (i + 1 < threads) {
+            const char* cut = text + body / threads * (i + 1);
+            if (cut < begin) 
+                cut = begin;
+            if (cut < end) // a long line may already have swallowed this chunk
+                end = (const char*)memchr(cut, '\n', end - cut) + 1;
+        }
+
+        jobs[i].begin = begin;
+        jobs[i].end = end;
+        jobs[i].lines = ArrayInit();
+        begin = end;
+
+        started[i] = (threads > 1 && pthread_create(&workers[i], NULL, LoadWorker, &jobs[i]) == 0);
+        if (!started[i]) 
+            LoadWorker(&jobs[i]);
+    }
+
+    size_t total = 1;
+    for (int i = 0; i < threads; i++) {
+        if (started[i]) 
+            pthread_join(workers[i], NULL);
+        total += jobs[i].lines->size;
+    }
+
+    ArrayReserve(lines, lines->size + total);
+    for (int i = 0; i < threads; i++) {
+        memcpy(&lines->array[lines->size], jobs[i].lines->array, jobs[i].lines->size * sizeof(String*));
+        lines->size += jobs[i].lines->size;
+        free(jobs[i].lines->array);
+        free(jobs[i].lines);
+    }
+    ArrayAppend(lines, StringFromBuffer(text + body, size - body));
+}
+
+const char* FileBaseName(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Watch the directory of the file, that way both rewrites in place and replacements by rename are seen
+void WatchFile(const char* filename) {
+    editor.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (editor.watch_fd == -1) 
+        return;
+
+    String* dir = StringInit();
+    const char* slash = strrchr(filename, '/');
+    if (slash == NULL) 
+        StringAssign(dir, ".");
+    else if (slash == filename) 
+        StringAssign(dir, "/");
+    else 
+        StringAppendN(dir, filename, slash - filename);
+
+    if (inotify_add_watch(editor.watch_fd, dir->str, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        close(editor.watch_fd);
+        editor.watch_fd = -1;
+    }
+    StringDestroy(dir);
+}
+
+// The index of a large file is cached in ~/.cache/notvim, opening the file again doesn't read it: the lines
+// are built from the index and borrow their text from a mapping of the file, only the shown ones get paged in.
+// An index holds while the file has the size, mtime and inode it was made for. The header is followed by the
+// path of the file and the length of every line but the last one (newline included) as LEB128 varints
+#define INDEX_MAGIC "notvimI1"
+
+typedef struct
+{
+    char magic[8];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    size_t lines, index_size, path_size;
+    int cur_line, cur_column, start_line; // the view when the file was left
+} IndexHeader;
+
+// The index of a file read the long way, written on a thread so the editor doesn't wait for it
+typedef struct
+{
+    pthread_t thread;
+    int running;
+    String* cache_path;
+    String* real_path;
+    IndexHeader header;
+    unsigned char* index;
+} IndexJob;
+
+_Thread_local IndexJob index_job;
+
+int WriteAllV(int fd, struct iovec* iov, int count);
+void SplitChunk(const char* chunk, size_t len, String* partial, Array* lines);
+int SameFileState(const struct stat* a, const struct stat* b);
+size_t OwnMapped(Buffer* buffer, size_t keep, size_t readable); // before its file is written over
+
+// The mappings lines borrow their text from, for HandleBusError: it runs on whichever thread read past the end
+// of a file that shrank. They're never unmapped, so a slot stays valid
+#define MAPPED_FILES 256
+typedef struct
+{
+    char* start;
+    size_t size;
+    volatile sig_atomic_t damaged; // text of it was lost, saving would write NULs or empty lines for it
+} MappedFile;
+
+MappedFile mapped_files[MAPPED_FILES];
+atomic_int mapped_file_count;
+
+// Where the index of a file is cached, NULL without a cache directory. real_path gets the absolute path of the file
+String* IndexCachePath(const char* filename, String* real_path) {
+    const char* cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char* real = realpath(filename, NULL);
+    if (real == NULL || ((cache == NULL || *cache == 0) && (home == NULL || *home == 0))) {
+        free(real);
+        return NULL;
+    }
+    StringAssign(real_path, real);
+    free(real);
+
+    String* path = StringInit();
+    if (cache && *cache) {
+        StringAssign(path, cache);
+    } else {
+        StringAssign(path, home);
+        StringAppend(path, "/.cache");
+    }
+    mkdir(path->str, 0700);
+    StringAppend(path, "/notvim");
+    mkdir(path->str, 0700);
+
+    // the FNV-1a hash of the path names the index
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < real_path->size; i++) {
+        hash = (hash ^ (unsigned char)real_path->str[i]) * 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.idx", hash);
+    StringAppend(path, name);
+    return path;
+}
+
+// Read the header of a cached index, 0 if it isn't one or it's the index of another path
+int ReadIndexHeader(int fd, const String* real_path, IndexHeader* header) {
+    char path[PATH_MAX];
+    if (pread(fd, header, sizeof(IndexHeader), 0) != sizeof(IndexHeader) || memcmp(header->magic, INDEX_MAGIC, 8) != 0) 
+        return 0;
+    if (header->path_size != real_path->size || header->path_size > sizeof(path)) 
+        return 0;
+    return pread(fd, path, header->path_size, sizeof(IndexHeader)) == (ssize_t)header->path_size && 
+           memcmp(path, real_path->str, header->path_size) == 0;
+}
+
+int IndexMatches(const IndexHeader* header, const struct stat* disk) {
+    return header->dev == disk->st_dev && header->ino == disk->st_ino && header->size == disk->st_size &&
+           header->mtime.tv_sec == disk->st_mtim.tv_sec && header->mtime.tv_nsec == disk->st_mtim.tv_nsec;
+}
+
+int ReadVarint(const unsigned char** p, const unsigned char* end, size_t* value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (size_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) 
+            return 1;
+    }
+    return 0;
+}
+
+// Decode the index into lines borrowing from a mapping of the file, 0 if the index is damaged
+int BuildIndexedLines(int cache_fd, const IndexHeader* header, int fd, const struct stat* disk) {
+    struct stat cache_stat;
+    size_t offset = sizeof(IndexHeader) + header->path_size;
+    if (fstat(cache_fd, &cache_stat) == -1 || (size_t)cache_stat.st_size != offset + header->index_size || 
+        header->index_size == 0 || header->lines > header->index_size + 1) 
+        return 0;
+    unsigned char* cache = mmap(NULL, cache_stat.st_size, PROT_READ, MAP_PRIVATE, cache_fd, 0);
+    if (cache == MAP_FAILED) 
+        return 0;
+
+    Buffer* buffer = editor.buffer;
+    if (buffer->mapped == NULL || !SameFileState(&buffer->mapped_stat, disk)) {
+        char* text = mmap(NULL, disk->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int slot = (text == MAP_FAILED) ? -1 : atomic_fetch_add(&mapped_file_count, 1);
+        if (slot == -1 || slot >= MAPPED_FILES) {
+            if (text != MAP_FAILED) 
+                munmap(text, disk->st_size);
+            munmap(cache, cache_stat.st_size);
+            return 0;
+        }
+        // the old mapping is forgotten, registers may still borrow from it. If it's the same file only
+        // what it still holds can be copied
+        if (buffer->mapped) {
+            size_t readable = buffer->mapped_size;
+            if (buffer->mapped_stat.st_dev == disk->st_dev && buffer->mapped_stat.st_ino == disk->st_ino && (size_t)disk->st_size < readable) 
+                readable = disk->st_size;
+            OwnMapped(buffer, 0, readable);
+        }
+        mapped_files[slot].size = disk->st_size;
+        mapped_files[slot].start = text;
+        buffer->mapped = text;
+        buffer->mapped_size = disk->st_size;
+        buffer->mapped_stat = *disk;
+        buffer->mapping = slot;
+    }
+
+    const unsigned char* p = cache + offset, *end = p + header->index_size;
+    size_t start = 0, size = disk->st_size, len;
+    int ok = 1;
+    ArrayReserve(array_buffer, header->lines);
+    for (size_t i = 0; i + 1 < header->lines; i++) {
+        if (!ReadVarint(&p, end, &len) || len == 0 || len > size - start) {
+            ok = 0;
+            break;
+        }
+        array_buffer->array[array_buffer->size++] = StringBorrow(buffer->mapped + start, len - 1);
+        start += len;
+    }
+    munmap(cache, cache_stat.st_size);
+
+    if (!ok) {
+        for (size_t i = 0; i < array_buffer->size; i++) {
+            StringDestroy(array_buffer->array[i]);
+        }
+        array_buffer->size = 0;
+        return 0;
+    }
+    ArrayAppend(array_buffer, StringBorrow(buffer->mapped + start, size - start));
+    return 1;
+}
+
+// Build the lines of a large file from its cached index. The view the file was left with goes in the buffer,
+// also when the index is stale. Returns 0 if there's no index for the file as it is now
+int LoadIndexCache(const char* filename, int fd, const struct stat* disk) {
+    String* real_path = StringInit();
+    String* cache_path = IndexCachePath(filename, real_path);
+    int cache_fd = cache_path ? open(cache_path->str, O_RDONLY | O_CLOEXEC) : -1;
+    if (cache_path) 
+        StringDestroy(cache_path);
+
+    IndexHeader header;
+    int loaded = 0;
+    if (cache_fd != -1 && ReadIndexHeader(cache_fd, real_path, &header)) {
+        editor.buffer->last_line = header.cur_line;
+        editor.buffer->last_column = header.cur_column;
+        editor.buffer->last_start = header.start_line;
+        if (IndexMatches(&header, disk)) 
+            loaded = BuildIndexedLines(cache_fd, &header, fd, disk);
+    }
+    if (cache_fd != -1) 
+        close(cache_fd);
+    StringDestroy(real_path);
+    return loaded;
+}
+
+void* IndexWorker(void* arg) {
+    IndexJob* job = arg;
+    String* temp = StringDuplicate(job->cache_path);
+    StringAppend(temp, ".XXXXXX");
+    int fd = mkostemp(temp->str, O_CLOEXEC);
+    if (fd != -1) {
+        struct iovec iov[3] = {
+            {&job->header, sizeof(IndexHeader)},
+            {job->real_path->str, job->real_path->size},
+            {job->index, job->header.index_size}
+        };
+        int written = WriteAllV(fd, iov, 3) != -1;
+        close(fd);
+        if (!written || rename(temp->str, job->cache_path->str) == -1) 
+            unlink(temp->str);
+    }
+    StringDestroy(temp);
+    return NULL;
+}
+
+// Wait for the index being written, one is written at a time
+void FinishIndexCache() {
+    IndexJob* job = &index_job;
+    if (!job->running) 
+        return;
+    pthread_join(job->thread, NULL);
+    job->running = 0;
+    free(job->index);
+    StringDestroy(job->cache_path);
+    StringDestroy(job->real_path);
+}
+
+// Cache the index of a large file that was just read, array_buffer holds the file as it is on disk
+void SaveIndexCache(const char* filename, const struct stat* disk) {
+    FinishIndexCache();
+    IndexJob* job = &index_job;
+    job->real_path = StringInit();
+    job->cache_path = IndexCachePath(filename, job->real_path);
+    if (job->cache_path == NULL) {
+        StringDestroy(job->real_path);
+        return;
+    }
+
+    size_t index_size = 0;
+    for (size_t i = 0; i + 1 < array_buffer->size; i++) {
+        for (size_t len = array_buffer->array[i]->size + 1; len > 0; len >>= 7) index_size++;
+    }
+    job->index = malloc(index_size + 1);
+    if (job->index == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    unsigned char* p = job->index;
+    for (size_t i = 0; i + 1 < array_buffer->size; i++) {
+        size_t len = array_buffer->array[i]->size + 1;
+        for (; len >= 0x80; len >>= 7) *p++ = (len & 0x7f) | 0x80;
+        *p++ = len;
+    }
+
+    IndexHeader* header = &job->header;
+    memset(header, 0, sizeof(IndexHeader));
+    memcpy(header->magic, INDEX_MAGIC, 8);
+    header->dev = disk->st_dev;
+    header->ino = disk->st_ino;
+    header->size = disk->st_size;
+    header->mtime = disk->st_mtim;
+    header->lines = array_buffer->size;
+    header->index_size = index_size;
+    header->path_size = job->real_path->size;
+    header->cur_line = editor.buffer->last_line;
+    header->cur_column = editor.buffer->last_column;
+    header->start_line = editor.buffer->last_start;
+
+    if (pthread_create(&job->thread, NULL, IndexWorker, job) != 0) {
+        IndexWorker(job);
+        free(job->index);
+        StringDestroy(job->cache_path);
+        StringDestroy(job->real_path);
+        return;
+    }
+    job->running = 1;
+}
+
+// Keep the view of a buffer in the cached index of its file, the file opens there the next time
+void StoreCachedView(Buffer* buffer) {
+    if (!buffer->disk_stat_valid || buffer->disk_stat.st_size < INDEX_CACHE_MIN) 
+        return;
+    FinishIndexCache();
+    String* real_path = StringInit();
+    String* cache_path = IndexCachePath(buffer->file_name->str, real_path);
+    int fd = cache_path ? open(cache_path->str, O_RDWR | O_CLOEXEC) : -1;
+    IndexHeader header;
+    if (fd != -1 && ReadIndexHeader(fd, real_path, &header) && IndexMatches(&header, &buffer->disk_stat)) {
+        header.cur_line = buffer->last_line;
+        header.cur_column = buffer->last_column;
+        header.start_line = buffer->last_start;
+        if (pwrite(fd, &header, sizeof(IndexHeader), 0) != sizeof(IndexHeader)) 
+            StringAssign(editor.status_message, "Couldn't update the index cache");
+    }
+    if (fd != -1) 
+        close(fd);
+    if (cache_path) 
+        StringDestroy(cache_path);
+    StringDestroy(real_path);
+}
+
+// The format of a file from its first bytes
+enum COMPRESSION FileCompression(int fd) {
+    unsigned char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) 
+        return GZIP;
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) 
+        return ZSTD;
+    return UNCOMPRESSED;
+}
+
+// The format a new file is saved in, from its name
+enum COMPRESSION NameCompression(const char* filename) {
+    size_t len = strlen(filename);
+    if (len > 3 && strcmp(filename + len - 3, ".gz") == 0) 
+        return GZIP;
+    if (len > 4 && strcmp(filename + len - 4, ".zst") == 0) 
+        return ZSTD;
+    return UNCOMPRESSED;
+}
+
+// Run gzip or zstd from in_fd to out_fd, decompressing or compressing at editor.compress_level.
+// Returns its pid, -1 if it couldn't be started
+pid_t StartCompressor(enum COMPRESSION format, int decompress, int in_fd, int out_fd) {
+    const char* name = (format == GZIP) ? "gzip" : "zstd";
+    char level[16] = "-q";
+    if (!decompress && editor.compress_level > 0) // gzip stops at 9
+        snprintf(level, sizeof(level), "-%d", (format == GZIP) ? min(editor.compress_level, 9) : editor.compress_level);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in_fd, STDIN_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        execlp(name, name, decompress ? "-d" : level, "-c", "-q", (char*)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+// The compressor is on the PATH, a save checks it before truncating the file it would write
+int CompressorAvailable(enum COMPRESSION format) {
+    const char* name = (format == GZIP) ? "gzip" : "zstd";
+    const char* dir = getenv("PATH");
+    if (dir == NULL) 
+        dir = "/usr/bin:/bin";
+
+    String* candidate = StringInit();
+    int found = 0;
+    while (!found) {
+        const char* colon = strchr(dir, ':');
+        StringAssignN(candidate, dir, colon ? (size_t)(colon - dir) : strlen(dir));
+        StringAppend(candidate, "/");
+        StringAppend(candidate, name);
+        found = (access(candidate->str, X_OK) == 0);
+        if (colon == NULL) 
+            break;
+        dir = colon + 1;
+    }
+    StringDestroy(candidate);
+    return found;
+}
+
+// wait for the compressor, 0 if it failed
+int FinishCompressor(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) 
+            return 0;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Read a compressed file through its decompressor. The output is split into lines as it arrives (into
+// lines, or kept whole in text when lines is NULL), the compressed file itself is never in memory.
+// Returns 0 if it couldn't be decompressed
+int DecompressFile(int fd, enum COMPRESSION format, Array* lines, String* text) {
+    int output[2];
+    if (pipe2(output, O_CLOEXEC) == -1) 
+        return 0;
+    pid_t pid = StartCompressor(format, 1, fd, output[1]);
+    close(output[1]);
+    if (pid == -1) {
+        close(output[0]);
+        return 0;
+    }
+
+    char chunk[STDIN_CHUNK];
+    ssize_t n;
+    while ((n = read(output[0], chunk, sizeof(chunk))) != 0) {
+        if (n == -1 && errno == EINTR) 
+            continue;
+        if (n == -1) 
+            break;
+        if (lines != NULL) 
+            SplitChunk(chunk, n, text, lines);
+        else 
+            StringAppendN(text, chunk, n);
+    }
+    close(output[0]);
+    return FinishCompressor(pid) && n == 0;
+}
+
+void ReadFileToBuffer(const char *filename) { 
+    
+    // change the global state for the file
+    editor.file_opened = 1;
+    StringAssign(editor.file_name, filename);
+    StringAssign(editor.status_message, filename);
+    if (!editor.headless) 
+        WatchFile(filename);
+    
+    // Open the file in read mode
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) { // The file doesn't exist
+        s_ArrayAppend(array_buffer ,"");
+        return;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+        editor.disk_stat = file_stat;
+        editor.disk_stat_valid = 1;
+    }
+
+    // gzip and zstd files are decompressed as they're read
+    editor.compression = editor.disk_stat_valid ? FileCompression(fd) : UNCOMPRESSED;
+    if (editor.compression != UNCOMPRESSED) {
+        String* partial = StringInit();
+        if (!DecompressFile(fd, editor.compression, array_buffer, partial)) 
+            CommandError("Couldn't decompress file");
+        ArrayAppend(array_buffer, partial); // the last line, empty after a final newline
+        close(fd);
+        return;
+    }
+
+    // a large file opened before is built from its cached index
+    int indexed = !editor.headless && editor.disk_stat_valid && file_stat.st_size >= INDEX_CACHE_MIN;
+    if (indexed && LoadIndexCache(filename, fd, &file_stat)) {
+        close(fd);
+        return;
+    }
+
+    if (editor.disk_stat_valid && file_stat.st_size > 0) {
+        char* text = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text != MAP_FAILED) {
+            LoadLines(text, file_stat.st_size, array_buffer);
+            munmap(text, file_stat.st_size);
+            close(fd);
+            if (indexed) 
+                SaveIndexCache(filename, &file_stat);
+            return;
+        }
+    }
+
+    // not something that can be mapped, read it line by line
+    FILE *fptr = fdopen(fd, "r");
+    char* buffer = NULL; 
+    size_t len;
+
+    int last_line = 1;
+    ssize_t sz;
+    while ((sz = getline(&buffer, &len, fptr)) != -1) {
+        if (buffer[sz-1] == '\n') {
+            sz--;
+        } else {
+            last_line = 0;
+        }
+
+        s_ArrayAppendN(array_buffer, buffer, sz);
+    }
+
+    if (last_line) {
+        s_ArrayAppend(array_buffer, "");
+    }
+    free(buffer);
+    fclose(fptr);
+}
+
+void FoldsChanged(); // with the cursor movement, it puts the view back on shown lines
+void ScrollToCursor(); // brings the cursor back into view
+void CalculateCursorX(); // puts the cursor on screen where its column is
+
+// The status line under a window of a split screen: the file and the cursor position, the active window's in bold
+void WindowStatusLine(String* out, int active) {
+    char position[40];
+    size_t position_len = snprintf(position, sizeof(position), " %d,%d ", editor.cur_line + 1, editor.cur_column + 1);
+    size_t room = (editor.window_cols > position_len) ? editor.window_cols - position_len : 0;
+
+    String* text = StringInit();
+    StringAppend(text, " ");
+    StringAppend(text, editor.file_name->size ? editor.file_name->str : editor.from_stdin ? "[stdin]" : "[No Name]");
+    if (editor.buffer_modified) 
+        StringAppend(text, " [+]");
+    if (text->size > room) 
+        StringResize(text, room);
+    StringPad(text, room);
+    StringAppendN(text, position, min(position_len, editor.window_cols - room));
+
+    WindowMoveTo(out, editor.window_rows - 1, 0);
+    StringAppend(out, active ? REVERSE BOLD_ON : REVERSE);
+    StringAppendN(out, text->str, text->size);
+    StringAppend(out, COLOR_RESET);
+    StringDestroy(text);
+}
+
+// Draw the loaded window sending only what differs from its last frame: nothing when idle,
+// a scroll and the exposed rows when start_line moved, the whole window otherwise.
+// An edit redraws the windows showing the changed lines, the others are left alone
+void DrawWindow(String* out, int active) {
+    Frame* frame = &editor.frame;
+    Window* window = editor.window;
+    int resized = frame->window_rows != editor.window_rows || frame->window_cols != editor.window_cols;
+    int moved = !frame->valid || resized || frame->top != window->top || frame->left != window->left;
+    if (resized) 
+        ScrollToCursor();
+    // an edit can leave the cursor or the top of the view inside a closed fold
+    if (editor.folds.size > 0 && (VisibleLine(editor.cur_line) != editor.cur_line || VisibleLine(editor.start_line) != editor.start_line)) 
+        FoldsChanged();
+    // the lines in view widen the columns before they're drawn, the cursor moves with its column
+    unsigned long table_tick = 0;
+    if (editor.table) {
+        TableFit();
+        table_tick = editor.table->tick;
+        if (table_tick != frame->table_tick) 
+            CalculateCursorX();
+    }
+    int text_area = editor.window_rows - 1;
+    int welcome = !editor.file_opened && !editor.from_stdin && !editor.buffer_modified;
+    int selection_moved = IsVisualMode() && (frame->cur_line != editor.cur_line || frame->cur_column != editor.cur_column 
+                          || frame->v_start_line != editor.v_start_line || frame->v_start_col != editor.v_start_col);
+    int text_changed = (frame->to_end || editor.changed_line <= frame->end_line) && editor.changed_end >= frame->start_line;
+    int same_text = frame->valid && !moved && !text_changed && frame->mode == editor.mode 
+                    && frame->welcome == welcome && !selection_moved 
+                    && frame->table_tick == table_tick && frame->table_left == editor.table_left;
+
+    SpanList* spans = SpanListInit();
+    if (same_text && frame->start_line == editor.start_line) {
+        // the text area is already on screen
+    } else {
+        if (!(same_text && ScrollText(out, spans))) {
+            frame->text_rows = DrawTextRows(out, 0, text_area, spans);
+            if (welcome) {
+                ShowWelcomeMessage(out);
+            }
+        }
+        frame->end_line = max(editor.end_line, editor.start_line);
+        frame->to_end = NextLine(frame->end_line) >= (int)array_buffer->size;
+    }
+    SpanListDestroy(spans);
+
+    if (moved) {
+        // the column between the window and its neighbour on the right
+        if (window->left + editor.window_cols < editor.screen_cols) {
+            for (size_t row = 0; row < editor.window_rows; row++) {
+                WindowMoveTo(out, row, editor.window_cols);
+                StringAppend(out, "|");
+            }
+        }
+        StringClear(frame->status);
+    }
+    if (editor.window_count > 1) {
+        String* status = StringInit();
+        WindowStatusLine(status, active);
+        if (status->size != frame->status->size || memcmp(status->str, frame->status->str, status->size) != 0) {
+            StringAppendN(out, status->str, status->size);
+            StringSwap(frame->status, status);
+        }
+        StringDestroy(status);
+    }
+
+    frame->valid = 1;
+    frame->start_line = editor.start_line;
+    frame->mode = editor.mode;
+    frame->window_rows = editor.window_rows;
+    frame->window_cols = editor.window_cols;
+    frame->top = window->top;
+    frame->left = window->left;
+    frame->welcome = welcome;
+    frame->v_start_line = editor.v_start_line;
+    frame->v_start_col = editor.v_start_col;
+    frame->cur_line = editor.cur_line;
+    frame->cur_column = editor.cur_column;
+    frame->table_tick = table_tick;
+    frame->table_left = editor.table_left;
+}
+
+// Draw a frame: every window sends what changed on it, then the status bar and the cursor if they moved.
+// The other windows are loaded in the editor fields in turn to be drawn, they don't show the selection
+void EditorClearScreen() {
+    Window* active = editor.window;
+    enum MODE mode = editor.mode;
+    String* out = StringInit();
+
+    WindowSave(active);
+    for (size_t i = 0; i < editor.window_count; i++) {
+        Window* window = editor.windows[i];
+        WindowLoad(window);
+        editor.mode = (window == active) ? mode : NORMAL;
+        DrawWindow(out, window == active);
+        WindowSave(window);
+    }
+    editor.mode = mode;
+    WindowLoad(active);
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        editor.buffers[i]->changed_line = INT_MAX;
+        editor.buffers[i]->changed_end = -1;
+    }
+    editor.changed_line = INT_MAX;
+    editor.changed_end = -1;
+
+    String* status = StringInit();
+    StatusBar(status);
+    if (status->size != editor.shown_status->size || memcmp(status->str, editor.shown_status->str, status->size) != 0) {
+        StringAppendN(out, status->str, status->size);
+        StringSwap(editor.shown_status, status);
+    }
+    StringDestroy(status);
+
+    char cursor_pos[32];
+    if (editor.mode == COMMAND_LINE) {
+        snprintf(cursor_pos, sizeof(cursor_pos), "\x1b[%zu;%dH", editor.screen_rows, editor.command_cursor_pos + 3);
+    } else {
+        snprintf(cursor_pos, sizeof(cursor_pos), "\x1b[%d;%dH", active->top + editor.cursor_y, active->left + editor.cursor_x);
+    }
+    if (out->size > 0 || strcmp(cursor_pos, editor.shown_cursor->str) != 0) {
+        StringAppend(out, cursor_pos);
+        StringAssign(editor.shown_cursor, cursor_pos);
+        write(STDOUT_FILENO, out->str, out->size);
+    }
+    StringDestroy(out);
+}
+
+int EditorReadKey() {
+    int read_ret;
+    char c;
+   
+    if ((read_ret = read(STDIN_FILENO, &c, 1)) == 0) return -1;
+
+    if (read_ret == -1 && errno != EAGAIN) {
+        ShowError("read");
+    }
+    if (c == ESC) {
+        char seq[3];
+        if (read(STDIN_FILENO, &seq[0], 1) != 1) return ESC;
+        if (read(STDIN_FILENO, &seq[1], 1) != 1) return ESC;
+
+        if (seq[0] == '[') {
+            switch (seq[1]) {
+                case 'A': return CURSOR_UP;
+                case 'B': return CURSOR_DOWN;
+                case 'C': return CURSOR_RIGHT;
+                case 'D': return CURSOR_LEFT;
+                case 'H': return HOME;
+                case 'F': return END;
+            }
+            if (seq[1] >= '1' && seq[1] <= '9') {
+                if (read(STDIN_FILENO, &seq[2], 1) != 1) return ESC;
+
+                if (seq[2] == '~' && seq[1] == '5') return PAGE_UP;
+                else if (seq[2] == '~' && seq[1] == '6') return PAGE_DOWN;
+                else if (seq[2] == '~' && seq[1] == '3') return DELETE;
+                else return ESC;
+            }
+        }
+        return ESC;
+    }
+    return c;
+}
+
+void CalculateCursorX() {
+    if (editor.table && array_buffer->size > 0) 
+        editor.cursor_x = TableCursorX() + 1;
+    else 
+        editor.cursor_x = (editor.cur_column % TextCols()) + 1;
+    if (editor.folds.size > 0 && ClosedFold(editor.cur_line) != NULL) 
+        editor.cursor_x = 1;
+    editor.cursor_x += DiffGutter();
+}
+
+void CalculateCursorY() {
+    if (editor.replaying) // done once when the replay ends
+        return;
+
+    editor.cursor_y = 1;
+    for (int line = editor.start_line; line < editor.cur_line; line = NextLine(line)) {
+        editor.cursor_y += LineRows(line);
+    }
+    if ((editor.folds.size == 0 || ClosedFold(editor.cur_line) == NULL) && !editor.table) 
+        editor.cursor_y += (editor.cur_column / TextCols());
+
+}
+
+// the lines above and below are the ones shown, closed folds are stepped over
+void ScrollUp() {
+    if (!editor.replaying && editor.start_line > 0 && editor.cursor_y <= 5) { // scroll up
+        editor.start_line = PrevLine(editor.start_line);
+        editor.end_line = PrevLine(editor.end_line);
+    }
+    editor.cur_line = PrevLine(editor.cur_line);
+}
+
+void ScrollDown() {
+    if (!editor.replaying && ((array_buffer->size) >= editor.window_rows) && NextLine(editor.end_line) < ((int)array_buffer->size) &&  editor.cursor_y >= ((int)editor.window_rows - 6)) { // scroll down
+        editor.start_line = NextLine(editor.start_line);
+        editor.end_line = NextLine(editor.end_line);
+    }
+    editor.cur_line = NextLine(editor.cur_line);
+}
+
+void GoToFileEnd() {
+    if (array_buffer->size <= 1) 
+        return;
+
+    editor.start_line = editor.cur_line = VisibleLine(array_buffer->size - 1); // in case of the number of lines is less than window size
+
+    int lines_needed = 0;
+    while (editor.start_line) {
+        // calculate number of lines in the terminal needed to render the current line
+        lines_needed += LineRows(editor.start_line);
+
+        if (lines_needed + 1 >= (int)editor.window_rows)
+            break;
+        editor.start_line = PrevLine(editor.start_line);
+    }
+    
+    editor.cur_column = editor.max_column = 0;
+    CalculateCursorX();
+    CalculateCursorY();
+}
+
+void GoToFileStart() {
+    if (array_buffer->size == 0) 
+        return;
+
+    editor.start_line = editor.cur_line = 0; // in case of the number of lines is less than window size
+    editor.cur_column = editor.max_column = 0;
+    CalculateCursorX();
+    CalculateCursorY();
+}
+
+// A fold changed, the screen can't be scrolled from the last frame and the view must not start inside a closed fold
+void FoldsChanged() {
+    editor.start_line = VisibleLine(editor.start_line);
+    editor.cur_line = VisibleLine(editor.cur_line);
+    RedrawWindows();
+    CalculateCursorX();
+    CalculateCursorY();
+}
+
+// Open the closed folds holding line
+void OpenFoldsAt(int line) {
+    long fold;
+    int opened = 0;
+    while ((fold = FoldTreeClosedAt(&editor.folds, line)) != -1) {
+        editor.folds.folds[fold].closed = 0;
+        FoldTreeFix(&editor.folds, 0, editor.folds.size, fold);
+        opened = 1;
+    }
+    if (opened) 
+        FoldsChanged();
+}
+
+// Scroll so a line sits in the middle of the view
+void CenterOnLine(int line) {
+    editor.start_line = line;
+    int lines_needed = LineRows(line);
+    while (editor.start_line > 0) {
+        int prev = PrevLine(editor.start_line);
+        lines_needed += LineRows(prev);
+        if (lines_needed >= (int)editor.window_rows / 2)
+            break;
+        editor.start_line = prev;
+    }
+    editor.end_line = line;
+}
+
+// The window changed size or the view was left behind by the lines moving, scroll so the cursor is in it
+void ScrollToCursor() {
+    CalculateCursorX();
+    CalculateCursorY();
+    if (editor.cursor_y + LineRows(editor.cur_line) - 1 > (int)editor.window_rows - 1) {
+        CenterOnLine(editor.cur_line);
+        CalculateCursorY();
+    }
+}
+
+// Jump to a line, centering the view on it when it's outside the rendered lines
+void GoToLine(int line) {
+    if (array_buffer->size == 0)
+        return;
+
+    line = VisibleLine(max(0, min(line, (int)array_buffer->size - 1)));
+    editor.cur_line = line;
+
+    if (line < editor.start_line || line > editor.end_line || editor.start_line >= (int)array_buffer->size) {
+        CenterOnLine(line);
+    }
+
+    editor.cur_column = editor.max_column = 0;
+    CalculateCursorX();
+    CalculateCursorY();
+}
+
+void MoveCursorAndScroll(int move) {
+    if (array_buffer->size == 0) return;
+    String* cur_line = array_buffer->array[editor.cur_line];
+
+    // up and down in a table keep the cursor in its field
+    int field = -1;
+    size_t offset = 0;
+    if (editor.table && (move == CURSOR_UP || move == 'k' || move == CURSOR_DOWN || move == 'j')) {
+        const TableRow* row = TableRowOf(editor.cur_line);
+        field = TableFieldAt(row, editor.cur_column);
+        offset = editor.cur_column - row->starts[field];
+    }
+
+    switch (move)
+    {
+    case CURSOR_UP:
+    case 'k':
+        if (editor.cur_line > 0) {
+            ScrollUp();
+            cur_line = array_buffer->array[editor.cur_line];
+        }
+        break;
+    case CURSOR_DOWN:
+    case 'j':
+        if (NextLine(editor.cur_line) < (int)array_buffer->size) {
+            ScrollDown();
+            cur_line = array_buffer->array[editor.cur_line];
+        }
+        break;
+    case CURSOR_RIGHT:
+    case 'l':
+        cur_line = array_buffer->array[editor.cur_line];
+        if (editor.cur_column < (int)cur_line->size)
+            editor.max_column = editor.cur_column + 1;
+        else if (NextLine(editor.cur_line) < (int)array_buffer->size) {
+            MoveCursorAndScroll(CURSOR_DOWN);
+            cur_line = array_buffer->array[editor.cur_line];
+            editor.max_column = 0;
+        }
+        break;
+    case CURSOR_LEFT:
+    case 'h':
+        if (editor.cur_column > 0)
+            editor.max_column = editor.cur_column - 1;
+        else if (editor.cur_line > 0) {
+            MoveCursorAndScroll(CURSOR_UP);
+            cur_line = array_buffer->array[editor.cur_line];
+            editor.max_column = cur_line->size;
+        }
+        break;
+    case PAGE_UP:
+        for (size_t i = 0; i < editor.window_rows; i++) {
+            MoveCursorAndScroll(CURSOR_UP);
+        }
+        cur_line = array_buffer->array[editor.cur_line];
+        break;
+    case PAGE_DOWN:
+        for (size_t i = 0; i < editor.window_rows; i++) {
+            MoveCursorAndScroll(CURSOR_DOWN);
+        }
+        cur_line = array_buffer->array[editor.cur_line];
+        break;
+    case HOME:
+        editor.max_column = 0;
+        break;
+    case END:
+        editor.max_column = cur_line->size;
+        break;
+    default:
+        ShowError("Not a valid move");
+        break;
+    }
+    if (field != -1) {
+        const TableRow* row = TableRowOf(editor.cur_line);
+        field = min(field, row->count - 1);
+        editor.max_column = row->starts[field] + min(offset, TableFieldSize(row, field, cur_line));
+    }
+    editor.cur_column = min(editor.max_column, cur_line->size);
+
+    CalculateCursorX();
+    CalculateCursorY();
+
+}
+
+// w and b in a table go to the start of the next / previous field, across lines
+void TableStep(int step) {
+    const TableRow* row = TableRowOf(editor.cur_line);
+    int field = TableFieldAt(row, editor.cur_column);
+    if (step > 0 && field + 1 < row->count) {
+        editor.cur_column = row->starts[field + 1];
+    } else if (step > 0 && NextLine(editor.cur_line) < (int)array_buffer->size) {
+        ScrollDown();
+        editor.cur_column = 0;
+    } else if (step < 0 && editor.cur_column > row->starts[field]) {
+        editor.cur_column = row->starts[field];
+    } else if (step < 0 && field > 0) {
+        editor.cur_column = row->starts[field - 1];
+    } else if (step < 0 && editor.cur_line > 0) {
+        ScrollUp();
+        row = TableRowOf(editor.cur_line);
+        editor.cur_column = row->starts[row->count - 1];
+    }
+    editor.max_column = editor.cur_column;
+    CalculateCursorX();
+    CalculateCursorY();
+}
+
+void MoveForward() {
+    if (editor.table) {
+        TableStep(1);
+        return;
+    }
+    int found_separtor = 0;
+    while ((editor.cur_line + 1) < (int)array_buffer->size || (editor.cur_column + 1) < (int)array_buffer->array[editor.cur_line]->size) {
+        char c = array_buffer->array[editor.cur_line]->str[editor.cur_column];
+        if (!IsKeyword(c)) {
+            found_separtor = 1;
+        }
+        if (found_separtor && IsKeyword(c)) {
+            break;
+        }
+        MoveCursorAndScroll(CURSOR_RIGHT);
+    }
+}
+
+void MoveBackward() {
+    if (editor.table) {
+        TableStep(-1);
+        return;
+    }
+    int found_separtor = 0;
+    while (editor.cur_line > 0 || editor.cur_column > 0) {
+        char c = array_buffer->array[editor.cur_line]->str[editor.cur_column];
+        if (!IsKeyword(c)) {
+            found_separtor = 1;
+        }
+        if (found_separtor && IsKeyword(c)) {
+            break;
+        }
+        MoveCursorAndScroll(CURSOR_LEFT);
+    }
+}
+
+void Motion(int key) {
+    switch (key)
+    {
+    case 'g':   
+        GoToFileStart();
+        break;
+    case 'G':
+        GoToFileEnd();
+        break;
+    case 'w':
+        editor.motion_count = max(1, editor.motion_count);
+        for (int i = 0; i < editor.motion_count; i++) {
             MoveForward();
         }
-        editor.motion_count = 0;
-        break;
-    case 'b':
-        editor.motion_count = max(1, editor.motion_count);
-        for (int i = 0; i < editor.motion_count; i++) {
-            MoveBackward();
+        editor.motion_count = 0;
+        break;
+    case 'b':
+        editor.motion_count = max(1, editor.motion_count);
+        for (int i = 0; i < editor.motion_count; i++) {
+            MoveBackward();
+        }
+        editor.motion_count = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+void NormalModeOn() {
+    editor.mode = NORMAL;
+    editor.motion_count = 0;
+    editor.register_name = 0;
+    editor.pending_key = 0;
+    StringAssign(editor.status_message, editor.file_name->str);
+}
+
+void VisualModeOn(enum MODE mode) {
+    editor.v_start_line = editor.cur_line;
+    editor.v_start_col = editor.cur_column;
+    editor.mode = mode;
+}
+
+// command line stuff
+// zf and zF: a closed fold over [first, last]. It may hold other folds or be held by them, not cross them
+void CreateFold(int first, int last) {
+    for (size_t i = 0; i < editor.folds.size; i++) {
+        Fold* fold = &editor.folds.folds[i];
+        if ((fold->start < first && fold->end >= first && fold->end < last) || (fold->start > first && fold->start <= last && fold->end > last)) {
+            StringAssign(editor.status_message, "Folds can't cross each other");
+            return;
+        }
+    }
+    FoldTreeAdd(&editor.folds, first, last, 1);
+    FoldTreeBuild(&editor.folds);
+    FoldsChanged();
+}
+
+typedef struct
+{
+    int line, indent;
+} IndentBlock;
+
+// Folds over the blocks of lines indented more than the line before them, nested as deep as the indentation.
+// Blank lines go with the block around them
+void IndentFolds() {
+    FoldTreeClear(&editor.folds);
+
+    IndentBlock* open = malloc((array_buffer->size + 1) * sizeof(IndentBlock));
+    if (open == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    int depth = 0, last_text = -1;
+
+    for (size_t i = 0; i <= array_buffer->size; i++) {
+        int indent = 0; // the end of the buffer closes every block
+        if (i < array_buffer->size) {
+            String* line = array_buffer->array[i];
+            size_t c = 0;
+            for (; c < line->size && (line->str[c] == ' ' || line->str[c] == '\t'); c++) {
+                indent = (line->str[c] == '\t') ? (indent / 8 + 1) * 8 : indent + 1;
+            }
+            if (c == line->size) // blank
+                continue;
+        }
+
+        while (depth > 0 && open[depth - 1].indent > indent) {
+            depth--;
+            if (last_text > open[depth].line) // a single line isn't worth a fold
+                FoldTreeAdd(&editor.folds, open[depth].line, last_text, 1);
+        }
+        if (i < array_buffer->size && indent > (depth ? open[depth - 1].indent : 0)) 
+            open[depth++] = (IndentBlock){i, indent};
+        last_text = i;
+    }
+    free(open);
+    FoldTreeBuild(&editor.folds);
+    FoldsChanged();
+}
+
+// The z commands, count is the one typed before z
+void FoldCommand(int key, int count) {
+    long fold;
+    switch (key)
+    {
+    case 'f': // zf in the visual modes folds the selected lines
+        if (IsVisualMode()) {
+            CreateFold(min(editor.v_start_line, editor.cur_line), max(editor.v_start_line, editor.cur_line));
+            NormalModeOn();
+        }
+        break;
+    case 'F':
+        CreateFold(editor.cur_line, min(editor.cur_line + max(1, count) - 1, array_buffer->size - 1));
+        break;
+    case 'o':
+        fold = FoldTreeClosedAt(&editor.folds, editor.cur_line);
+        if (fold != -1) {
+            editor.folds.folds[fold].closed = 0;
+            FoldTreeFix(&editor.folds, 0, editor.folds.size, fold);
+        }
+        break;
+    case 'c':
+        fold = FoldTreeInnermost(&editor.folds, editor.cur_line, 0);
+        if (fold != -1) {
+            editor.folds.folds[fold].closed = 1;
+            FoldTreeFix(&editor.folds, 0, editor.folds.size, fold);
+        }
+        break;
+    case 'R':
+    case 'M':
+        for (size_t i = 0; i < editor.folds.size; i++) {
+            editor.folds.folds[i].closed = (key == 'M');
+        }
+        FoldTreeFix(&editor.folds, 0, editor.folds.size, editor.folds.size);
+        break;
+    case 'd':
+        fold = FoldTreeInnermost(&editor.folds, editor.cur_line, 1);
+        if (fold != -1) {
+            editor.folds.folds[fold].end = -1;
+            FoldTreeBuild(&editor.folds);
+        }
+        break;
+    case 'E':
+        FoldTreeClear(&editor.folds);
+        break;
+    default:
+        return;
+    }
+    FoldsChanged();
+}
+
+size_t LayoutIndex(Layout* node) {
+    size_t i = 0;
+    while (node->parent->children[i] != node) i++;
+    return i;
+}
+
+void LayoutAdd(Layout* node, size_t at, Layout* child) {
+    node->children = realloc(node->children, (node->size + 1) * sizeof(Layout*));
+    if (node->children == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    memmove(&node->children[at + 1], &node->children[at], (node->size - at) * sizeof(Layout*));
+    node->children[at] = child;
+    node->size++;
+    child->parent = node;
+}
+
+void LayoutRemove(Layout* node, size_t at) {
+    memmove(&node->children[at], &node->children[at + 1], (node->size - at - 1) * sizeof(Layout*));
+    node->size--;
+}
+
+size_t WindowIndex(Window* window) {
+    size_t i = 0;
+    while (editor.windows[i] != window) i++;
+    return i;
+}
+
+// Split the active window in two with the same view, the new one goes above it (left of it for a vertical split) and becomes active.
+// Returns 0 if there's no room for it
+int SplitWindow(int vertical) {
+    Window* active = editor.window;
+    if (vertical ? editor.window_cols < 3 : editor.window_rows < 4 + (editor.window_count == 1)) {
+        CommandError("Not enough room");
+        return 0;
+    }
+    WindowSave(active);
+    Window* window = WindowInit();
+    String* status = window->frame.status;
+    *window = *active;
+    window->frame.valid = 0;
+    window->frame.status = status;
+
+    // a node splitting the other way gets a node in place of the window
+    Layout* node = active->node, *parent = node->parent;
+    if (parent == NULL || parent->vertical != vertical) {
+        Layout* split = LayoutInit(NULL);
+        split->vertical = vertical;
+        if (parent == NULL) {
+            editor.layout = split;
+        } else {
+            parent->children[LayoutIndex(node)] = split;
+            split->parent = parent;
+        }
+        LayoutAdd(split, 0, node);
+        parent = split;
+    }
+    LayoutAdd(parent, LayoutIndex(node), LayoutInit(window));
+
+    editor.windows = realloc(editor.windows, (editor.window_count + 1) * sizeof(Window*));
+    if (editor.windows == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    size_t at = WindowIndex(active);
+    memmove(&editor.windows[at + 1], &editor.windows[at], (editor.window_count - at) * sizeof(Window*));
+    editor.windows[at] = window;
+    editor.window_count++;
+
+    editor.window = window;
+    LayoutWindows();
+    WindowLoad(window);
+    return 1;
+}
+
+int FinishSave(int wait); // a save belongs to the buffer in the editor fields
+
+// Close a window, its neighbours share its area and the one above it or left of it becomes active
+// (the one after it for the first one). A node left with one child is replaced by it
+void CloseWindow(Window* window) {
+    if (editor.window_count == 1) {
+        CommandError("Cannot close last window");
+        return;
+    }
+    Buffer* buffer = window->buffer;
+    BufferKeepView(window);
+    Layout* node = window->node, *parent = node->parent;
+    size_t index = LayoutIndex(node);
+    Layout* next = parent->children[(index > 0) ? index - 1 : 1];
+    while (next->window == NULL) {
+        next = next->children[(index > 0) ? next->size - 1 : 0];
+    }
+    LayoutRemove(parent, index);
+    LayoutDestroy(node);
+    if (parent->size == 1) {
+        Layout* child = parent->children[0], *above = parent->parent;
+        parent->size = 0;
+        if (above == NULL) {
+            editor.layout = child;
+            child->parent = NULL;
+        } else if (child->window == NULL && child->vertical == above->vertical) {
+            // its children join the node above, splitting the same way
+            size_t at = LayoutIndex(parent);
+            LayoutRemove(above, at);
+            for (size_t i = 0; i < child->size; i++) {
+                LayoutAdd(above, at + i, child->children[i]);
+            }
+            child->size = 0;
+            LayoutDestroy(child);
+        } else {
+            above->children[LayoutIndex(parent)] = child;
+            child->parent = above;
+        }
+        LayoutDestroy(parent);
+    }
+
+    size_t at = WindowIndex(window);
+    memmove(&editor.windows[at], &editor.windows[at + 1], (editor.window_count - at - 1) * sizeof(Window*));
+    editor.window_count--;
+    if (window == editor.window) {
+        if (next->window->buffer != editor.buffer) 
+            FinishSave(1);
+        editor.window = next->window;
+        LayoutWindows();
+        WindowLoad(editor.window);
+    } else {
+        LayoutWindows();
+    }
+    WindowDestroy(window);
+    BufferHidden(buffer);
+}
+
+// Close every window but the active one
+void OnlyWindow() {
+    Window** windows = editor.windows;
+    size_t count = editor.window_count;
+    editor.windows = malloc(sizeof(Window*));
+    if (editor.windows == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    editor.windows[0] = editor.window;
+    editor.window_count = 1;
+    for (size_t i = 0; i < count; i++) {
+        Window* window = windows[i];
+        if (window == editor.window) 
+            continue;
+        Buffer* buffer = window->buffer;
+        BufferKeepView(window);
+        WindowDestroy(window);
+        BufferHidden(buffer);
+    }
+    free(windows);
+    LayoutDestroy(editor.layout);
+    editor.layout = LayoutInit(editor.window);
+    LayoutWindows();
+}
+
+void GoToWindow(Window* window) {
+    if (window == NULL || window == editor.window) 
+        return;
+    if (window->buffer != editor.buffer) 
+        FinishSave(1);
+    WindowSave(editor.window);
+    WindowLoad(window);
+    ScrollToCursor();
+}
+
+// The window covering a screen position, its separator included. NULL if there is none
+Window* WindowAt(int row, int col) {
+    for (size_t i = 0; i < editor.window_count; i++) {
+        Window* window = editor.windows[i];
+        if (row >= window->top && row < window->top + (int)window->rows && col >= window->left && col <= window->left + (int)window->cols) 
+            return window;
+    }
+    return NULL;
+}
+
+void ExecuteCommand(); // Ctrl-W q runs :q
+
+// The second key of Ctrl-W
+void WindowCommand(int key, int count) {
+    size_t index = WindowIndex(editor.window);
+    for (int i = 0; i < max(1, count); i++) {
+        Window* window = editor.window;
+        int row = window->top + editor.cursor_y - 1, col = window->left + editor.cursor_x - 1;
+        switch (key) {
+        case 'h':
+        case CTRL_KEY('h'):
+        case CURSOR_LEFT:
+            GoToWindow(WindowAt(row, window->left - 2));
+            break;
+        case 'l':
+        case CTRL_KEY('l'):
+        case CURSOR_RIGHT:
+            GoToWindow(WindowAt(row, window->left + window->cols + 1));
+            break;
+        case 'k':
+        case CTRL_KEY('k'):
+        case CURSOR_UP:
+            GoToWindow(WindowAt(window->top - 1, col));
+            break;
+        case 'j':
+        case CTRL_KEY('j'):
+        case CURSOR_DOWN:
+            GoToWindow(WindowAt(window->top + window->rows, col));
+            break;
+        }
+    }
+
+    switch (key) {
+    case 's':
+    case 'S':
+    case CTRL_KEY('s'):
+        SplitWindow(0);
+        break;
+    case 'v':
+    case CTRL_KEY('v'):
+        SplitWindow(1);
+        break;
+    case 'w':
+    case CTRL_KEY('w'):
+        GoToWindow(editor.windows[(count > 0) ? (size_t)min(count, editor.window_count) - 1 : (index + 1) % editor.window_count]);
+        break;
+    case 'W':
+        GoToWindow(editor.windows[(count > 0) ? (size_t)min(count, editor.window_count) - 1 : (index + editor.window_count - 1) % editor.window_count]);
+        break;
+    case 't':
+    case CTRL_KEY('t'):
+        GoToWindow(editor.windows[0]);
+        break;
+    case 'b':
+    case CTRL_KEY('b'):
+        GoToWindow(editor.windows[editor.window_count - 1]);
+        break;
+    case 'c':
+        CloseWindow(editor.window);
+        break;
+    case 'q':
+    case CTRL_KEY('q'):
+        StringAssign(editor.command, "q"); // the last window quits like :q
+        ExecuteCommand();
+        break;
+    case 'o':
+    case CTRL_KEY('o'):
+        OnlyWindow();
+        break;
+    default:
+        break;
+    }
+}
+
+int SameFileState(const struct stat* a, const struct stat* b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// writev that keeps going after short writes
+int WriteAllV(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++, count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Write lines from line on straight from the given line store, newlines go between lines only.
+// progress follows the bytes written if given. Returns the number of bytes written or -1
+off_t WriteLines(int fd, Array* lines, size_t line, atomic_llong* progress) {
+    off_t total = 0;
+    while (line < lines->size) {
+        struct iovec iov[IOV_BATCH];
+        int count = 0;
+        for (; line < lines->size && count + 2 <= IOV_BATCH; line++) {
+            iov[count].iov_base = lines->array[line]->str;
+            iov[count++].iov_len = lines->array[line]->size;
+            total += lines->array[line]->size;
+            if (line + 1 < lines->size) {
+                iov[count].iov_base = "\n";
+                iov[count++].iov_len = 1;
+                total++;
+            }
+        }
+        if (WriteAllV(fd, iov, count) == -1) 
+            return -1;
+        if (progress != NULL) 
+            atomic_store(progress, total);
+    }
+    return total;
+}
+
+// copy the first len bytes of src into dst inside the kernel (shared extents where the fs can),
+// the file offset of dst ends up after them
+int CopyFilePrefix(int src, int dst, off_t len) {
+    off_t in = 0;
+    while (in < len) {
+        ssize_t copied = copy_file_range(src, &in, dst, NULL, len - in, 0);
+        if (copied == -1 && errno == EINTR) continue;
+        if (copied <= 0) return 0;
+    }
+    return 1;
+}
+
+// A save running in the background on a snapshot of the line store. The snapshot retains its lines,
+// so edits made meanwhile clone a line before changing it and the thread only ever reads unchanged text.
+// Reference counts are only touched by the main thread, which takes and drops the snapshot
+typedef struct
+{
+    pthread_t thread;
+    int running; // started and not joined yet
+    Array* lines;
+    int fd, src; // src is where the unchanged prefix is copied from, -1 if it isn't
+    int pipe; // the lines go to the compressor through it, -1 when they're written to fd
+    pid_t compressor;
+    size_t first;
+    off_t prefix, size; // set by the thread, size is what the file ended up as
+    off_t to_write; // bytes after the prefix, for the progress
+    int own_file;
+    int dirty_line; // editor.dirty_line when the snapshot was taken
+    atomic_llong written;
+    atomic_int done;
+    int failed;
+    struct stat stat;
+    int stat_valid;
+} SaveJob;
+
+_Thread_local SaveJob save_job;
+
+void* SaveWorker(void* arg) {
+    SaveJob* job = arg;
+
+    if (job->src != -1) {
+        if (!CopyFilePrefix(job->src, job->fd, job->prefix)) { // write it all from memory instead
+            job->first = 0, job->prefix = 0;
+            if (lseek(job->fd, 0, SEEK_SET) == -1 || ftruncate(job->fd, 0) == -1) 
+                job->failed = 1;
+        }
+        close(job->src);
+    }
+
+    if (job->pipe != -1) {
+        // the compressor writes the file, it's done when it exits
+        off_t written = WriteLines(job->pipe, job->lines, 0, &job->written);
+        close(job->pipe);
+        job->failed = !FinishCompressor(job->compressor) || written == -1;
+    } else if (!job->failed) {
+        off_t written = WriteLines(job->fd, job->lines, job->first, &job->written);
+        job->failed = (written == -1 || ftruncate(job->fd, job->prefix + written) == -1);
+        job->size = job->prefix + written;
+    }
+    job->stat_valid = !job->failed && fstat(job->fd, &job->stat) == 0;
+    if (job->pipe != -1 && job->stat_valid) 
+        job->size = job->stat.st_size;
+    close(job->fd);
+
+    atomic_store(&job->done, 1);
+    return NULL;
+}
+
+// Report the progress of the background save, or join it once it's done (right away with wait).
+// Returns 0 if the save failed
+int FinishSave(int wait) {
+    SaveJob* job = &save_job;
+    if (!job->running) 
+        return 1;
+
+    char message[40];
+    if (!wait && !atomic_load(&job->done)) {
+        long long percent = job->to_write > 0 ? atomic_load(&job->written) * 100 / job->to_write : 0;
+        if (percent > 100) 
+            percent = 100;
+        snprintf(message, sizeof(message), "Writing... %lld%%", percent);
+        StringAssign(editor.status_message, message);
+        return 1;
+    }
+
+    pthread_join(job->thread, NULL);
+    job->running = 0;
+
+    if (job->failed) {
+        // the snapshot's changes are still unsaved
+        if (job->own_file) {
+            editor.buffer_modified = 1;
+            if (editor.dirty_line == -1 || (job->dirty_line != -1 && job->dirty_line < editor.dirty_line)) 
+                editor.dirty_line = job->dirty_line;
+        }
+        CommandError("Couldn't write file");
+    } else {
+        if (job->own_file) {
+            editor.disk_stat = job->stat;
+            editor.disk_stat_valid = job->stat_valid;
+            if (editor.buffer == editor.diff.side[0] && editor.diff.side[1] == NULL) 
+                editor.diff.stale = 1;
+        }
+        snprintf(message, sizeof(message), "%zuL, %lldB written", job->lines->size, (long long)job->size);
+        StringAssign(editor.status_message, message);
+    }
+
+    ArrayDestroy(job->lines);
+    free(job->lines);
+    return !job->failed;
+}
+
+// Copy the text of the lines that borrow it from [from, from + size). The file under it only holds the first
+// readable bytes now, lines reaching past them lose their text. Returns how many did
+size_t OwnBorrowed(Array* lines, const char* from, size_t size, size_t readable) {
+    size_t lost = 0;
+    if (lines == NULL)
+        return 0;
+    for (size_t i = 0; i < lines->size; i++) {
+        String* line = lines->array[i];
+        if (line->capacity > 0 || line->str < from || line->str > from + size)
+            continue;
+        if (line->size > 0 && line->str + line->size > from + readable) {
+            line->str = (char*)"";
+            line->size = 0;
+            lost++;
+        } else {
+            StringOwn(line);
+        }
+    }
+    return lost;
+}
+
+// The file a buffer maps is about to be written over past keep bytes, or it changed on disk and holds readable
+// bytes now. Whatever borrows its text from there gets its own copy first: the lines of every buffer, the registers
+// and the lines diff mode read. Returns how many lines lost their text, the mapping is marked damaged then
+size_t OwnMapped(Buffer* buffer, size_t keep, size_t readable) {
+    if (buffer->mapped == NULL || keep >= buffer->mapped_size)
+        return 0;
+    CancelWords();
+    const char* from = buffer->mapped + keep;
+    size_t size = buffer->mapped_size - keep, lost = 0;
+    readable = (readable > keep) ? readable - keep : 0;
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        Buffer* other = editor.buffers[i];
+        lost += OwnBorrowed(other == editor.buffer ? array_buffer : other->lines, from, size, readable);
+    }
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        lost += OwnBorrowed(editor.registers[i].lines, from, size, readable);
+    }
+    lost += OwnBorrowed(editor.diff.disk, from, size, readable);
+    if (lost > 0) 
+        mapped_files[buffer->mapping].damaged = 1;
+    return lost;
+}
+
+// Text of the file the buffer maps was lost when it shrank
+int BufferDamaged(Buffer* buffer) {
+    return buffer->mapped != NULL && mapped_files[buffer->mapping].damaged;
+}
+
+// Save the buffer, only what changed since the file was read or saved gets written:
+// the unchanged lines before editor.dirty_line are kept in place when saving over the same file,
+// and copied with copy_file_range when saving to another one.
+// The writing happens on a thread, FinishSave reports when it's done. Returns 0 if it couldn't start
+int SaveBuffer(String* filename) {
+    // one save at a time
+    FinishSave(1);
+
+    // the file is the same under another name too (./name, a link)
+    struct stat disk, target;
+    int on_disk = editor.file_opened && stat(editor.file_name->str, &disk) == 0;
+    int target_exists = stat(filename->str, &target) == 0;
+    int own_file = editor.file_opened && (strcmp(filename->str, editor.file_name->str) == 0 || 
+                   (on_disk && target_exists && disk.st_dev == target.st_dev && disk.st_ino == target.st_ino));
+    int disk_matches = on_disk && editor.disk_stat_valid && SameFileState(&disk, &editor.disk_stat);
+
+    if (own_file && disk_matches && editor.dirty_line == -1) {
+        StringAssign(editor.status_message, "No changes to write");
+        return 1;
+    }
+
+    // a compressed file is written whole through the compressor, in the format it was read in or the one its name says.
+    // Nothing can be copied from a compressed file on disk either
+    enum COMPRESSION compression = (own_file && editor.compression != UNCOMPRESSED) ? editor.compression : NameCompression(filename->str);
+    if (compression != UNCOMPRESSED || editor.compression != UNCOMPRESSED) 
+        disk_matches = 0;
+    if (compression != UNCOMPRESSED && !CompressorAvailable(compression)) {
+        CommandError(compression == GZIP ? "gzip not found" : "zstd not found");
+        return 0;
+    }
+
+    size_t first = 0;
+    off_t prefix = 0;
+    if (disk_matches) {
+        first = (editor.dirty_line == -1) ? array_buffer->size : (size_t)editor.dirty_line;
+        if (first > array_buffer->size)
+            first = array_buffer->size;
+        for (size_t i = 0; i < first; i++) {
+            prefix += array_buffer->array[i]->size + 1;
+        }
+        // the last line of the file has no newline after it
+        while (first > 0 && prefix > disk.st_size) {
+            first--;
+            prefix -= array_buffer->array[first]->size + 1;
+        }
+    }
+
+    // a mapping sees the file being written: in place the text after the prefix changes, truncated all of it goes.
+    // Any buffer may map the file written to
+    if (target_exists) {
+        for (size_t i = 0; i < editor.buffer_count; i++) {
+            Buffer* buffer = editor.buffers[i];
+            if (buffer->mapped && buffer->mapped_stat.st_dev == target.st_dev && buffer->mapped_stat.st_ino == target.st_ino) {
+                size_t readable = ((size_t)target.st_size < buffer->mapped_size) ? (size_t)target.st_size : buffer->mapped_size;
+                OwnMapped(buffer, (buffer == editor.buffer && own_file && disk_matches) ? (size_t)prefix : 0, readable);
+            }
+        }
+    }
+    if (BufferDamaged(editor.buffer)) {
+        CommandError("Not saved: text lost when file shrank");
+        return 0;
+    }
+
+    int fd, src = -1;
+    if (own_file && disk_matches) {
+        fd = open(filename->str, O_WRONLY | O_CLOEXEC);
+        if (fd != -1 && lseek(fd, prefix, SEEK_SET) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = open(filename->str, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd != -1 && prefix > 0) {
+            src = open(editor.file_name->str, O_RDONLY | O_CLOEXEC);
+            if (src == -1) // write it all from memory instead
+                first = 0, prefix = 0;
+        }
+    }
+
+    if (fd == -1) {
+        CommandError("Couldn't open file");
+        return 0;
+    }
+
+    int compress[2] = {-1, -1};
+    pid_t compressor = -1;
+    if (compression != UNCOMPRESSED) {
+        if (pipe2(compress, O_CLOEXEC) == 0) {
+            compressor = StartCompressor(compression, 0, compress[0], fd);
+            close(compress[0]);
+        }
+        if (compressor == -1) {
+            if (compress[1] != -1) 
+                close(compress[1]);
+            close(fd);
+            CommandError("Couldn't start the compressor");
+            return 0;
+        }
+    }
+
+    // the snapshot: one pointer and one reference per line
+    SaveJob* job = &save_job;
+    job->lines = ArrayInit();
+    ArrayReserve(job->lines, array_buffer->size);
+    off_t size = 0;
+    for (size_t i = 0; i < array_buffer->size; i++) {
+        job->lines->array[i] = StringRetain(array_buffer->array[i]);
+        size += array_buffer->array[i]->size + (i + 1 < array_buffer->size);
+    }
+    job->lines->size = array_buffer->size;
+
+    job->fd = fd, job->src = src;
+    job->pipe = compress[1], job->compressor = compressor;
+    job->first = first, job->prefix = prefix;
+    job->to_write = size - prefix;
+    job->own_file = own_file;
+    job->dirty_line = editor.dirty_line;
+    atomic_store(&job->written, 0);
+    atomic_store(&job->done, 0);
+    job->failed = 0;
+
+    // edits made while the thread writes mark the buffer dirty again
+    if (own_file) {
+        editor.dirty_line = -1;
+        editor.buffer_modified = 0;
+    }
+
+    if (pthread_create(&job->thread, NULL, SaveWorker, job) != 0) {
+        SaveWorker(job);
+    }
+    job->running = 1;
+    FinishSave(0);
+    return 1;
+}
+
+// Ex ranges, lines are 0 based and inclusive
+typedef struct
+{
+    int given;
+    int start, end;
+} Range;
+
+// The last line ranges reach: the newline ending a file reads as an empty line after it, which they leave alone
+int LastRangeLine() {
+    int last = (int)array_buffer->size - 1;
+    if (last > 0 && array_buffer->array[last]->size == 0) 
+        last--;
+    return last;
+}
+
+// Parse a line address (1 based, 0 is before the first line) like 12, ., $, .+3 or $-1
+int ParseAddress(const char** cmd, int* addr) {
+    const char* p = *cmd;
+
+    if (isdigit(*p)) {
+        *addr = 0;
+        while (isdigit(*p)) {
+            *addr = min(*addr * 10 + (*p - '0'), 1e9);
+            p++;
+        }
+    } else if (*p == '.') {
+        *addr = editor.cur_line + 1;
+        p++;
+    } else if (*p == '$') {
+        *addr = LastRangeLine() + 1;
+        p++;
+    } else if (*p == '+' || *p == '-') { // offset from the current line
+        *addr = editor.cur_line + 1;
+    } else {
+        return 0;
+    }
+
+    while (*p == '+' || *p == '-') {
+        int sign = (*p == '+') ? 1 : -1, offset = 0;
+        p++;
+        if (!isdigit(*p)) 
+            offset = 1;
+        while (isdigit(*p)) {
+            offset = min(offset * 10 + (*p - '0'), 1e9);
+            p++;
+        }
+        *addr += sign * offset;
+    }
+
+    *cmd = p;
+    return 1;
+}
+
+// Parse the [range] prefix of a command, the range defaults to the current line
+int ParseRange(const char** cmd, Range* range) {
+    const char* p = *cmd;
+    while (*p == ' ') p++;
+
+    range->given = 0;
+    range->start = range->end = editor.cur_line;
+
+    if (*p == '%') {
+        range->given = 2;
+        range->start = 0, range->end = LastRangeLine();
+        p++;
+    } else {
+        int first, second;
+        if (ParseAddress(&p, &first)) {
+            range->given = 1;
+            second = first;
+            if (*p == ',') {
+                p++;
+                if (!ParseAddress(&p, &second)) return 0;
+                range->given = 2;
+            }
+            if (first > second) {
+                int tmp = first;
+                first = second, second = tmp;
+            }
+            if (first < 0) return 0;
+
+            // past the end is the last line
+            int last = LastRangeLine() + 1;
+            range->start = max(min(first, last), 1) - 1;
+            range->end = max(min(second, last), 1) - 1;
+        }
+    }
+
+    *cmd = p;
+    return 1;
+}
+
+// Match an abbreviated command name (at least min_len chars of name)
+int MatchCommandName(const char** cmd, const char* name, size_t min_len) {
+    size_t len = 0;
+    while (isalpha((*cmd)[len])) len++;
+
+    if (len < min_len || len > strlen(name) || strncmp(*cmd, name, len) != 0)
+        return 0;
+
+    *cmd += len;
+    return 1;
+}
+
+// Extract a pattern ended by delim, an escaped delimiter is taken literally
+void ExtractPattern(const char** cmd, char delim, String* pattern) {
+    const char* p = *cmd;
+    while (*p && *p != delim) {
+        if (*p == '\\' && p[1] == delim) {
+            p++;
+        } else if (*p == '\\' && p[1]) {
+            StringAppendN(pattern, p++, 1);
+        }
+        StringAppendN(pattern, p++, 1);
+    }
+    if (*p == delim) p++;
+    *cmd = p;
+}
+
+int ParseTargetAddress(const char** cmd, int* addr) {
+    while (**cmd == ' ') (*cmd)++;
+    if (!ParseAddress(cmd, addr) || *addr < 0) {
+        CommandError("Invalid address");
+        return 0;
+    }
+    *addr = min(*addr, LastRangeLine() + 1);
+    return 1;
+}
+
+// make sure the buffer keeps a line and the cursor lands on a valid one after a bulk edit
+void FinishBulkEdit(int first_changed, int line) {
+    MarkDirty(first_changed);
+    if (array_buffer->size == 0) {
+        s_ArrayAppend(array_buffer, "");
+    }
+    editor.start_line = min(editor.start_line, array_buffer->size - 1);
+    GoToLine(line);
+}
+
+void ExDelete(Range* range) {
+    int count = range->end - range->start + 1;
+    ArrayRemoveRange(array_buffer, range->start, range->end, NULL);
+    FinishBulkEdit(range->start, range->start);
+
+    char message[40];
+    snprintf(message, sizeof(message), "%d fewer lines", count);
+    StringAssign(editor.status_message, message);
+}
+
+void ExMove(Range* range, int dest) {
+    if (dest > range->start && dest <= range->end) {
+        CommandError("Cannot move a range into itself");
+        return;
+    }
+
+    int count = range->end - range->start + 1;
+    Array* moved = ArrayInit();
+    ArrayRemoveRange(array_buffer, range->start, range->end, moved);
+    if (dest > range->end) 
+        dest -= count;
+    ArrayInsertLines(array_buffer, dest, moved->array, moved->size);
+    free(moved->array);
+    free(moved);
+
+    FinishBulkEdit(min(range->start, dest), dest + count - 1);
+}
+
+void ExCopy(Range* range, int dest) {
+    int count = range->end - range->start + 1;
+    Array* copied = ArrayInit();
+    for (int i = range->start; i <= range->end; i++) {
+        ArrayAppend(copied, StringRetain(array_buffer->array[i]));
+    }
+    ArrayInsertLines(array_buffer, dest, copied->array, copied->size);
+    free(copied->array);
+    free(copied);
+
+    FinishBulkEdit(dest, dest + count - 1);
+}
+
+typedef struct
+{
+    regex_t regex;
+    String* replacement;
+    int global;
+} Substitute;
+
+// Parse /pattern/replacement/[g] where / is any delimiter
+// An empty pattern becomes the last one :s or :g used, a given one is kept as the last. Returns 0 if there's none yet
+int LastPattern(String* pattern) {
+    if (pattern->size > 0) {
+        StringAssign(editor.last_pattern, pattern->str);
+        return 1;
+    }
+    if (editor.last_pattern->size == 0) {
+        CommandError("No previous pattern");
+        return 0;
+    }
+    StringAssign(pattern, editor.last_pattern->str);
+    return 1;
+}
+
+int ParseSubstitute(const char** cmd, Substitute* sub) {
+    char delim = **cmd;
+    if (delim == 0 || isalnum(delim) || delim == ' ' || delim == '\\') {
+        CommandError("Invalid substitute");
+        return 0;
+    }
+    (*cmd)++;
+
+    String* pattern = StringInit();
+    ExtractPattern(cmd, delim, pattern);
+    if (!LastPattern(pattern)) {
+        StringDestroy(pattern);
+        return 0;
+    }
+    sub->replacement = StringInit();
+    ExtractPattern(cmd, delim, sub->replacement);
+
+    sub->global = 0;
+    while (**cmd == 'g') {
+        sub->global = 1;
+        (*cmd)++;
+    }
+
+    int failed = regcomp(&sub->regex, pattern->str, 0);
+    StringDestroy(pattern);
+    if (failed) {
+        StringDestroy(sub->replacement);
+        CommandError("Invalid pattern");
+        return 0;
+    }
+    return 1;
+}
+
+void SubstituteDestroy(Substitute* sub) {
+    regfree(&sub->regex);
+    StringDestroy(sub->replacement);
+}
+
+// Replace the matches in a line, the new line is built in result for the caller to swap in
+int SubstituteLine(String* line, Substitute* sub, String* result) {
+    regmatch_t match[10];
+    size_t pos = 0, last_end = (size_t)-1;
+    int count = 0, eflags = 0;
+
+    StringClear(result);
+    while (pos <= line->size) {
+        // REG_STARTEND bounds the search by the line size instead of a null, offsets are from the line start
+        match[0].rm_so = pos, match[0].rm_eo = line->size;
+        if (regexec(&sub->regex, line->str, 10, match, eflags | REG_STARTEND) != 0) 
+            break;
+        size_t start = match[0].rm_so, end = match[0].rm_eo;
+
+        if (start == end && start == last_end) { // an empty match right after the previous one doesn't count
+            if (start < line->size) 
+                StringAppendN(result, &line->str[start], 1);
+            pos = start + 1;
+            eflags = REG_NOTBOL;
+            continue;
+        }
+        StringAppendN(result, &line->str[pos], start - pos);
+
+        // expand & and \1..\9 in the replacement
+        String* rep = sub->replacement;
+        for (size_t i = 0; i < rep->size; i++) {
+            int group = -1;
+            if (rep->str[i] == '&') {
+                group = 0;
+            } else if (rep->str[i] == '\\' && i + 1 < rep->size) {
+                i++;
+                if (isdigit(rep->str[i])) {
+                    group = rep->str[i] - '0';
+                } else if (rep->str[i] == 't') {
+                    StringAppendN(result, "\t", 1);
+                    continue;
+                }
+            }
+
+            if (group == -1) {
+                StringAppendN(result, &rep->str[i], 1);
+            } else if (match[group].rm_so != -1) {
+                StringAppendN(result, line->str + match[group].rm_so, match[group].rm_eo - match[group].rm_so);
+            }
+        }
+        count++;
+        last_end = end;
+
+        if (start == end) { // empty match, step over a char to avoid looping forever
+            if (end < line->size) 
+                StringAppendN(result, &line->str[end], 1);
+            end++;
+        }
+        pos = end;
+        eflags = REG_NOTBOL;
+
+        if (!sub->global) break;
+    }
+
+    if (count == 0) 
+        return 0;
+
+    if (pos < line->size) 
+        StringAppendN(result, &line->str[pos], line->size - pos);
+    return count;
+}
+
+void ExSubstitute(const char* cmd, Range* range, const char* marks) {
+    Substitute sub;
+    if (!ParseSubstitute(&cmd, &sub))
+        return;
+
+    String* result = StringInit();
+    int substitutions = 0, lines = 0, first_line = -1, last_line = -1;
+    for (int i = range->start; i <= range->end; i++) {
+        if (marks != NULL && !marks[i]) 
+            continue;
+
+        int count = SubstituteLine(array_buffer->array[i], &sub, result);
+        if (count) {
+            ArraySwapLine(array_buffer, i, result);
+            substitutions += count;
+            lines++;
+            if (first_line == -1) 
+                first_line = i;
+            last_line = i;
+        }
+    }
+    StringDestroy(result);
+    SubstituteDestroy(&sub);
+
+    if (substitutions == 0) {
+        StringAssign(editor.status_message, "Pattern not found");
+        return;
+    }
+    FinishBulkEdit(first_line, last_line);
+
+    char message[40];
+    snprintf(message, sizeof(message), "%d substitutions on %d lines", substitutions, lines);
+    StringAssign(editor.status_message, message);
+}
+
+// :g/pattern/cmd and :v/pattern/cmd
+// Every matching line is marked first, then the command runs over the marks in a single pass
+void ExGlobal(const char* cmd, Range* range, int invert) {
+    char delim = *cmd;
+    if (delim == 0 || isalnum(delim) || delim == ' ' || delim == '\\') {
+        CommandError("Invalid global command");
+        return;
+    }
+    cmd++;
+
+    // the pattern is the last one before the command runs, so s//rep/ replaces what was matched
+    String* pattern = StringInit();
+    ExtractPattern(&cmd, delim, pattern);
+    if (!LastPattern(pattern)) {
+        StringDestroy(pattern);
+        return;
+    }
+    regex_t regex;
+    int failed = regcomp(&regex, pattern->str, REG_NOSUB);
+    StringDestroy(pattern);
+    if (failed) {
+        CommandError("Invalid pattern");
+        return;
+    }
+
+    if (range->given == 0) {
+        range->start = 0, range->end = LastRangeLine();
+    }
+
+    char* marks = calloc(array_buffer->size, 1);
+    if (marks == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+
+    int marked = 0, first_marked = -1;
+    for (int i = range->start; i <= range->end; i++) {
+        regmatch_t bounds = {0, array_buffer->array[i]->size};
+        int matched = (regexec(&regex, array_buffer->array[i]->str, 1, &bounds, REG_STARTEND) == 0);
+        if (matched != invert) {
+            marks[i] = 1;
+            marked++;
+            if (first_marked == -1) 
+                first_marked = i;
+        }
+    }
+    regfree(&regex);
+
+    while (*cmd == ' ') cmd++;
+    int dest;
+
+    if (marked == 0) {
+        StringAssign(editor.status_message, "Pattern not found");
+    } 
+    else if (MatchCommandName(&cmd, "delete", 1)) {
+        ArrayCompact(array_buffer, marks, NULL);
+        FinishBulkEdit(first_marked, editor.cur_line);
+
+        char message[40];
+        snprintf(message, sizeof(message), "%d fewer lines", marked);
+        StringAssign(editor.status_message, message);
+    } 
+    else if (MatchCommandName(&cmd, "move", 1)) {
+        if (ParseTargetAddress(&cmd, &dest)) {
+            // lines land below the target in the order vim would leave them:
+            // reversed under a fixed line (g/^/m0 reverses the file), in order at the end
+            int at_end = (dest == LastRangeLine() + 1), insert_at = 0;
+            for (int i = 0; i < dest; i++) {
+                insert_at += !marks[i];
+            }
+
+            Array* moved = ArrayInit();
+            ArrayCompact(array_buffer, marks, moved);
+            if (!at_end) {
+                for (size_t i = 0; i < moved->size / 2; i++) {
+                    String* tmp = moved->array[i];
+                    moved->array[i] = moved->array[moved->size - 1 - i];
+                    moved->array[moved->size - 1 - i] = tmp;
+                }
+            }
+            ArrayInsertLines(array_buffer, insert_at, moved->array, moved->size);
+            free(moved->array);
+            free(moved);
+
+            FinishBulkEdit(min(first_marked, insert_at), insert_at + marked - 1);
+        }
+    } 
+    else if (MatchCommandName(&cmd, "t", 1) || MatchCommandName(&cmd, "copy", 2)) {
+        if (ParseTargetAddress(&cmd, &dest)) {
+            int at_end = (dest == LastRangeLine() + 1);
+            Array* copied = ArrayInit();
+            for (size_t i = 0; i < array_buffer->size; i++) {
+                if (marks[i]) 
+                    ArrayAppend(copied, StringRetain(array_buffer->array[i]));
+            }
+            if (!at_end) {
+                for (size_t i = 0; i < copied->size / 2; i++) {
+                    String* tmp = copied->array[i];
+                    copied->array[i] = copied->array[copied->size - 1 - i];
+                    copied->array[copied->size - 1 - i] = tmp;
+                }
+            }
+            ArrayInsertLines(array_buffer, dest, copied->array, copied->size);
+            free(copied->array);
+            free(copied);
+
+            FinishBulkEdit(dest, dest + marked - 1);
+        }
+    } 
+    else if (MatchCommandName(&cmd, "substitute", 1)) {
+        ExSubstitute(cmd, range, marks);
+    } 
+    else {
+        CommandError("Unsupported :g command");
+    }
+
+    free(marks);
+}
+
+void ExSort(const char* cmd, Range* range) {
+    int flags = 0;
+    if (*cmd == '!') {
+        flags |= SORT_REVERSE;
+        cmd++;
+    }
+    for (; *cmd; cmd++) {
+        if (*cmd == 'u') flags |= SORT_UNIQUE;
+        else if (*cmd == 'n') flags |= SORT_NUMERIC;
+        else if (*cmd == 'r') flags |= SORT_REVERSE;
+        else if (*cmd != ' ') {
+            CommandError("Invalid sort flags");
+            return;
+        }
+    }
+
+    if (range->given == 0) {
+        range->start = 0, range->end = LastRangeLine();
+    }
+
+    size_t count = range->end - range->start + 1;
+    SortItem* items = malloc(count * sizeof(SortItem));
+    if (items == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        String* line = array_buffer->array[range->start + i];
+        items[i].line = line;
+        items[i].has_key = 0;
+        if (flags & SORT_NUMERIC) { // the key is the first decimal number in the line
+            for (size_t c = 0; c < line->size; c++) {
+                if (isdigit(line->str[c])) {
+                    items[i].key = strtoll(&line->str[c], NULL, 10);
+                    if (c > 0 && line->str[c - 1] == '-') 
+                        items[i].key = -items[i].key;
+                    items[i].has_key = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    ParallelSortItems(items, count, flags);
+
+    // put the sorted lines back, dropping repeated ones for :sort u
+    WordsFlush(array_buffer);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if ((flags & SORT_UNIQUE) && kept > 0 && CompareSortItems(&items[kept - 1], &items[i], flags) == 0) {
+            WordsCounted(array_buffer, items[i].line, -1);
+            StringDestroy(items[i].line);
+        } else {
+            items[kept++] = items[i];
+        }
+    }
+    for (size_t i = 0; i < kept; i++) {
+        array_buffer->array[range->start + i] = items[i].line;
+    }
+    if (kept < count) {
+        memmove(&array_buffer->array[range->start + kept], &array_buffer->array[range->end + 1], 
+                (array_buffer->size - range->end - 1) * sizeof(String*));
+        array_buffer->size -= count - kept;
+        LinesMoved(array_buffer, range->start + kept, count - kept, 0);
+    }
+    free(items);
+
+    FinishBulkEdit(range->start, range->start);
+
+    char message[64];
+    if (kept < count) 
+        snprintf(message, sizeof(message), "%zu lines sorted, %zu removed", kept, count - kept);
+    else 
+        snprintf(message, sizeof(message), "%zu lines sorted", count);
+    StringAssign(editor.status_message, message);
+}
+
+// Send as many lines of range as the pipe takes, *line and *offset track the next byte to send.
+// Returns 0 once everything was sent or the reader is gone
+int FilterWriteLines(int fd, Range* range, size_t* line, size_t* offset) {
+    while (*line <= (size_t)range->end) {
+        struct iovec iov[IOV_BATCH];
+        int count = 0;
+        for (size_t i = *line; i <= (size_t)range->end && count + 2 <= IOV_BATCH; i++) {
+            String* cur_line = array_buffer->array[i];
+            size_t skip = (i == *line) ? *offset : 0;
+            if (skip < cur_line->size) {
+                iov[count].iov_base = &cur_line->str[skip];
+                iov[count++].iov_len = cur_line->size - skip;
+            }
+            iov[count].iov_base = "\n";
+            iov[count++].iov_len = 1;
+        }
+
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1) 
+            return (errno == EAGAIN || errno == EINTR);
+
+        // advance past what was written, a line counts its newline as its last byte
+        size_t left = written;
+        while (left > 0) {
+            size_t line_left = array_buffer->array[*line]->size + 1 - *offset;
+            if (left < line_left) {
+                *offset += left;
+                break;
+            }
+            left -= line_left;
+            (*line)++;
+            *offset = 0;
+        }
+    }
+    return 0;
+}
+
+// :[range]w file writes the lines to another file
+void ExWrite(Range* range, const char* filename) {
+    while (*filename == ' ') filename++;
+    if (*filename == 0) {
+        CommandError("No file name");
+        return;
+    }
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        CommandError("Couldn't open file");
+        return;
+    }
+    // a regular file takes every write, the line stops short only on an error
+    size_t line = range->start, offset = 0;
+    while (FilterWriteLines(fd, range, &line, &offset));
+    if (close(fd) == -1 || line <= (size_t)range->end) {
+        CommandError("Couldn't write file");
+        return;
+    }
+
+    char message[64];
+    snprintf(message, sizeof(message), "%d lines written", range->end - range->start + 1);
+    StringAssign(editor.status_message, message);
+}
+
+void YankLines(size_t first, size_t last, size_t first_col, size_t last_col, enum REGISTER_TYPE type); // below
+
+void ExYank(Range* range) {
+    YankLines(range->start, range->end, 0, 0, REGISTER_LINES);
+
+    char message[40];
+    snprintf(message, sizeof(message), "%d lines yanked", range->end - range->start + 1);
+    StringAssign(editor.status_message, message);
+}
+
+// :[range]!cmd streams the lines through `sh -c cmd` and replaces them with its output.
+// The lines are written straight from the line store and the output is split into lines as it
+// arrives, so neither side makes a copy of the whole range
+void ExFilter(Range* range, const char* shell_cmd) {
+    int to_child[2], from_child[2];
+    // close on exec, so shells started at the same time by batch mode threads don't hold each other's pipes open
+    if (pipe2(to_child, O_CLOEXEC) == -1) {
+        CommandError("Couldn't create pipe");
+        return;
+    }
+    if (pipe2(from_child, O_CLOEXEC) == -1) {
+        close(to_child[0]), close(to_child[1]);
+        CommandError("Couldn't create pipe");
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        dup2(from_child[1], STDERR_FILENO);
+        close(to_child[0]), close(to_child[1]);
+        close(from_child[0]), close(from_child[1]);
+        signal(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", "-c", shell_cmd, (char*)NULL);
+        _exit(127);
+    }
+    close(to_child[0]), close(from_child[1]);
+    if (pid == -1) {
+        close(to_child[1]), close(from_child[0]);
+        CommandError("Couldn't start shell");
+        return;
+    }
+
+    // a reader that quits early must not kill the editor
+    void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    fcntl(to_child[1], F_SETFL, O_NONBLOCK);
+
+    Array* output = ArrayInit();
+    String* partial = StringInit();
+    size_t line = range->start, offset = 0;
+    int writing = 1;
+    char buffer[1 << 16];
+
+    while (1) {
+        struct pollfd fds[2] = {
+            {from_child[0], POLLIN, 0},
+            {to_child[1], POLLOUT, 0}
+        };
+        if (poll(fds, writing ? 2 : 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (writing && fds[1].revents) {
+            if (!FilterWriteLines(to_child[1], range, &line, &offset)) {
+                close(to_child[1]);
+                writing = 0;
+            }
+        }
+
+        if (fds[0].revents) {
+            ssize_t n = read(from_child[0], buffer, sizeof(buffer));
+            if (n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (n <= 0) break;
+
+            char *start = buffer, *end = buffer + n, *newline;
+            while ((newline = memchr(start, '\n', end - start)) != NULL) {
+                StringAppendN(partial, start, newline - start);
+                ArrayAppend(output, partial);
+                partial = StringInit();
+                start = newline + 1;
+            }
+            StringAppendN(partial, start, end - start);
+        }
+    }
+    if (writing) 
+        close(to_child[1]);
+    close(from_child[0]);
+
+    if (partial->size > 0) {
+        ArrayAppend(output, partial);
+    } else {
+        StringDestroy(partial);
+    }
+
+    int status = 0, waited;
+    while ((waited = waitpid(pid, &status, 0)) == -1 && errno == EINTR);
+    signal(SIGPIPE, old_handler);
+    int exit_code = (waited != -1 && WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+
+    char message[40];
+    if (output->size == 0 && exit_code != 0) { // keep the lines when the command failed without output
+        snprintf(message, sizeof(message), "shell returned %d", exit_code);
+    } else {
+        size_t count = range->end - range->start + 1;
+        ArrayRemoveRange(array_buffer, range->start, range->end, NULL);
+        ArrayInsertLines(array_buffer, range->start, output->array, output->size);
+        FinishBulkEdit(range->start, range->start);
+
+        if (exit_code != 0) 
+            snprintf(message, sizeof(message), "shell returned %d", exit_code);
+        else 
+            snprintf(message, sizeof(message), "%zu lines filtered", count);
+    }
+    StringAssign(editor.status_message, message);
+
+    free(output->array);
+    free(output);
+}
+
+// Report how a running :grep goes and join its threads once it's over, wait blocks until then
+void FinishGrep(int wait) {
+    Quickfix* qf = &editor.quickfix;
+    if (!qf->running) 
+        return;
+
+    pthread_mutex_lock(&qf->lock);
+    while (wait && (qf->queue.size > 0 || qf->busy > 0)) {
+        pthread_cond_wait(&qf->wake, &qf->lock);
+    }
+    int done = (qf->queue.size == 0 && qf->busy == 0);
+    size_t matches = qf->size, files = qf->files->size;
+    pthread_mutex_unlock(&qf->lock);
+
+    char message[40];
+    if (!done) {
+        // leave a :cn message alone until there is something new to tell
+        if (matches != qf->reported || qf->reported == 0) {
+            snprintf(message, sizeof(message), "Searching... %zu matches", matches);
+            StringAssign(editor.status_message, message);
+            qf->reported = matches;
+        }
+        return;
+    }
+    JoinGrep(qf);
+
+    // files came in whatever order the threads finished them
+    QuickfixEntry current = {0};
+    if (qf->current >= 0) 
+        current = qf->entries[qf->current];
+    qsort(qf->entries, qf->size, sizeof(QuickfixEntry), CompareQuickfixEntries);
+    if (qf->current >= 0) {
+        QuickfixEntry* moved = bsearch(&current, qf->entries, qf->size, sizeof(QuickfixEntry), CompareQuickfixEntries);
+        qf->current = moved - qf->entries;
+    }
+
+    snprintf(message, sizeof(message), "%zu matches in %zu files", matches, files);
+    StringAssign(editor.status_message, message);
+}
+
+// The buffer of a file, a new one is registered without reading the file
+Buffer* AddBuffer(const char* filename) {
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        String* name = editor.buffers[i]->file_name;
+        if (name->size > 0 && strcmp(name->str, filename) == 0) 
+            return editor.buffers[i];
+    }
+    return BufferInit(filename);
+}
+
+// Put the view back where it was when the buffer was last shown, or where the cached index of its file had it
+void RestoreView(Buffer* buffer) {
+    int last = (int)array_buffer->size - 1;
+    editor.cur_line = VisibleLine(max(0, min(buffer->last_line, last)));
+    editor.start_line = VisibleLine(max(0, min(buffer->last_start, editor.cur_line)));
+    editor.end_line = editor.cur_line;
+    editor.cur_column = editor.max_column = min(max(0, buffer->last_column), (int)array_buffer->array[editor.cur_line]->size);
+    ScrollToCursor();
+}
+
+// Show a buffer in the active window, its file is read if its lines aren't in memory.
+// The cursor goes back where it was when the buffer was last shown
+void ShowBuffer(Buffer* buffer) {
+    Buffer* old = editor.buffer;
+    if (buffer == old) 
+        return;
+    FinishSave(1);
+    BufferKeepView(editor.window);
+    SwitchBuffer(buffer);
+    editor.window->buffer = buffer;
+    editor.table_left = 0;
+
+    if (array_buffer == NULL) {
+        // folds made before the buffer was dropped only hold if the file is still the same
+        struct stat disk;
+        if (!editor.disk_stat_valid || stat(editor.file_name->str, &disk) == -1 || !SameFileState(&disk, &editor.disk_stat)) 
+            FoldTreeClear(&editor.folds);
+        editor.disk_stat_valid = 0;
+        array_buffer = ArrayInit();
+        String* filename = StringDuplicate(editor.file_name);
+        ReadFileToBuffer(filename->str);
+        StringDestroy(filename);
+        TableAuto();
+    } else {
+        StringAssign(editor.status_message, editor.file_name->str);
+    }
+
+    RestoreView(buffer);
+    editor.frame.valid = 0;
+    BufferHidden(old);
+}
+
+// Show a file in the active window, adding it to the buffer list if it isn't there
+void EditFile(const char* filename) {
+    ShowBuffer(AddBuffer(filename));
+}
+
+// :bn and :bp go through the buffer list in the order the buffers were added
+void BufferStep(int step) {
+    size_t i = 0;
+    while (editor.buffers[i] != editor.buffer) i++;
+    ShowBuffer(editor.buffers[(i + editor.buffer_count + step) % editor.buffer_count]);
+}
+
+// :b N
+void ExBuffer(const char* number) {
+    int wanted = atoi(number);
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        if (editor.buffers[i]->number == wanted) {
+            ShowBuffer(editor.buffers[i]);
+            return;
+        }
+    }
+    CommandError("No such buffer");
+}
+
+// Diff of two sequences of line numbers in linear space: Myers' middle snake splits the edit script
+// in two, each half is diffed the same way. The lines that aren't matched get flagged in changed
+typedef struct
+{
+    const int* seq[2];
+    char* changed[2];
+    int* forward, *backward; // furthest x reached on every diagonal x - y, from the start and from the end
+    int too_expensive; // edits after which the best split found so far is taken
+} DiffContext;
+
+// Where an edit script of seq[0][xoff, xlim) into seq[1][yoff, ylim) can be cut in two
+void DiffSplit(DiffContext* ctx, int xoff, int xlim, int yoff, int ylim, int* split_x, int* split_y) {
+    const int* a = ctx->seq[0], *b = ctx->seq[1];
+    int* fd = ctx->forward, *bd = ctx->backward;
+    int dmin = xoff - ylim, dmax = xlim - yoff;
+    int fmid = xoff - yoff, bmid = xlim - ylim;
+    int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    int odd = (fmid - bmid) & 1;
+    fd[fmid] = xoff;
+    bd[bmid] = xlim;
+
+    for (int cost = 1;; cost++) {
+        // one more edit from the start on every diagonal, the paths meeting give the split
+        if (fmin > dmin) fd[--fmin - 1] = -1; else fmin++;
+        if (fmax < dmax) fd[++fmax + 1] = -1; else fmax--;
+        for (int d = fmax; d >= fmin; d -= 2) {
+            int low = fd[d - 1], high = fd[d + 1];
+            int x = (low < high) ? high : low + 1, y = x - d;
+            while (x < xlim && y < ylim && a[x] == b[y]) x++, y++;
+            fd[d] = x;
+            if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+                *split_x = x, *split_y = y;
+                return;
+            }
+        }
+
+        // and from the end
+        if (bmin > dmin) bd[--bmin - 1] = INT_MAX; else bmin++;
+        if (bmax < dmax) bd[++bmax + 1] = INT_MAX; else bmax--;
+        for (int d = bmax; d >= bmin; d -= 2) {
+            int low = bd[d - 1], high = bd[d + 1];
+            int x = (low < high) ? low : high - 1, y = x - d;
+            while (x > xoff && y > yoff && a[x - 1] == b[y - 1]) x--, y--;
+            bd[d] = x;
+            if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+                *split_x = x, *split_y = y;
+                return;
+            }
+        }
+        if (cost < ctx->too_expensive)
+            continue;
+
+        // very different sides: split where a path got furthest, the script isn't the shortest anymore
+        int fxy = -1, fx = xoff, bxy = INT_MAX, bx = xlim;
+        for (int d = fmax; d >= fmin; d -= 2) {
+            int x = min(fd[d], xlim), y = x - d;
+            if (y > ylim)
+                x = ylim + d, y = ylim;
+            if (x + y > fxy)
+                fxy = x + y, fx = x;
+        }
+        for (int d = bmax; d >= bmin; d -= 2) {
+            int x = max(xoff, bd[d]), y = x - d;
+            if (y < yoff)
+                x = yoff + d, y = yoff;
+            if (x + y < bxy)
+                bxy = x + y, bx = x;
+        }
+        if ((xlim + ylim) - bxy < fxy - (xoff + yoff))
+            *split_x = fx, *split_y = fxy - fx;
+        else
+            *split_x = bx, *split_y = bxy - bx;
+        return;
+    }
+}
+
+void DiffCompare(DiffContext* ctx, int xoff, int xlim, int yoff, int ylim) {
+    const int* a = ctx->seq[0], *b = ctx->seq[1];
+    while (xoff < xlim && yoff < ylim && a[xoff] == b[yoff]) xoff++, yoff++;
+    while (xoff < xlim && yoff < ylim && a[xlim - 1] == b[ylim - 1]) xlim--, ylim--;
+
+    if (xoff == xlim) {
+        memset(&ctx->changed[1][yoff], 1, ylim - yoff);
+    } else if (yoff == ylim) {
+        memset(&ctx->changed[0][xoff], 1, xlim - xoff);
+    } else {
+        int x, y;
+        DiffSplit(ctx, xoff, xlim, yoff, ylim, &x, &y);
+        DiffCompare(ctx, xoff, x, yoff, y);
+        DiffCompare(ctx, x, xlim, y, ylim);
+    }
+}
+
+int SameLine(const String* a, const String* b) {
+    return a->size == b->size && memcmp(a->str, b->str, a->size) == 0;
+}
+
+unsigned long long LineHash(const String* line) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < line->size; i++) {
+        hash = (hash ^ (unsigned char)line->str[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+typedef struct
+{
+    unsigned long long hash;
+    const String* line;
+    char on[2]; // the sides having it
+} DistinctLine;
+
+void DiffAddHunk(Diff* diff, int a_start, int a_count, int b_start, int b_count) {
+    if (diff->size == diff->capacity) {
+        diff->capacity = diff->capacity ? diff->capacity * 2 : 16;
+        diff->hunks = realloc(diff->hunks, diff->capacity * sizeof(DiffHunk));
+        if (diff->hunks == NULL) {
+            ShowError("Memory couldn't be allocated");
+        }
+    }
+    diff->hunks[diff->size++] = (DiffHunk){{a_start, b_start}, {a_count, b_count}};
+}
+
+// Make the hunks between two arrays of lines. The lines both start and end with are skipped,
+// the others are numbered through a hash table so the diff compares ints. A line the other side
+// doesn't have is a change whatever happens around it, only the lines both have go through the diff
+void DiffCompute(Array* lines_a, Array* lines_b, Diff* diff) {
+    diff->size = 0;
+    String** lines[2] = {lines_a->array, lines_b->array};
+    size_t shortest = min(lines_a->size, lines_b->size), prefix = 0, suffix = 0;
+    while (prefix < shortest && SameLine(lines[0][prefix], lines[1][prefix])) prefix++;
+    while (suffix < shortest - prefix && SameLine(lines[0][lines_a->size - 1 - suffix], lines[1][lines_b->size - 1 - suffix])) suffix++;
+    int n[2] = {lines_a->size - prefix - suffix, lines_b->size - prefix - suffix};
+
+    size_t slot_count = 16;
+    while (slot_count < 2 * (size_t)(n[0] + n[1])) slot_count <<= 1;
+    int* slots = malloc(slot_count * sizeof(int));
+    DistinctLine* distinct = malloc((n[0] + n[1] + 1) * sizeof(DistinctLine));
+    int* seq[2], *index[2];
+    char* changed[2], *kept_changed[2];
+    for (int s = 0; s < 2; s++) {
+        seq[s] = malloc((n[s] + 1) * sizeof(int));
+        index[s] = malloc((n[s] + 1) * sizeof(int));
+        changed[s] = calloc(n[s] + 1, 1);
+        kept_changed[s] = calloc(n[s] + 1, 1);
+        if (seq[s] == NULL || index[s] == NULL || changed[s] == NULL || kept_changed[s] == NULL) {
+            ShowError("Memory couldn't be allocated");
+        }
+    }
+    if (slots == NULL || distinct == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+
+    memset(slots, -1, slot_count * sizeof(int));
+    int distinct_count = 0;
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < n[s]; i++) {
+            const String* line = lines[s][prefix + i];
+            unsigned long long hash = LineHash(line);
+            size_t slot = hash & (slot_count - 1);
+            while (slots[slot] != -1 && (distinct[slots[slot]].hash != hash || !SameLine(distinct[slots[slot]].line, line)))
+                slot = (slot + 1) & (slot_count - 1);
+            if (slots[slot] == -1) {
+                distinct[distinct_count] = (DistinctLine){hash, line, {0, 0}};
+                slots[slot] = distinct_count++;
+            }
+            distinct[slots[slot]].on[s] = 1;
+            seq[s][i] = slots[slot];
+        }
+    }
+    free(slots);
+
+    int kept[2] = {0, 0};
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < n[s]; i++) {
+            if (distinct[seq[s][i]].on[!s]) {
+                seq[s][kept[s]] = seq[s][i];
+                index[s][kept[s]++] = i;
+            } else {
+                changed[s][i] = 1;
+            }
+        }
+    }
+    free(distinct);
+
+    DiffContext ctx = {{seq[0], seq[1]}, {kept_changed[0], kept_changed[1]}, NULL, NULL, 1};
+    size_t diagonals = kept[0] + kept[1] + 3;
+    for (size_t d = diagonals; d != 0; d >>= 2) ctx.too_expensive <<= 1;
+    ctx.too_expensive = max(256, ctx.too_expensive / 2); // about the square root of the diagonals
+    int* diagonal_buffer = malloc(2 * diagonals * sizeof(int));
+    if (diagonal_buffer == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    ctx.forward = diagonal_buffer + kept[1] + 1;
+    ctx.backward = ctx.forward + diagonals;
+    DiffCompare(&ctx, 0, kept[0], 0, kept[1]);
+    free(diagonal_buffer);
+
+    for (int s = 0; s < 2; s++) {
+        for (int k = 0; k < kept[s]; k++) {
+            if (kept_changed[s][k])
+                changed[s][index[s][k]] = 1;
+        }
+    }
+
+    // the unchanged lines pair up in order, the runs of changed lines between them make the hunks
+    int i = 0, j = 0;
+    while (i < n[0] || j < n[1]) {
+        if (i < n[0] && j < n[1] && !changed[0][i] && !changed[1][j]) {
+            i++, j++;
+            continue;
+        }
+        int first_i = i, first_j = j;
+        while (i < n[0] && changed[0][i]) i++;
+        while (j < n[1] && changed[1][j]) j++;
+        if (i == first_i && j == first_j)
+            break;
+        DiffAddHunk(diff, prefix + first_i, i - first_i, prefix + first_j, j - first_j);
+    }
+
+    for (int s = 0; s < 2; s++) {
+        free(seq[s]);
+        free(index[s]);
+        free(changed[s]);
+        free(kept_changed[s]);
+    }
+}
+
+// Read the lines of a file without a buffer for them, decompressing it like ReadFileToBuffer does.
+// Returns 0 if it can't be read
+int ReadFileLines(const char* filename, Array* lines, struct stat* disk) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, disk) == -1 || !S_ISREG(disk->st_mode)) {
+        close(fd);
+        return 0;
+    }
+
+    int ok = 1;
+    enum COMPRESSION format = FileCompression(fd);
+    if (format != UNCOMPRESSED) {
+        String* partial = StringInit();
+        ok = DecompressFile(fd, format, lines, partial);
+        ArrayAppend(lines, partial);
+    } else if (disk->st_size > 0) {
+        char* text = mmap(NULL, disk->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = (text != MAP_FAILED);
+        if (ok) {
+            LoadLines(text, disk->st_size, lines);
+            munmap(text, disk->st_size);
+        }
+    } else {
+        s_ArrayAppend(lines, "");
+    }
+    close(fd);
+    return ok;
+}
+
+// The markers come and go with the diff, they take columns from the text
+void DiffOff() {
+    DiffClear(&editor.diff);
+    RedrawWindows();
+    ScrollToCursor();
+}
+
+// Make the hunks again from the lines of both sides, the file is read again if it changed since
+void DiffUpdate() {
+    Diff* diff = &editor.diff;
+    diff->stale = 0;
+    if (diff->side[1] == NULL) {
+        const char* filename = diff->side[0]->file_name->str;
+        struct stat disk;
+        if (diff->disk == NULL || stat(filename, &disk) == -1 || !SameFileState(&disk, &diff->disk_stat)) {
+            Array* lines = ArrayInit();
+            if (!ReadFileLines(filename, lines, &diff->disk_stat)) {
+                ArrayDestroy(lines);
+                free(lines);
+                DiffOff();
+                CommandError("Can't read the file to diff");
+                return;
+            }
+            if (diff->disk) {
+                ArrayDestroy(diff->disk);
+                free(diff->disk);
+            }
+            diff->disk = lines;
+        }
+    }
+
+    Array* a = DiffLines(0), *b = DiffLines(1);
+    if (a == NULL || b == NULL) {
+        DiffOff();
+        return;
+    }
+    DiffCompute(a, b, diff);
+    RedrawWindows();
+}
+
+// Diff a buffer with another one, or with its file when b is NULL
+void DiffStart(Buffer* a, Buffer* b) {
+    DiffClear(&editor.diff);
+    editor.diff.side[0] = a;
+    editor.diff.side[1] = b;
+    DiffUpdate();
+    if (editor.diff.side[0] == NULL)
+        return;
+    ScrollToCursor();
+
+    char message[40];
+    snprintf(message, sizeof(message), "%zu change%s", editor.diff.size, editor.diff.size == 1 ? "" : "s");
+    StringAssign(editor.status_message, message);
+}
+
+// :diff compares the buffer with its file, :diff file shows file in a window on the right and compares the two
+void ExDiff(const char* filename) {
+    if (filename == NULL) {
+        if (!editor.file_opened || editor.file_name->size == 0) {
+            CommandError("No file name");
+            return;
+        }
+        DiffStart(editor.buffer, NULL);
+        return;
+    }
+
+    Buffer* buffer = editor.buffer, *other = AddBuffer(filename);
+    if (other == buffer) {
+        CommandError("Same buffer");
+        return;
+    }
+    if (!SplitWindow(1))
+        return;
+    GoToWindow(editor.windows[WindowIndex(editor.window) + 1]);
+    ShowBuffer(other);
+    DiffStart(buffer, other);
+}
+
+// ]c and [c go to the next / previous hunk, count times
+void DiffJump(int step, int count) {
+    int side = DiffSide();
+    if (side < 0) {
+        CommandError("Not in diff mode");
+        return;
+    }
+    if (editor.diff.stale)
+        DiffUpdate();
+
+    int size = array_buffer->size, line = editor.cur_line, target = -1;
+    for (size_t i = 0; i < editor.diff.size && count > 0; i++) {
+        size_t at = (step > 0) ? i : editor.diff.size - 1 - i;
+        int hunk_line = DiffHunkLine(&editor.diff.hunks[at], side, size);
+        if ((step > 0) ? hunk_line > line : hunk_line < line) {
+            target = line = hunk_line;
+            count--;
+        }
+    }
+    if (target == -1) {
+        CommandError("No more changes");
+        return;
+    }
+    OpenFoldsAt(target);
+    GoToLine(target);
+}
+
+// :grep /pattern/ [paths] or :grep pattern [paths], the paths default to the current directory
+void ExGrep(const char* cmd) {
+    while (*cmd == ' ') cmd++;
+
+    String* pattern = StringInit();
+    if (*cmd == '/') {
+        cmd++;
+        ExtractPattern(&cmd, '/', pattern);
+    } else {
+        while (*cmd && *cmd != ' ') {
+            StringAppendN(pattern, cmd++, 1);
+        }
+    }
+
+    regex_t regex;
+    if (pattern->size == 0 || regcomp(&regex, pattern->str, 0) != 0) {
+        StringDestroy(pattern);
+        CommandError("Invalid pattern");
+        return;
+    }
+    regfree(&regex);
+
+    Array* paths = ArrayInit();
+    while (*cmd) {
+        while (*cmd == ' ') cmd++;
+        const char* start = cmd;
+        while (*cmd && *cmd != ' ') cmd++;
+        if (cmd > start) 
+            ArrayAppend(paths, StringFromBuffer(start, cmd - start));
+    }
+    if (paths->size == 0) 
+        s_ArrayAppend(paths, ".");
+
+    if (StartGrep(&editor.quickfix, pattern->str, paths)) 
+        FinishGrep(editor.headless);
+    else 
+        CommandError("No such file or directory");
+
+    StringDestroy(pattern);
+    ArrayDestroy(paths);
+    free(paths);
+}
+
+// :cn and :cp, step through the :grep matches opening their files as needed
+void QuickfixJump(int step) {
+    Quickfix* qf = &editor.quickfix;
+
+    // the list may still be growing
+    pthread_mutex_lock(&qf->lock);
+    size_t size = qf->size;
+    long target = qf->current + step;
+    QuickfixEntry entry = {NULL, 0, 0};
+    if (target >= 0 && (size_t)target < size) 
+        entry = qf->entries[target];
+    pthread_mutex_unlock(&qf->lock);
+
+    if (size == 0) {
+        CommandError("No matches");
+        return;
+    }
+    if (entry.file == NULL) {
+        CommandError("No more items");
+        return;
+    }
+    if (!editor.file_opened || strcmp(entry.file->str, editor.file_name->str) != 0) 
+        EditFile(entry.file->str);
+
+    qf->current = target;
+    OpenFoldsAt(entry.line);
+    GoToLine(entry.line);
+    editor.cur_column = editor.max_column = min(entry.column, array_buffer->array[editor.cur_line]->size);
+    CalculateCursorX();
+    CalculateCursorY();
+
+    // the status bar is short, long paths lose their directories
+    char message[PATH_MAX + 64];
+    snprintf(message, sizeof(message), "(%ld of %zu) %s:%zu", target + 1, size, entry.file->str, entry.line + 1);
+    if (strlen(message) >= 40) 
+        snprintf(message, sizeof(message), "(%ld of %zu) %s:%zu", target + 1, size, FileBaseName(entry.file->str), entry.line + 1);
+    StringAssign(editor.status_message, message);
+}
+
+// :!cmd without a range runs the command on the terminal
+void ExShell(const char* shell_cmd) {
+    if (editor.headless) {
+        if (system(shell_cmd) == -1) 
+            CommandError("Couldn't start shell");
+        return;
+    }
+
+    ResetScreenBuffer();
+    DisableRawMode();
+
+    int status = system(shell_cmd);
+    if (status != 0) {
+        printf("\nshell returned %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+    printf("\nPress ENTER to continue");
+    fflush(stdout);
+
+    char c;
+    while (read(STDIN_FILENO, &c, 1) == 1 && c != '\n');
+
+    ChangeScreenBuffer();
+    EnableRawMode();
+    RedrawWindows();
+}
+
+// Print text below the editor the way :!cmd shows its output, until ENTER is pressed
+void ShowListing(const String* text) {
+    ResetScreenBuffer();
+    DisableRawMode();
+
+    fwrite(text->str, 1, text->size, stdout);
+    printf("\nPress ENTER to continue");
+    fflush(stdout);
+
+    char c;
+    while (read(STDIN_FILENO, &c, 1) == 1 && c != '\n');
+
+    ChangeScreenBuffer();
+    EnableRawMode();
+    RedrawWindows();
+}
+
+// :ls lists the buffers. % marks the current buffer, a one shown in a window, h one kept in memory while hidden
+void ExBuffers() {
+    BufferSave(editor.buffer);
+    if (editor.headless) {
+        char message[32];
+        snprintf(message, sizeof(message), "%zu buffers", editor.buffer_count);
+        StringAssign(editor.status_message, message);
+        return;
+    }
+
+    String* text = StringInit();
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        Buffer* buffer = editor.buffers[i];
+        int shown = 0;
+        for (size_t j = 0; j < editor.window_count; j++) 
+            shown |= editor.windows[j]->buffer == buffer;
+        const char* name = buffer->from_stdin ? "[stdin]" : buffer->file_name->size ? buffer->file_name->str : "[No Name]";
+        int line = buffer == editor.buffer ? editor.cur_line : buffer->last_line;
+        char entry[PATH_MAX + 64];
+        snprintf(entry, sizeof(entry), "%3d %c%c %c \"%s\" line %d\n", buffer->number, buffer == editor.buffer ? '%' : ' ', 
+                 shown ? 'a' : buffer->lines ? 'h' : ' ', buffer->buffer_modified ? '+' : ' ', name, line + 1);
+        StringAppend(text, entry);
+    }
+    ShowListing(text);
+    StringDestroy(text);
+}
+
+// bytes as 12.3M and such
+void FormatBytes(char* out, size_t size, double bytes) {
+    const char* units = "BKMGT";
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(out, size, unit ? "%.1f%c" : "%.0f%c", bytes, units[unit]);
+}
+
+// What the lines of a buffer hold against what they take: allocated counts the String structs, their own
+// text with its slack and the line array. Packed text is in arenas, borrowed text in a mapping of a file
+void LineMemory(const Array* lines, String* out) {
+    size_t text = 0, allocated = lines->capacity * sizeof(String*), packed = 0, borrowed = 0;
+    for (size_t i = 0; i < lines->size; i++) {
+        String* line = lines->array[i];
+        text += line->size;
+        allocated += sizeof(String);
+        if (line->packed) 
+            packed += line->size + 1;
+        else if (line->capacity == 0) 
+            borrowed += line->size;
+        else 
+            allocated += line->capacity;
+    }
+
+    char sizes[4][16];
+    FormatBytes(sizes[0], sizeof(sizes[0]), text);
+    FormatBytes(sizes[1], sizeof(sizes[1]), allocated);
+    FormatBytes(sizes[2], sizeof(sizes[2]), packed);
+    FormatBytes(sizes[3], sizeof(sizes[3]), borrowed);
+    char entry[128];
+    snprintf(entry, sizeof(entry), "%zu lines, text %s, allocated %s, packed %s, borrowed %s", 
+             lines->size, sizes[0], sizes[1], sizes[2], sizes[3]);
+    StringAppend(out, entry);
+}
+
+// :mem shows the memory of every buffer in memory, the arenas and the resident size of the editor
+void ExMem() {
+    BufferSave(editor.buffer);
+    String* text = StringInit();
+    if (editor.headless) {
+        LineMemory(array_buffer, text);
+        StringAssignN(editor.status_message, text->str, text->size);
+        StringDestroy(text);
+        return;
+    }
+
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        Buffer* buffer = editor.buffers[i];
+        if (buffer->lines == NULL) 
+            continue;
+        const char* name = buffer->from_stdin ? "[stdin]" : buffer->file_name->size ? buffer->file_name->str : "[No Name]";
+        char entry[PATH_MAX + 16];
+        snprintf(entry, sizeof(entry), "%3d \"%s\"\n    ", buffer->number, name);
+        StringAppend(text, entry);
+        LineMemory(buffer->lines, text);
+        StringAppend(text, "\n");
+    }
+
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "re");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) 
+            pages = 0;
+        fclose(statm);
+    }
+    char arenas[16], resident[16], entry[128];
+    FormatBytes(arenas, sizeof(arenas), (double)arena_count * ARENA_SIZE);
+    FormatBytes(resident, sizeof(resident), (double)pages * sysconf(_SC_PAGESIZE));
+    snprintf(entry, sizeof(entry), "\n%zu arenas (%s), resident %s, growth %d%%\n", arena_count, arenas, resident, string_growth);
+    StringAppend(text, entry);
+    ShowListing(text);
+    StringDestroy(text);
+}
+
+// :set name=value..., an option may be given by its short name
+void ExSet(Array* options) {
+    for (size_t i = 0; i < options->size; i++) {
+        const char* option = options->array[i]->str;
+        const char* value = strchr(option, '=');
+        size_t name_len = value ? (size_t)(value - option) : strlen(option);
+        value = value ? value + 1 : "";
+
+        if ((name_len == 10 && strncmp(option, "foldmethod", 10) == 0) || (name_len == 3 && strncmp(option, "fdm", 3) == 0)) {
+            if (strcmp(value, "indent") == 0) {
+                IndentFolds(); // made now, after that they are kept like manual ones
+            } else if (strcmp(value, "manual") != 0) {
+                CommandError("Invalid argument");
+                return;
+            }
+        } else if (name_len == 9 && strncmp(option, "complevel", 9) == 0) {
+            char* end;
+            long level = strtol(value, &end, 10);
+            if (*value == 0 || *end != 0 || level < 0 || level > 19) {
+                CommandError("Invalid argument");
+                return;
+            }
+            editor.compress_level = level;
+        } else if (name_len == 6 && strncmp(option, "growth", 6) == 0) {
+            char* end;
+            long growth = strtol(value, &end, 10);
+            if (*value == 0 || *end != 0 || growth < 100 || growth > 1000) {
+                CommandError("Invalid argument");
+                return;
+            }
+            string_growth = growth;
+        } else if (name_len == 5 && strncmp(option, "table", 5) == 0) {
+            if (editor.table == NULL && !TableStart()) {
+                CommandError("No delimiter in the first lines");
+                return;
+            }
+            RedrawWindows();
+            ScrollToCursor();
+        } else if (name_len == 7 && strncmp(option, "notable", 7) == 0) {
+            TableDestroy(editor.table);
+            editor.table = NULL;
+            editor.table_left = 0;
+            RedrawWindows();
+            ScrollToCursor();
+        } else {
+            CommandError("Unknown option");
+            return;
+        }
+    }
+}
+
+// Timestamps of log lines. The format is taken from the first lines, then a line's time is the
+// first timestamp of that format in its first TIME_SCAN bytes
+enum TIME_FORMAT {
+    TIME_NONE,
+    TIME_ISO, // 2026-10-17T13:05:00 or 2026-10-17 13:05:00
+    TIME_SLASH, // 2026/10/17 13:05:00
+    TIME_CLF, // 17/Oct/2026:13:05:00 (web server logs)
+    TIME_SYSLOG, // Oct 17 13:05:00, no year
+    TIME_EPOCH, // 1792242300 or 1792242300.123
+    TIME_CLOCK, // 13:05, only typed, the date is the one of the first line
+};
+
+#define TIME_SAMPLE 20
+#define TIME_SCAN 256
+#define SYSLOG_YEAR 2000 // a leap year, so Feb 29 has a time
+
+typedef struct
+{
+    int year, month, day, hour, minute, second;
+} TimeFields;
+
+const char* month_names = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+// Read exactly count digits
+int ParseDigits(const char** p, const char* end, int count, int* value) {
+    *value = 0;
+    for (int i = 0; i < count; i++, (*p)++) {
+        if (*p == end || !isdigit(**p)) 
+            return 0;
+        *value = *value * 10 + (**p - '0');
+    }
+    return 1;
+}
+
+int ParseMonth(const char** p, const char* end, int* month) {
+    if (end - *p < 3) 
+        return 0;
+    for (int i = 0; i < 12; i++) {
+        if (strncmp(*p, &month_names[i * 3], 3) == 0) {
+            *month = i + 1;
+            *p += 3;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// HH:MM with optional :SS and fraction
+int ParseClock(const char** p, const char* end, TimeFields* t) {
+    t->second = 0;
+    if (!ParseDigits(p, end, 2, &t->hour) || *p == end || **p != ':' || (++(*p), !ParseDigits(p, end, 2, &t->minute))) 
+        return 0;
+    if (*p < end && **p == ':' && end - *p >= 3 && isdigit((*p)[1])) {
+        (*p)++;
+        if (!ParseDigits(p, end, 2, &t->second)) 
+            return 0;
+        if (*p < end && (**p == '.' || **p == ',') && *p + 1 < end && isdigit((*p)[1])) {
+            (*p)++;
+            while (*p < end && isdigit(**p)) (*p)++;
+        }
+    }
+    return t->hour < 24 && t->minute < 60 && t->second <= 60;
+}
+
+// Days from 1970-01-01 to a date of the proleptic Gregorian calendar
+long long DaysFromCivil(int year, int month, int day) {
+    year -= (month <= 2);
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    long long year_of_era = year - era * 400;
+    long long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+void CivilFromDays(long long days, TimeFields* t) {
+    days += 719468;
+    long long era = (days >= 0 ? days : days - 146096) / 146097;
+    long long day_of_era = days - era * 146097;
+    long long year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    long long day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    long long mp = (5 * day_of_year + 2) / 153;
+    t->day = day_of_year - (153 * mp + 2) / 5 + 1;
+    t->month = mp < 10 ? mp + 3 : mp - 9;
+    t->year = year_of_era + era * 400 + (t->month <= 2);
+}
+
+long long TimeValue(const TimeFields* t) {
+    return DaysFromCivil(t->year, t->month, t->day) * 86400 + t->hour * 3600 + t->minute * 60 + t->second;
+}
+
+// Parse a timestamp of the format at s, returns its length or 0 if there is none
+size_t ParseTime(const char* s, const char* end, enum TIME_FORMAT format, TimeFields* t) {
+    const char* p = s;
+    memset(t, 0, sizeof(TimeFields));
+    t->month = t->day = 1;
+
+    switch (format) {
+    case TIME_ISO:
+    case TIME_SLASH: {
+        char sep = (format == TIME_ISO) ? '-' : '/';
+        if (!ParseDigits(&p, end, 4, &t->year) || p == end || *p++ != sep || !ParseDigits(&p, end, 2, &t->month) 
+            || p == end || *p++ != sep || !ParseDigits(&p, end, 2, &t->day)) 
+            return 0;
+        // the time of day is optional
+        const char* date_end = p;
+        if (p < end && (*p == 'T' || *p == ' ')) {
+            p++;
+            if (!ParseClock(&p, end, t)) {
+                p = date_end;
+                t->hour = t->minute = t->second = 0;
+            }
+        }
+        break;
+    }
+    case TIME_CLF:
+        if (!ParseDigits(&p, end, 2, &t->day) || p == end || *p++ != '/' || !ParseMonth(&p, end, &t->month) 
+            || p == end || *p++ != '/' || !ParseDigits(&p, end, 4, &t->year) || p == end || *p++ != ':' || !ParseClock(&p, end, t)) 
+            return 0;
+        break;
+    case TIME_SYSLOG:
+        if (!ParseMonth(&p, end, &t->month) || p == end || *p++ != ' ') 
+            return 0;
+        if (p < end && *p == ' ') 
+            p++;
+        if (p == end || !isdigit(*p)) 
+            return 0;
+        t->day = *p++ - '0';
+        if (p < end && isdigit(*p)) 
+            t->day = t->day * 10 + (*p++ - '0');
+        if (p == end || *p++ != ' ' || !ParseClock(&p, end, t)) 
+            return 0;
+        t->year = SYSLOG_YEAR;
+        break;
+    case TIME_EPOCH: {
+        long long seconds = 0;
+        while (p < end && isdigit(*p) && p - s < 12) {
+            seconds = seconds * 10 + (*p++ - '0');
+        }
+        if (p - s < 9 || p - s > 11) 
+            return 0;
+        if (p < end && *p == '.' && p + 1 < end && isdigit(p[1])) {
+            p++;
+            while (p < end && isdigit(*p)) p++;
+        }
+        CivilFromDays(seconds / 86400, t);
+        t->hour = seconds % 86400 / 3600;
+        t->minute = seconds % 3600 / 60;
+        t->second = seconds % 60;
+        break;
+    }
+    case TIME_CLOCK:
+        if (!ParseClock(&p, end, t)) 
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+
+    if (t->month < 1 || t->month > 12 || t->day < 1 || t->day > 31 || (p < end && isdigit(*p))) 
+        return 0;
+    return p - s;
+}
+
+// The first timestamp of the format in the line, returns its column or -1
+int FindTime(const String* line, enum TIME_FORMAT format, TimeFields* t) {
+    const char* end = line->str + line->size;
+    size_t scan = min(line->size, TIME_SCAN);
+    for (size_t i = 0; i < scan; i++) {
+        if ((i == 0 || !isalnum(line->str[i - 1])) && ParseTime(&line->str[i], end, format, t)) 
+            return i;
+    }
+    return -1;
+}
+
+// The format of the earliest timestamp in the first timestamped line, *first gets its time
+enum TIME_FORMAT DetectTimeFormat(TimeFields* first) {
+    for (size_t i = 0; i < array_buffer->size && i < TIME_SAMPLE; i++) {
+        enum TIME_FORMAT found = TIME_NONE;
+        int found_column = INT_MAX;
+        TimeFields t;
+        for (enum TIME_FORMAT format = TIME_ISO; format <= TIME_EPOCH; format++) {
+            int column = FindTime(array_buffer->array[i], format, &t);
+            if (column != -1 && column < found_column) {
+                found = format;
+                found_column = column;
+                *first = t;
+            }
+        }
+        if (found != TIME_NONE) 
+            return found;
+    }
+    return TIME_NONE;
+}
+
+// A time typed in any of the formats, a time of day alone is on the date of the first line
+int ParseTimeArgument(const char** cmd, enum TIME_FORMAT format, const TimeFields* first, long long* value) {
+    while (**cmd == ' ') (*cmd)++;
+    const char* end = *cmd + strlen(*cmd);
+    TimeFields t;
+    for (enum TIME_FORMAT typed = TIME_ISO; typed <= TIME_CLOCK; typed++) {
+        size_t len = ParseTime(*cmd, end, typed, &t);
+        if (len == 0) 
+            continue;
+        if (typed == TIME_CLOCK) {
+            t.year = first->year, t.month = first->month, t.day = first->day;
+        } else if (typed == TIME_SYSLOG || format == TIME_SYSLOG) { // the year is the one of the lines
+            t.year = first->year;
+        }
+        *cmd += len;
+        *value = TimeValue(&t);
+        return 1;
+    }
+    return 0;
+}
+
+// The first line with a timestamp at or after value, the size of the buffer if there is none.
+// The lines are taken to be in time order, lines without a timestamp belong to the one above them,
+// so only the lines the binary search lands on (and the untimed ones after them) are read
+size_t FirstLineAtTime(enum TIME_FORMAT format, long long value) {
+    size_t low = 0, high = array_buffer->size, found = array_buffer->size;
+    TimeFields t;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2, line = mid;
+        while (line < high && FindTime(array_buffer->array[line], format, &t) == -1) line++;
+        if (line == high) {
+            high = mid;
+        } else if (TimeValue(&t) >= value) {
+            found = line;
+            high = mid;
+        } else {
+            low = line + 1;
+        }
+    }
+    return found;
+}
+
+// Commands that work on a [range] of lines, returns 0 if cmd isn't one of them
+int ExecuteRangeCommand(const char* cmd, Range* range) {
+    int dest;
+
+    if (MatchCommandName(&cmd, "global", 1)) {
+        int invert = 0;
+        if (*cmd == '!') {
+            invert = 1;
+            cmd++;
+        }
+        ExGlobal(cmd, range, invert);
+    } 
+    else if (MatchCommandName(&cmd, "vglobal", 1)) {
+        ExGlobal(cmd, range, 1);
+    } 
+    else if (MatchCommandName(&cmd, "delete", 1) && *cmd == 0) {
+        ExDelete(range);
+    } 
+    else if (MatchCommandName(&cmd, "yank", 1) && *cmd == 0) {
+        ExYank(range);
+    } 
+    else if (range->given && MatchCommandName(&cmd, "write", 1) && (*cmd == ' ' || *cmd == 0)) {
+        ExWrite(range, cmd);
+    } 
+    else if (MatchCommandName(&cmd, "move", 1)) {
+        if (ParseTargetAddress(&cmd, &dest))
+            ExMove(range, dest);
+    } 
+    else if (MatchCommandName(&cmd, "t", 1) || MatchCommandName(&cmd, "copy", 2)) {
+        if (ParseTargetAddress(&cmd, &dest))
+            ExCopy(range, dest);
+    } 
+    else if (MatchCommandName(&cmd, "sort", 3)) {
+        ExSort(cmd, range);
+    } 
+    else if (MatchCommandName(&cmd, "substitute", 1)) {
+        ExSubstitute(cmd, range, NULL);
+    } 
+    else if (*cmd == '!') {
+        if (range->given) 
+            ExFilter(range, cmd + 1);
+        else 
+            ExShell(cmd + 1);
+    } 
+    else {
+        return 0;
+    }
+    return 1;
+}
+
+// :goto-time time jumps to the first line at or after the time
+void ExGotoTime(const char* cmd) {
+    TimeFields first;
+    enum TIME_FORMAT format = DetectTimeFormat(&first);
+    long long value;
+    if (format == TIME_NONE) {
+        CommandError("No timestamps in the first lines");
+        return;
+    }
+    if (!ParseTimeArgument(&cmd, format, &first, &value) || *cmd != 0) {
+        CommandError("Invalid time");
+        return;
+    }
+
+    size_t line = FirstLineAtTime(format, value);
+    if (line == array_buffer->size) {
+        CommandError("No line at or after that time");
+        return;
+    }
+    OpenFoldsAt(line);
+    GoToLine(line);
+}
+
+// :range-time from to [cmd] selects the lines from the first one at or after from to the last one before to,
+// or runs the range command cmd (d, y, w file, s, ...) on them
+void ExRangeTime(const char* cmd) {
+    TimeFields first;
+    enum TIME_FORMAT format = DetectTimeFormat(&first);
+    long long from, to;
+    if (format == TIME_NONE) {
+        CommandError("No timestamps in the first lines");
+        return;
+    }
+    if (!ParseTimeArgument(&cmd, format, &first, &from) || !ParseTimeArgument(&cmd, format, &first, &to) || (*cmd != ' ' && *cmd != 0)) {
+        CommandError("Invalid time");
+        return;
+    }
+
+    // past the last timestamp the range ends at the last line, not on the empty entry of the final newline
+    size_t start = FirstLineAtTime(format, from), after = FirstLineAtTime(format, to);
+    if (after > (size_t)LastRangeLine() + 1) 
+        after = LastRangeLine() + 1;
+    if (start >= after) {
+        CommandError("No lines between those times");
+        return;
+    }
+    while (*cmd == ' ') cmd++;
+    if (*cmd == 0) {
+        OpenFoldsAt(start);
+        GoToLine(start);
+        VisualModeOn(VISUAL_LINE);
+        OpenFoldsAt(after - 1);
+        GoToLine(after - 1);
+        return;
+    }
+    Range range = {2, start, after - 1};
+    if (!ExecuteRangeCommand(cmd, &range)) 
+        CommandError("Not a range command");
+}
+
+void ExecuteCommand() {
+    const char* cmd = editor.command->str;
+    Range range;
+
+    if (!ParseRange(&cmd, &range)) {
+        CommandError("Invalid range");
+        return;
+    }
+    while (*cmd == ' ') cmd++;
+
+    if (*cmd == 0) { // :N jumps to line N
+        if (range.given) {
+            OpenFoldsAt(range.end);
+            GoToLine(range.end);
+        }
+        return;
+    }
+    if (ExecuteRangeCommand(cmd, &range)) 
+        return;
+    if (MatchCommandName(&cmd, "grep", 2)) { // the pattern may have spaces
+        ExGrep(cmd);
+        return;
+    }
+    // so may the times
+    if (strncmp(cmd, "goto-time", 9) == 0 && (cmd[9] == ' ' || cmd[9] == 0)) {
+        ExGotoTime(cmd + 9);
+        return;
+    }
+    if (strncmp(cmd, "range-time", 10) == 0 && (cmd[10] == ' ' || cmd[10] == 0)) {
+        ExRangeTime(cmd + 10);
+        return;
+    }
+
+    Array* paramaters = ArrayInit();
+    String* command = NULL, *token = StringInit();
+    size_t cmd_len = strlen(cmd);
+
+    int command_extraced = 0;
+    for (size_t i = 0; i < cmd_len; i++) {
+        if (cmd[i] != ' ') {
+            StringAppendN(token, &cmd[i], 1);
+        }
+        if (i + 1 == cmd_len || cmd[i] == ' ') {
+            if (command_extraced) {
+                ArrayAppend(paramaters, token);
+                token = StringInit();
+            } else {
+                command = token;
+                command_extraced = 1;
+                token = StringInit();
+            }
+        }
+    }
+
+    if (command == NULL) return;
+
+    int should_quit = 0;
+
+    if (strcmp(command->str, "q") == 0) {
+        should_quit = 1;
+    }
+    else if (strcmp(command->str, "w") == 0) {
+        if (paramaters->size > 0) {
+            SaveBuffer(paramaters->array[0]);
+        } else if (editor.file_opened) {
+            SaveBuffer(editor.file_name);
+        } else {
+            CommandError("No File Specified");
+        }
+    }
+    else if (strcmp(command->str, "wq") == 0) {
+        if (paramaters->size > 0) {
+            should_quit = SaveBuffer(paramaters->array[0]);
+        } else if (editor.file_opened) {
+            should_quit = SaveBuffer(editor.file_name);
+        } else {
+            CommandError("No File Specified");
+        }
+    }
+    else if (strcmp(command->str, "set") == 0) {
+        ExSet(paramaters);
+    }
+    else if (strcmp(command->str, "sp") == 0 || strcmp(command->str, "split") == 0) {
+        if (SplitWindow(0) && paramaters->size > 0) 
+            EditFile(((String*)paramaters->array[0])->str);
+    }
+    else if (strcmp(command->str, "vs") == 0 || strcmp(command->str, "vsplit") == 0) {
+        if (SplitWindow(1) && paramaters->size > 0) 
+            EditFile(((String*)paramaters->array[0])->str);
+    }
+    else if (strcmp(command->str, "e") == 0 || strcmp(command->str, "edit") == 0) {
+        if (paramaters->size > 0) {
+            EditFile(((String*)paramaters->array[0])->str);
+        } else {
+            CommandError("No file name");
+        }
+    }
+    else if (strcmp(command->str, "bn") == 0 || strcmp(command->str, "bnext") == 0) {
+        BufferStep(1);
+    }
+    else if (strcmp(command->str, "bp") == 0 || strcmp(command->str, "bprevious") == 0 || strcmp(command->str, "bN") == 0) {
+        BufferStep(-1);
+    }
+    else if (strcmp(command->str, "b") == 0 || strcmp(command->str, "buffer") == 0) {
+        if (paramaters->size > 0) {
+            ExBuffer(((String*)paramaters->array[0])->str);
+        } else {
+            CommandError("Argument required");
+        }
+    }
+    else if (strcmp(command->str, "ls") == 0 || strcmp(command->str, "buffers") == 0 || strcmp(command->str, "files") == 0) {
+        ExBuffers();
+    }
+    else if (strcmp(command->str, "mem") == 0) {
+        ExMem();
+    }
+    else if (strcmp(command->str, "diff") == 0) {
+        ExDiff(paramaters->size > 0 ? ((String*)paramaters->array[0])->str : NULL);
+    }
+    else if (strcmp(command->str, "diffu") == 0 || strcmp(command->str, "diffupdate") == 0) {
+        if (editor.diff.side[0] != NULL) 
+            DiffUpdate();
+        else 
+            CommandError("Not in diff mode");
+    }
+    else if (strcmp(command->str, "diffo") == 0 || strcmp(command->str, "diffoff") == 0) {
+        DiffOff();
+    }
+    else if (strcmp(command->str, "clo") == 0 || strcmp(command->str, "close") == 0) {
+        CloseWindow(editor.window);
+    }
+    else if (strcmp(command->str, "on") == 0 || strcmp(command->str, "only") == 0) {
+        OnlyWindow();
+    }
+    else if (strcmp(command->str, "cn") == 0 || strcmp(command->str, "cnext") == 0) {
+        QuickfixJump(1);
+    }
+    else if (strcmp(command->str, "cp") == 0 || strcmp(command->str, "cprevious") == 0) {
+        QuickfixJump(-1);
+    } else {
+        CommandError("Not an editor command");
+    }
+    StringDestroy(command);
+    StringDestroy(token);
+    ArrayDestroy(paramaters);
+
+    // a failed save keeps the editor open
+    if (should_quit && !FinishSave(1)) 
+        should_quit = 0;
+    if (should_quit && editor.headless) {
+        editor.quit = 1;
+    } else if (should_quit && editor.window_count > 1) { // only the window goes
+        CloseWindow(editor.window);
+    } else if (should_quit)  {
+        ResetScreenBuffer();
+        exit(0);   
+    }
+}
+
+// insert into buffer
+void BufferInsert(char c) {
+    // New line
+    if (c == '\r') {
+        MarkDirty(editor.cur_line);
+        ArraySplitLine(array_buffer ,editor.cur_line, editor.cur_column);
+        MoveCursorAndScroll(CURSOR_DOWN);
+        MoveCursorAndScroll(HOME);
+    }
+
+    // Printable
+    else {
+        MarkLinesDirty(editor.cur_line, editor.cur_line);
+        String* cur_line = ArrayMutableLine(array_buffer, editor.cur_line);
+        StringInsertChar(cur_line, editor.cur_column, c);
+        MoveCursorAndScroll(CURSOR_RIGHT);
+    }
+}
+
+// delete from buffer backward
+void BufferDelete() {
+    String* cur_line = array_buffer->array[editor.cur_line];
+    if (editor.cur_column > 0) { // Delete a char
+        MarkLinesDirty(editor.cur_line, editor.cur_line);
+        cur_line = ArrayMutableLine(array_buffer, editor.cur_line);
+        StringDeleteChar(cur_line, editor.cur_column - 1);
+        MoveCursorAndScroll(CURSOR_LEFT);
+    } 
+    
+    else if (editor.cur_line > 0) { // Delete a line
+        // get prev line size to move the cursor after it
+        String* prev_line = array_buffer->array[editor.cur_line - 1];
+        size_t prev_size = prev_line->size;
+
+        MarkDirty(editor.cur_line - 1);
+        ArrayMergeLines(array_buffer, editor.cur_line);
+        editor.cur_column = editor.max_column = prev_size;
+        ScrollUp();
+        CalculateCursorX();
+        CalculateCursorY();
+    }
+}
+
+// Yanking only takes a reference to every selected line, edits clone a shared line before changing it
+void YankLines(size_t first, size_t last, size_t first_col, size_t last_col, enum REGISTER_TYPE type) {
+    Register* reg = &editor.registers[editor.register_name];
+    RegisterClear(reg);
+    reg->lines = ArrayInit();
+    ArrayReserve(reg->lines, last - first + 1);
+    for (size_t line = first; line <= last; line++) {
+        ArrayAppend(reg->lines, StringRetain(array_buffer->array[line]));
+    }
+    reg->first_col = first_col;
+    reg->last_col = last_col;
+    reg->type = type;
+
+    // a named yank fills the unnamed register too
+    if (editor.register_name != 0) 
+        RegisterCopy(&editor.registers[0], reg);
+}
+
+void Yank() {
+    size_t st_l, st_c, en_l, en_c;
+    if (editor.mode == VISUAL_BLOCK) {
+        VisualBlock(&st_l, &en_l, &st_c, &en_c);
+        YankLines(st_l, en_l, st_c, en_c, REGISTER_BLOCK);
+    } else if (editor.mode == VISUAL_LINE) {
+        VisualBlock(&st_l, &en_l, &st_c, &en_c);
+        YankLines(st_l, en_l, 0, 0, REGISTER_LINES);
+    } else {
+        VisualSelection(&st_l, &st_c, &en_l, &en_c);
+        YankLines(st_l, en_l, st_c, en_c, REGISTER_CHARS);
+    }
+}
+
+// Leave the cursor at a column after a bulk edit
+void SetCursorColumn(size_t column) {
+    editor.cur_column = editor.max_column = column;
+    CalculateCursorX();
+    CalculateCursorY();
+}
+
+// remove the text between two positions with a single shift of the lines after it
+void DeleteRange(size_t st_l, size_t st_c, size_t en_l, size_t en_c) {
+    if (st_l == en_l && st_c == en_c) 
+        return;
+
+    if (st_l == en_l) {
+        ArrayCutLine(array_buffer, st_l, st_c, en_c);
+    } else {
+        String* first = ArrayMutableLine(array_buffer, st_l);
+        String* last = array_buffer->array[en_l];
+        StringResize(first, st_c);
+        StringAppendN(first, &last->str[en_c], last->size - en_c);
+        ArrayRemoveRange(array_buffer, st_l + 1, en_l, NULL);
+    }
+
+    FinishBulkEdit(st_l, st_l);
+    SetCursorColumn(st_c);
+}
+
+// cut the columns [left, right) out of every line of the block, lines too short to reach left are skipped
+void DeleteBlock(size_t top, size_t bottom, size_t left, size_t right) {
+    for (size_t line = top; line <= bottom; line++) {
+        size_t size = array_buffer->array[line]->size;
+        if (size > left) 
+            ArrayCutLine(array_buffer, line, left, (right < size) ? right : size);
+    }
+
+    FinishBulkEdit(top, top);
+    size_t size = array_buffer->array[top]->size;
+    SetCursorColumn((left < size) ? left : size);
+}
+
+void Delete(int from_paste) {
+    if (!from_paste)
+        Yank();
+
+    size_t st_l, st_c, en_l, en_c;
+    if (editor.mode == VISUAL_BLOCK) {
+        VisualBlock(&st_l, &en_l, &st_c, &en_c);
+        DeleteBlock(st_l, en_l, st_c, en_c);
+    } else if (editor.mode == VISUAL_LINE) {
+        VisualBlock(&st_l, &en_l, &st_c, &en_c);
+        ArrayRemoveRange(array_buffer, st_l, en_l, NULL);
+        FinishBulkEdit(st_l, st_l);
+    } else {
+        VisualSelection(&st_l, &st_c, &en_l, &en_c);
+        DeleteRange(st_l, st_c, en_l, en_c);
+    }
+}
+
+// Insert the lines of a linewise register before line at, all of them shared
+void PasteLines(Register* reg, size_t at) {
+    for (size_t i = 0; i < reg->lines->size; i++) {
+        StringRetain(reg->lines->array[i]);
+    }
+    ArrayInsertLines(array_buffer, at, reg->lines->array, reg->lines->size);
+    FinishBulkEdit(at, at);
+}
+
+// Insert every row of a block register at the cursor column of the lines from the cursor down,
+// rows landing before more text are padded to the block width
+void PasteBlock(Register* reg) {
+    size_t line = editor.cur_line, column = editor.cur_column;
+    size_t width = reg->last_col - reg->first_col;
+    String* row = StringInit();
+
+    for (size_t i = 0; i < reg->lines->size; i++, line++) {
+        String* text = reg->lines->array[i];
+        size_t from = (reg->first_col < text->size) ? reg->first_col : text->size;
+        size_t to = (reg->last_col < text->size) ? reg->last_col : text->size;
+
+        if (line == array_buffer->size) 
+            s_ArrayAppend(array_buffer, "");
+        String* target = ArrayMutableLine(array_buffer, line);
+
+        StringClear(row);
+        StringAppendN(row, &text->str[from], to - from);
+        if (target->size > column) 
+            StringPad(row, width);
+        StringPad(target, column);
+        StringInsertN(target, column, row->str, row->size);
+    }
+    StringDestroy(row);
+
+    FinishBulkEdit(editor.cur_line, editor.cur_line);
+    SetCursorColumn(column);
+}
+
+// Insert the register at the cursor, the lines between its first and last are spliced in shared
+void Paste() {
+    Register* reg = &editor.registers[editor.register_name];
+    editor.register_name = 0;
+    if (reg->lines == NULL) 
+        return;
+
+    if (reg->type == REGISTER_LINES) {
+        PasteLines(reg, NextLine(editor.cur_line)); // below a closed fold, not into it
+        return;
+    }
+    if (reg->type == REGISTER_BLOCK) {
+        PasteBlock(reg);
+        return;
+    }
+
+    String** text = reg->lines->array;
+    size_t count = reg->lines->size;
+    size_t line = editor.cur_line, column = editor.cur_column;
+    String* cur_line = ArrayMutableLine(array_buffer, line);
+
+    if (count == 1) {
+        StringInsertN(cur_line, column, &text[0]->str[reg->first_col], reg->last_col - reg->first_col);
+        column += reg->last_col - reg->first_col;
+    } else {
+        // the rest of the current line follows the end of the pasted text
+        String* last = StringFromBuffer(text[count - 1]->str, reg->last_col);
+        StringAppendN(last, &cur_line->str[column], cur_line->size - column);
+        StringResize(cur_line, column);
+        StringAppendN(cur_line, &text[0]->str[reg->first_col], text[0]->size - reg->first_col);
+
+        for (size_t i = 1; i + 1 < count; i++) {
+            StringRetain(text[i]);
+        }
+        ArrayInsertLines(array_buffer, line + 1, &text[1], count - 2);
+        ArrayInsertLines(array_buffer, line + count - 1, &last, 1);
+
+        line += count - 1;
+        column = reg->last_col;
+    }
+
+    FinishBulkEdit(editor.cur_line, line);
+    SetCursorColumn(column);
+}
+
+// p in visual mode replaces the selection with the register
+void VisualPaste() {
+    if (editor.mode != VISUAL_LINE) {
+        Delete(1);
+        Paste();
+        return;
+    }
+
+    size_t top, bottom, left, right;
+    VisualBlock(&top, &bottom, &left, &right);
+    ArrayRemoveRange(array_buffer, top, bottom, NULL);
+
+    Register* reg = &editor.registers[editor.register_name];
+    if (reg->lines != NULL && reg->type == REGISTER_LINES) {
+        editor.register_name = 0;
+        PasteLines(reg, top);
+    } else { // other registers go on a line of their own
+        String* empty = StringInit();
+        ArrayInsertLines(array_buffer, top, &empty, 1);
+        FinishBulkEdit(top, top);
+        Paste();
+    }
+}
+
+// I and A on a block start typing on its first line, the text is repeated on the others when leaving insert mode
+void BlockInsert(int append) {
+    size_t top, bottom, left, right;
+    VisualBlock(&top, &bottom, &left, &right);
+    size_t column = append ? right : left;
+
+    if (array_buffer->array[top]->size < column) {
+        MarkLinesDirty(top, top);
+        StringPad(ArrayMutableLine(array_buffer, top), column);
+    }
+
+    editor.block_line = top;
+    editor.block_bottom = bottom;
+    editor.block_column = column;
+    editor.block_pad = append;
+    editor.block_line_size = array_buffer->array[top]->size;
+
+    GoToLine(top);
+    SetCursorColumn(column);
+    editor.mode = INSERT;
+}
+
+// Repeat what was typed on the first line of the block, one insert per line.
+// Lines too short for the column are padded after A and skipped after I
+void FinishBlockInsert() {
+    if (editor.block_bottom < 0) 
+        return;
+
+    int bottom = editor.block_bottom;
+    size_t column = editor.block_column;
+    editor.block_bottom = -1;
+
+    // only text typed on the first line without leaving it is repeated
+    String* first = array_buffer->array[editor.block_line];
+    if (editor.cur_line != editor.block_line || first->size <= editor.block_line_size) 
+        return;
+    size_t len = first->size - editor.block_line_size;
+    if (column + len > first->size) 
+        return;
+
+    String* text = StringFromBuffer(&first->str[column], len);
+    for (int line = editor.block_line + 1; line <= bottom; line++) {
+        if (array_buffer->array[line]->size < column && !editor.block_pad) 
+            continue;
+
+        String* target = ArrayMutableLine(array_buffer, line);
+        StringPad(target, column);
+        StringInsertN(target, column, text->str, text->size);
+    }
+    StringDestroy(text);
+    MarkLinesDirty(editor.block_line, bottom);
+}
+
+// Reload the file after it changed on disk. The lines matching at the start and the end of the
+// file are kept as they are and only the ones in between are rebuilt, the view stays on the same text
+void ReloadFile() {
+    int fd = open(editor.file_name->str, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) 
+        return;
+
+    struct stat disk;
+    if (fstat(fd, &disk) == -1 || !S_ISREG(disk.st_mode)) {
+        close(fd);
+        return;
+    }
+
+    size_t size = disk.st_size;
+    char* mapped = NULL;
+    const char* text = "";
+    String* plain = NULL; // the text of a compressed file
+    if (editor.compression != UNCOMPRESSED) {
+        plain = StringInit();
+        if (!DecompressFile(fd, editor.compression, NULL, plain)) {
+            StringDestroy(plain);
+            close(fd);
+            return;
+        }
+        text = plain->str;
+        size = plain->size;
+    } else if (size > 0) {
+        mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return;
+        }
+        text = mapped;
+    }
+
+    // unchanged lines at the start, each one followed by its newline
+    size_t prefix = 0, offset = 0;
+    while (prefix < array_buffer->size) {
+        String* line = array_buffer->array[prefix];
+        size_t end = offset + line->size;
+        if (end >= size || text[end] != '\n' || memcmp(&text[offset], line->str, line->size) != 0) 
+            break;
+        offset = end + 1;
+        prefix++;
+    }
+
+    // unchanged lines at the end, they can't reach into the prefix
+    size_t suffix = 0, end = size, suffix_start = size;
+    while (prefix + suffix < array_buffer->size) {
+        String* line = array_buffer->array[array_buffer->size - 1 - suffix];
+        if (line->size > end - offset) 
+            break;
+
+        size_t start = end - line->size;
+        if ((start > 0 && text[start - 1] != '\n') || memcmp(&text[start], line->str, line->size) != 0) 
+            break;
+
+        suffix++;
+        suffix_start = start;
+        if (start == offset) 
+            break;
+        end = start - 1;
+    }
+
+    // the changed lines go before the new ones are made and the text of a compressed file right after,
+    // so the lines and one copy of the file are the most held at once
+    size_t old_count = array_buffer->size - prefix - suffix;
+    if (old_count > 0) 
+        ArrayRemoveRange(array_buffer, prefix, prefix + old_count - 1, NULL);
+
+    Array* middle = ArrayInit();
+    if (suffix == 0) 
+        LoadLines(text + offset, size - offset, middle);
+    else if (suffix_start > offset) 
+        LoadLines(text + offset, suffix_start - 1 - offset, middle);
+    if (plain != NULL) 
+        StringDestroy(plain);
+
+    size_t new_count = middle->size;
+    ArrayInsertLines(array_buffer, prefix, middle->array, new_count);
+    free(middle->array);
+    free(middle);
+
+    if (mapped != NULL) 
+        munmap(mapped, size);
+    close(fd);
+
+    editor.disk_stat = disk;
+    editor.disk_stat_valid = 1;
+    editor.dirty_line = -1;
+    editor.buffer_modified = 0;
+    if (editor.buffer->mapped) 
+        mapped_files[editor.buffer->mapping].damaged = 0;
+
+    int last = array_buffer->size - 1;
+    editor.start_line = min(AnchorLine(editor.start_line, prefix, old_count, new_count), last);
+    editor.cur_line = min(AnchorLine(editor.cur_line, prefix, old_count, new_count), last);
+    editor.cur_column = min(editor.cur_column, array_buffer->array[editor.cur_line]->size);
+    CalculateCursorX();
+    CalculateCursorY();
+
+    char message[40];
+    snprintf(message, sizeof(message), "Reloaded, %zu lines changed", (old_count > new_count) ? old_count : new_count);
+    StringAssign(editor.status_message, message);
+}
+
+// Drain the inotify events, the file is reloaded (or the user warned) when it was rewritten or replaced
+void HandleFileEvents() {
+    _Alignas(struct inotify_event) char events[4096];
+    const char* name = FileBaseName(editor.file_name->str);
+    int changed = 0;
+    ssize_t len;
+
+    while ((len = read(editor.watch_fd, events, sizeof(events))) > 0) {
+        for (char* p = events; p < events + len; ) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->len > 0 && strcmp(event->name, name) == 0) 
+                changed = 1;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if (!changed) 
+        return;
+
+    // our own save closing the file, its new state is known once the thread is joined
+    FinishSave(1);
+
+    // gone, or it's still what we read or saved ourselves
+    struct stat disk;
+    if (stat(editor.file_name->str, &disk) == -1 || (editor.disk_stat_valid && SameFileState(&disk, &editor.disk_stat))) 
+        return;
+
+    // the text still in a mapping of the file is copied out before anything reads past its new end. A file that
+    // only grew under a buffer that wasn't changed is read again, that's left to the reload
+    size_t lost = 0;
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        Buffer* buffer = editor.buffers[i];
+        int modified = (buffer == editor.buffer) ? editor.buffer_modified : buffer->buffer_modified;
+        if (buffer->mapped && buffer->mapped_stat.st_dev == disk.st_dev && buffer->mapped_stat.st_ino == disk.st_ino &&
+            (modified || (size_t)disk.st_size < buffer->mapped_size)) {
+            size_t readable = ((size_t)disk.st_size < buffer->mapped_size) ? (size_t)disk.st_size : buffer->mapped_size;
+            size_t count = OwnMapped(buffer, 0, readable);
+            if (buffer == editor.buffer) 
+                lost = count;
         }
-        editor.motion_count = 0;
-        break;
-    default:
-        break;
     }
+
+    if (editor.buffer == editor.diff.side[0] && editor.diff.side[1] == NULL) 
+        editor.diff.stale = 1;
+    if (editor.buffer_modified) 
+        StringAssign(editor.status_message, lost ? "W: file shrank on disk, text lost" : "W: file changed on disk");
+    else 
+        ReloadFile();
 }
 
-void NormalModeOn() {
-    editor.mode = NORMAL;
-    editor.motion_count = 0;
-    StringAssign(editor.status_message, editor.file_name->str);
+// notvim - reads the text from stdin on a thread while the editor runs. Lines are handed over as they
+// come and a byte on a pipe wakes up WaitForInput. Past STDIN_SPILL_AFTER bytes the stream goes to an
+// unlinked temporary file instead and its lines borrow their text from a mapping of it, so the page cache
+// holds the text rather than the heap
+typedef struct
+{
+    pthread_t thread;
+    int running;
+    int fd;
+    int wake[2]; // self-pipe, written when lines are waiting
+    pthread_mutex_t lock; // guards lines, tail, finished and signaled
+    Array* lines; // complete lines not in the buffer yet
+    String* tail; // what followed the last newline, set at the end of the stream
+    int finished;
+    int signaled; // a wake byte is in the pipe
+    size_t total; // bytes read
+    int spill_fd; // -1 until the stream gets too large, or if spilling failed
+    int spill_failed;
+    char* spill; // mapping of the spill file, SPILL_RESERVE bytes of address space
+    size_t spill_size, line_start; // bytes in the file, offset of the line being read
+} StdinReader;
+
+_Thread_local StdinReader stdin_reader;
+
+// Move to a spill file, the partial line read so far goes first
+int StartSpill(StdinReader* reader, String* partial) {
+    const char* dir = getenv("TMPDIR");
+    String* path = StringInit();
+    StringAssign(path, (dir && *dir) ? dir : "/tmp");
+    StringAppend(path, "/notvim-stdin-XXXXXX");
+
+    int fd = mkostemp(path->str, O_CLOEXEC);
+    if (fd != -1) 
+        unlink(path->str);
+    StringDestroy(path);
+    if (fd == -1) 
+        return 0;
+
+    char* spill = mmap(NULL, SPILL_RESERVE, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (spill == MAP_FAILED || write(fd, partial->str, partial->size) != (ssize_t)partial->size) {
+        if (spill != MAP_FAILED) 
+            munmap(spill, SPILL_RESERVE);
+        close(fd);
+        return 0;
+    }
+    reader->spill_fd = fd;
+    reader->spill = spill;
+    reader->spill_size = partial->size;
+    reader->line_start = 0;
+    StringClear(partial);
+    return 1;
 }
 
-void VisualModeOn() {
-    editor.v_start_line = editor.cur_line;
-    editor.v_start_col = editor.cur_column;
-    editor.mode = VISUAL;
+// Append a chunk to the spill file and borrow the lines it completes
+int SpillChunk(StdinReader* reader, const char* chunk, size_t len, Array* lines) {
+    if (reader->spill_size + len > SPILL_RESERVE) 
+        return 0;
+    for (size_t written = 0; written < len; ) {
+        ssize_t n = write(reader->spill_fd, chunk + written, len - written);
+        if (n == -1 && errno == EINTR) 
+            continue;
+        if (n <= 0) 
+            return 0;
+        written += n;
+    }
+
+    for (const char* p = chunk, *newline; (newline = memchr(p, '\n', chunk + len - p)) != NULL; p = newline + 1) {
+        size_t end = reader->spill_size + (newline - chunk);
+        ArrayAppend(lines, StringBorrow(reader->spill + reader->line_start, end - reader->line_start));
+        reader->line_start = end + 1;
+    }
+    reader->spill_size += len;
+    return 1;
 }
 
-// command line stuff
-void SaveBuffer(String* filename) {
-    FILE* fptr;
+// Split a chunk into lines kept in memory, partial holds the unfinished last one
+void SplitChunk(const char* chunk, size_t len, String* partial, Array* lines) {
+    const char* p = chunk, *newline;
+    while ((newline = memchr(p, '\n', chunk + len - p)) != NULL) {
+        StringAppendN(partial, p, newline - p);
+        ArrayAppend(lines, StringFromBuffer(partial->str, partial->size));
+        StringClear(partial);
+        p = newline + 1;
+    }
+    StringAppendN(partial, p, chunk + len - p);
+}
 
-    fptr = fopen(filename->str, "w");
+// Hand the lines read so far to the main thread
+void PublishLines(StdinReader* reader, Array* lines, String* tail) {
+    pthread_mutex_lock(&reader->lock);
+    for (size_t i = 0; i < lines->size; i++) {
+        ArrayAppend(reader->lines, lines->array[i]);
+    }
+    lines->size = 0;
+    if (tail != NULL) {
+        reader->tail = tail;
+        reader->finished = 1;
+    }
+    if (!reader->signaled && write(reader->wake[1], "", 1) == 1) 
+        reader->signaled = 1;
+    pthread_mutex_unlock(&reader->lock);
+}
 
-    if (fptr == NULL) {
-        ShowError("Couldn't open file");
+void* StdinWorker(void* arg) {
+    StdinReader* reader = arg;
+    char* chunk = malloc(STDIN_CHUNK);
+    if (chunk == NULL) {
+        ShowError("Memory couldn't be allocated");
     }
+    String* partial = StringInit();
+    Array* lines = ArrayInit();
+
+    ssize_t len;
+    while ((len = read(reader->fd, chunk, STDIN_CHUNK)) != 0) {
+        if (len == -1 && errno == EINTR) 
+            continue;
+        if (len == -1) 
+            break;
 
-    String* buffer = StringInit();
-    for (size_t i = 0; i < array_buffer->size; i++) {
-        StringAppend(buffer, array_buffer->array[i]->str);
-        if (i + 1 < (array_buffer->size)) {
-            StringAppend(buffer, "\n");
+        if (reader->spill_fd == -1 && !reader->spill_failed && reader->total + len > STDIN_SPILL_AFTER) 
+            reader->spill_failed = !StartSpill(reader, partial);
+        if (reader->spill_fd != -1 && !SpillChunk(reader, chunk, len, lines)) {
+            // out of room, the rest stays in memory. The borrowed part of the line being read is copied
+            StringAppendN(partial, reader->spill + reader->line_start, reader->spill_size - reader->line_start);
+            reader->spill_fd = -1;
+            reader->spill_failed = 1;
+            SplitChunk(chunk, len, partial, lines);
+        } else if (reader->spill_fd == -1) {
+            SplitChunk(chunk, len, partial, lines);
         }
+        reader->total += len;
+        PublishLines(reader, lines, NULL);
     }
-    fputs(buffer->str, fptr);
 
-    StringDestroy(buffer);
-    fclose(fptr);
+    // the end of the file isn't mapped past its last page, so the tail is always a copy
+    if (reader->spill_fd != -1) 
+        StringAppendN(partial, reader->spill + reader->line_start, reader->spill_size - reader->line_start);
+    PublishLines(reader, lines, partial);
+    free(chunk);
+    ArrayDestroy(lines);
+    free(lines);
+    return NULL;
 }
 
-void ExecuteCommand() {
-    Array* paramaters = ArrayInit();
-    String* command = NULL, *token = StringInit();
+// Read the text from fd in the background, the buffer should hold its (empty) last line already
+void StartStdinReader(int fd) {
+    StdinReader* reader = &stdin_reader;
+    reader->fd = fd;
+    reader->lines = ArrayInit();
+    reader->tail = NULL;
+    reader->finished = reader->signaled = 0;
+    reader->total = 0;
+    reader->spill_fd = -1;
+    reader->spill_failed = 0;
+    pthread_mutex_init(&reader->lock, NULL);
+    if (pipe2(reader->wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+        ShowError("Couldn't create pipe");
+    }
+    if (pthread_create(&reader->thread, NULL, StdinWorker, reader) != 0) {
+        ShowError("Couldn't start the stdin reader");
+    }
+    reader->running = 1;
+    StringAssign(editor.status_message, "Reading stdin...");
+}
 
-    int command_extraced = 0;
-    for (size_t i = 0; i < editor.command->size; i++) {
-        if (editor.command->str[i] != ' ') {
-            StringInsertChar(token, token->size, editor.command->str[i]);
-        }
-        if (i + 1 == editor.command->size || editor.command->str[i] == ' ') {
-            if (command_extraced) {
-                ArrayAppend(paramaters, token);
-                token = StringInit();
-            } else {
-                command = token;
-                command_extraced = 1;
-                token = StringInit();
-            }
+// Keep the end of the stream in view in the other windows showing it on the last line
+void FollowStream(int last) {
+    Window* active = editor.window;
+    WindowSave(active);
+    for (size_t i = 0; i < editor.window_count; i++) {
+        Window* window = editor.windows[i];
+        if (window != active && window->buffer == editor.stdin_buffer && window->cur_line == last) {
+            WindowLoad(window);
+            GoToFileEnd();
+            WindowSave(window);
         }
     }
+    WindowLoad(active);
+}
 
-    if (command == NULL) return;
-
-    int should_quit = 0;
+// Put the lines the reader has handed over before the last line of the buffer.
+// The cursor follows them when it's on that line, so the end of the stream stays in view
+void TakeStdinLines() {
+    StdinReader* reader = &stdin_reader;
+    char drain[16];
+    while (read(reader->wake[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&reader->lock);
+    Array* lines = reader->lines;
+    reader->lines = ArrayInit();
+    String* tail = reader->tail;
+    int finished = reader->finished;
+    reader->signaled = 0;
+    pthread_mutex_unlock(&reader->lock);
+
+    // the stream goes to its own buffer, which may not be the one in the active window
+    Buffer* shown = editor.buffer;
+    SwitchBuffer(editor.stdin_buffer);
+    size_t last = array_buffer->size - 1;
+    int follow = (shown == editor.buffer && array_buffer->size > 1 && editor.cur_line == (int)last);
+    if (lines->size > 0) {
+        ArrayInsertLines(array_buffer, last, lines->array, lines->size);
+        last += lines->size;
+    }
+    if (tail != NULL && tail->size > 0) {
+        StringAppendN(ArrayMutableLine(array_buffer, last), tail->str, tail->size);
+        LinesChanged(last, last);
+    }
+    if (tail != NULL) 
+        StringDestroy(tail);
+    if (follow) 
+        GoToFileEnd();
 
-    if (strcmp(command->str, "q") == 0) {
-        should_quit = 1;
+    if (shown == editor.buffer) {
+        char message[40];
+        snprintf(message, sizeof(message), finished ? "stdin: %zu lines" : "Reading stdin... %zu lines", last + (array_buffer->array[last]->size > 0));
+        StringAssign(editor.status_message, message);
     }
-    else if (strcmp(command->str, "w") == 0) {
-        if (paramaters->size > 0) {
-            SaveBuffer(paramaters->array[0]);
-        } else if (editor.file_opened) {
-            SaveBuffer(editor.file_name);
-        } else {
-            StringAssign(editor.status_message, "No File Specified");
-        }
+    // the other windows on the last line were moved down with it by the insert
+    if (array_buffer->size - lines->size > 1) 
+        FollowStream(last);
+    SwitchBuffer(shown);
+    free(lines->array);
+    free(lines);
+
+    if (finished) {
+        pthread_join(reader->thread, NULL);
+        close(reader->fd);
+        close(reader->wake[0]);
+        close(reader->wake[1]);
+        ArrayDestroy(reader->lines);
+        free(reader->lines);
+        pthread_mutex_destroy(&reader->lock);
+        reader->running = 0;
     }
-    else if (strcmp(command->str, "wq") == 0) {
-        if (paramaters->size > 0) {
-            SaveBuffer(paramaters->array[0]);
-            should_quit = 1;
-        } else if (editor.file_opened) {
-            SaveBuffer(editor.file_name);
-            should_quit = 1;
-        } else {
-            StringAssign(editor.status_message, "No File Specified");
+}
+
+// Idle compaction: after a second without keys the lines of the buffer are gone through a slice per tick.
+// Short lines move into arenas and longer ones give back their slack. Lines changed since are gone through
+// again, except the one the cursor is on which is likely to change next
+#define COMPACT_STEP 65536 // lines per tick
+#define COMPACT_IDLE_TICKS 10 // WaitForInput timeouts without keys before compacting
+
+void CompactLine(String* line) {
+    if (line->capacity == 0) // borrowed, or packed already
+        return;
+    if (line->size < ARENA_LINE_MAX) {
+        char* text = ArenaCopy(line->str, line->size);
+        free(line->str);
+        line->str = text;
+        line->capacity = 0;
+        line->packed = 1;
+    } else if (line->capacity > line->size + 1 + line->size / 8) {
+        char* text = realloc(line->str, line->size + 1);
+        if (text != NULL) {
+            line->str = text;
+            line->capacity = line->size + 1;
         }
-    } else {
-        StringAssign(editor.status_message, "Not an editor command");
     }
-    StringDestroy(command);
-    StringDestroy(token);
-    ArrayDestroy(paramaters);
+}
 
-    if (should_quit)  {
-        ResetScreenBuffer();
-        exit(0);   
+void CompactIdle() {
+    if (editor.compact_buffer != editor.buffer) {
+        editor.compact_buffer = editor.buffer;
+        editor.compact_next = 0;
+    }
+    // a save and the word index read the lines on their threads
+    if (save_job.running || word_job.running || editor.compact_next >= array_buffer->size) 
+        return;
+
+    size_t end = editor.compact_next + COMPACT_STEP;
+    if (end > array_buffer->size) 
+        end = array_buffer->size;
+    for (size_t i = editor.compact_next; i < end; i++) {
+        if (i != (size_t)editor.cur_line) 
+            CompactLine(array_buffer->array[i]);
     }
+    editor.compact_next = end;
+    if (end == array_buffer->size) 
+        malloc_trim(0);
 }
 
-// insert into buffer
-void BufferInsert(char c) {
-    // New line
-    if (c == '\r') {
-        ArraySplitLine(array_buffer ,editor.cur_line, editor.cur_column);
-        MoveCursorAndScroll(CURSOR_DOWN);
-        MoveCursorAndScroll(HOME);
+// Wait for a key, a change of the watched file or lines from stdin, waking up every 100ms like the raw mode read timeout
+int WaitForInput() {
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}};
+    int count = 1, watch = -1, stream = -1;
+    if (editor.watch_fd != -1) {
+        watch = count;
+        fds[count++] = (struct pollfd){editor.watch_fd, POLLIN, 0};
+    }
+    if (stdin_reader.running) {
+        stream = count;
+        fds[count++] = (struct pollfd){stdin_reader.wake[0], POLLIN, 0};
     }
 
-    // Printable
-    else {
-        editor.buffer_modified = 1;
-        String* cur_line = array_buffer->array[editor.cur_line];
-        StringInsertChar(cur_line, editor.cur_column, c);
-        MoveCursorAndScroll(CURSOR_RIGHT);
+    int ready = poll(fds, count, 100);
+    FinishSave(0);
+    FinishGrep(0);
+    FinishWords(0);
+    if (ready == 0 && editor.diff.stale) 
+        DiffUpdate();
+    if (ready == 0 && ++editor.idle_ticks >= COMPACT_IDLE_TICKS) 
+        CompactIdle();
+    if (ready <= 0) 
+        return 0;
+    if (watch != -1 && (fds[watch].revents & POLLIN)) 
+        HandleFileEvents();
+    if (stream != -1 && (fds[stream].revents & POLLIN)) 
+        TakeStdinLines();
+    if (fds[0].revents != 0) 
+        editor.idle_ticks = 0;
+    return fds[0].revents != 0;
+}
+
+// Key proccessing for differnet modes
+void ProcessKey(int key); // replays feed their keys back through it
+
+// Bring the view to the cursor once after a replay, scrolling was held back while it ran
+void FinishReplay() {
+    editor.start_line = min(editor.start_line, array_buffer->size - 1);
+    if (editor.cur_line < editor.start_line || editor.cur_line > editor.end_line) 
+        CenterOnLine(editor.cur_line);
+    CalculateCursorX();
+    CalculateCursorY();
+}
+
+// Run keys count times without drawing in between
+void ReplayKeys(const KeyList* keys, int count) {
+    if (keys->size == 0) 
+        return;
+
+    editor.replaying = 1;
+    for (int i = 0; i < count; i++) {
+        for (size_t k = 0; k < keys->size; k++) {
+            ProcessKey(keys->keys[k]);
+        }
     }
+    editor.replaying = 0;
+    FinishReplay();
+
+    // what ran is not the change . repeats
+    editor.change_start_tick = editor.change_tick;
 }
 
-// delete from buffer backward
-void BufferDelete() {
-    String* cur_line = array_buffer->array[editor.cur_line];
-    if (editor.cur_column > 0) { // Delete a char
-        StringDeleteChar(cur_line, editor.cur_column - 1);
-        MoveCursorAndScroll(CURSOR_LEFT);
+void StartRecording(int reg) {
+    editor.recording = reg;
+    editor.macros[reg].size = 0;
+}
+
+// The second key of "x, qx and @x, returns 1 if the key was used.
+// q and @ are ignored while replaying, so a macro can't change under its own replay
+int PendingKey(int key) {
+    int first = editor.pending_key;
+    if (first == 0) {
+        if (key == 'q' && editor.mode == NORMAL && editor.recording >= 0 && !editor.replaying) {
+            editor.recording = -1;
+            return 1;
+        }
+        if (key == '"' || ((key == 'q' || key == '@') && editor.mode == NORMAL && !editor.replaying) || key == 'z' 
+            || ((key == CTRL_KEY('w') || key == ']' || key == '[') && editor.mode == NORMAL)) {
+            editor.pending_key = key;
+            return 1;
+        }
+        return 0;
+    }
+
+    editor.pending_key = 0;
+    int reg = (key >= 'a' && key <= 'z') ? key - 'a' + 1 : -1;
+    if (first == '"') {
+        if (key == '"') 
+            reg = 0;
+        if (reg >= 0) 
+            editor.register_name = reg;
     } 
-    
-    else if (editor.cur_line > 0) { // Delete a line
-        // get prev line size to move the cursor after it
-        String* prev_line = array_buffer->array[editor.cur_line - 1];
-        size_t prev_size = prev_line->size;
+    else if (first == 'q' && reg > 0) {
+        StartRecording(reg);
+    } 
+    else if (first == '@') {
+        if (key == '@') 
+            reg = editor.last_macro;
+        if (reg > 0) {
+            int count = max(1, editor.motion_count);
+            editor.motion_count = 0;
+            editor.last_macro = reg;
+            ReplayKeys(&editor.macros[reg], count);
+        }
+    }
+    else if (first == 'z') {
+        int count = editor.motion_count;
+        editor.motion_count = 0;
+        FoldCommand(key, count);
+    }
+    else if (first == CTRL_KEY('w')) {
+        int count = editor.motion_count;
+        editor.motion_count = 0;
+        WindowCommand(key, count);
+    }
+    else if ((first == ']' || first == '[') && key == 'c') {
+        int count = max(1, editor.motion_count);
+        editor.motion_count = 0;
+        DiffJump((first == ']') ? 1 : -1, count);
+    }
+    return 1;
+}
 
-        ArrayMergeLines(array_buffer, editor.cur_line);
-        editor.cur_column = editor.max_column = prev_size;
-        ScrollUp();
-        CalculateCursorX();
-        CalculateCursorY();
+// Collect the keys from normal mode being idle to it being idle again, they make the last change if the buffer was edited
+void TrackChangeStart(int key) {
+    if (!editor.change_open && editor.mode == NORMAL && editor.pending_key == 0 && editor.motion_count == 0) {
+        editor.change.size = 0;
+        editor.change_start_tick = editor.change_tick;
+        editor.change_open = 1;
     }
+    KeyListAppend(&editor.change, key);
 }
 
-void Yank() {
-    StringClear(editor.yanked);
-    size_t st_l = editor.v_start_line, st_c = editor.v_start_col;
-    size_t en_l = editor.cur_line, en_c = editor.cur_column;
+void TrackChangeEnd() {
+    if (editor.mode != NORMAL || editor.pending_key != 0 || editor.motion_count != 0) 
+        return;
 
-    if (en_l < st_l) {
-        swap(&st_l, &en_l);
-        swap(&st_c, &en_c);
-    } else if (en_l == st_l && en_c < st_c) {
-        swap(&st_c, &en_c);
-    }
+    if (editor.change_tick != editor.change_start_tick) 
+        KeyListCopy(&editor.last_change, &editor.change);
+    editor.change_open = 0;
+}
 
-    for (size_t line = st_l; line <= en_l; line++) {
-        String* cur_line = array_buffer->array[line];
-        if (line == st_l && line == en_l) {
-            for (size_t c = st_c; c < en_c; c++) {
-                StringInsertChar(editor.yanked, editor.yanked->size, cur_line->str[c]);
-            }
-        } else if (line == st_l) {
-            StringAppend(editor.yanked, &cur_line->str[st_c]);
-        } else if (line == en_l) {
-            for (size_t c = 0; c < en_c; c++) {
-                StringInsertChar(editor.yanked, editor.yanked->size, cur_line->str[c]);
-            }
-        } else {
-            StringAppend(editor.yanked, cur_line->str);
+// Append the k-th word (in letter order) below node to word, the word ending at node itself isn't counted
+void WordNth(WordIndex* index, int node, int k, String* word) {
+    while (1) {
+        int child = index->nodes[node].child;
+        while (k >= index->nodes[child].words) {
+            k -= index->nodes[child].words;
+            child = index->nodes[child].sibling;
         }
-        if (line < en_l) {
-            StringInsertChar(editor.yanked, editor.yanked->size, '\n');
+        StringAppendN(word, &index->nodes[child].letter, 1);
+        node = child;
+        if (index->nodes[node].count > 0) {
+            if (k == 0) 
+                return;
+            k--;
         }
     }
 }
 
-void Delete(int from_paste) {
-    if (!from_paste)
-        Yank();
-        
-    size_t st_l = editor.v_start_line, st_c = editor.v_start_col;
-    size_t en_l = editor.cur_line, en_c = editor.cur_column;
+void CompletionFailed(const char* message) {
+    StringAssign(editor.status_message, message);
+    editor.completion_choice = -1;
+    editor.completion_line = editor.cur_line;
+    editor.completion_end = editor.cur_column;
+    editor.completion_tick = editor.change_tick;
+}
 
-    if (en_l < st_l) {
-        swap(&st_l, &en_l);
-        swap(&st_c, &en_c);
-    } else if (en_l == st_l && en_c < st_c) {
-        swap(&st_c, &en_c);
+// Ctrl-N / Ctrl-P: replace the word before the cursor with the next / previous word of the buffer starting like it.
+// Pressing them again goes through the matches in letter order, then back to what was typed
+void CompleteWord(int step) {
+    if (editor.words == NULL) {
+        StartWords();
+        FinishWords(array_buffer->size <= WORD_WAIT_LINES);
     }
-    editor.cur_line = en_l, editor.cur_column = en_c;
-    while (editor.cur_line != st_l || editor.cur_column != st_c) {
-        BufferDelete();
+    WordIndex* index = editor.words;
+    int line = editor.cur_line;
+    if (index->snapshot != NULL) {
+        CompletionFailed("Words are still being indexed");
+        return;
     }
-}
 
-void Paste() {
-    for (size_t i = 0; i < editor.yanked->size; i++) {
-        if (editor.yanked->str[i] == '\n') {
-            BufferInsert('\r');
-        } else {
-            BufferInsert(editor.yanked->str[i]);
-        }
+    int again = Completing() && editor.completion_choice >= 0;
+    if (!again) {
+        const char* text = array_buffer->array[line]->str;
+        int start = editor.cur_column;
+        while (start > 0 && IsKeyword(text[start - 1])) start--;
+        if (editor.completion == NULL) 
+            editor.completion = StringInit();
+        StringAssign(editor.completion, "");
+        StringAppendN(editor.completion, &text[start], editor.cur_column - start);
+        editor.completion_line = line;
+        editor.completion_start = start;
     }
+
+    // the words of the line itself are counted out while it's edited
+    ArrayMutableLine(array_buffer, line);
+    int node = 0;
+    for (size_t i = 0; i < editor.completion->size && node != -1; i++) {
+        node = WordChild(index, node, editor.completion->str[i], 0);
+        if (node == 0) 
+            node = -1;
+    }
+    int matches = (node == -1) ? 0 : index->nodes[node].words - (index->nodes[node].count > 0);
+    if (matches == 0) {
+        CompletionFailed("Pattern not found");
+        return;
+    }
+
+    // choice matches stands for the typed prefix
+    int choice;
+    if (again) 
+        choice = (editor.completion_choice + step + matches + 1) % (matches + 1);
+    else 
+        choice = (step > 0) ? 0 : matches - 1;
+    String* word = StringDuplicate(editor.completion);
+    if (choice < matches) 
+        WordNth(index, node, choice, word);
+
+    MarkLinesDirty(line, line);
+    ArrayCutLine(array_buffer, line, editor.completion_start, editor.cur_column);
+    StringInsertN(array_buffer->array[line], editor.completion_start, word->str, word->size);
+    SetCursorColumn(editor.completion_start + word->size);
+    StringDestroy(word);
+
+    char message[64];
+    if (choice < matches) 
+        snprintf(message, sizeof(message), "match %d of %d", choice + 1, matches);
+    else 
+        snprintf(message, sizeof(message), "Back at original");
+    StringAssign(editor.status_message, message);
+    editor.completion_choice = choice;
+    editor.completion_end = editor.cur_column;
+    editor.completion_tick = editor.change_tick;
 }
 
-// Key proccessing for differnet modes
 void InsertProccessKey(int key) {
+    if (key == CTRL_KEY('n') || key == CTRL_KEY('p')) {
+        CompleteWord((key == CTRL_KEY('n')) ? 1 : -1);
+        return;
+    }
+
     // Backspace -> Delete backward
     if (key == 127) {
         BufferDelete();
@@ -1187,8 +7779,11 @@ void InsertProccessKey(int key) {
     if (key == DELETE) {
         String* cur_line = array_buffer->array[editor.cur_line];
         if (editor.cur_column < (int)cur_line->size) {
+            MarkLinesDirty(editor.cur_line, editor.cur_line);
+            cur_line = ArrayMutableLine(array_buffer, editor.cur_line);
             StringDeleteChar(cur_line, editor.cur_column);
         } else if (editor.cur_line < (int)array_buffer->size - 1) {
+            MarkDirty(editor.cur_line);
             ArrayMergeLines(array_buffer ,editor.cur_line + 1);
         }
     }
@@ -1204,6 +7799,9 @@ void InsertProccessKey(int key) {
 }
 
 void NormalProccessKey(int key) {
+    if (PendingKey(key)) 
+        return;
+
     if (IsMoveKeyNormal(key)) {
         editor.motion_count = max(1, editor.motion_count);
         for (int i = 0; i < editor.motion_count; i++) {
@@ -1224,16 +7822,29 @@ void NormalProccessKey(int key) {
     if (key == 'p') {
         Paste();
     }
+
+    if (key == '.') {
+        int count = max(1, editor.motion_count);
+        editor.motion_count = 0;
+        ReplayKeys(&editor.last_change, count);
+    }
     
     // switch between modes
     switch (key)
     {
     case 'i':
     case 's':
+        OpenFoldsAt(editor.cur_line);
         editor.mode = INSERT;
         break;
     case 'v':
-        VisualModeOn();
+        VisualModeOn(VISUAL);
+        break;
+    case 'V':
+        VisualModeOn(VISUAL_LINE);
+        break;
+    case CTRL_KEY('v'):
+        VisualModeOn(VISUAL_BLOCK);
         break;
     case ':':
         editor.mode = COMMAND_LINE;
@@ -1273,13 +7884,16 @@ void CommandProccessKey(int key) {
         StringDeleteChar(editor.command, editor.command_cursor_pos);
     }
 
-    else if (IsPrintableCharacter(key) && editor.command->size < editor.window_cols) {
+    else if (IsPrintableCharacter(key) && editor.command->size < editor.screen_cols) {
         StringInsertChar(editor.command, editor.command_cursor_pos, key);
         editor.command_cursor_pos++;
     }
 }
 
 void VisualProccessKey(int key) {
+    if (PendingKey(key)) 
+        return;
+
     if (IsMoveKeyNormal(key)) {
         editor.motion_count = max(1, editor.motion_count);
         for (int i = 0; i < editor.motion_count; i++) {
@@ -1307,19 +7921,20 @@ void VisualProccessKey(int key) {
     }
 
     else if (key == 'p') {
-        Delete(1);
-        Paste();
+        VisualPaste();
         NormalModeOn();
     }
-}
-void EditorProccessKey() {
-    int key = EditorReadKey();
-
-    // no key was read
-    if (key == -1) return;
 
+    else if (editor.mode == VISUAL_BLOCK && (key == 'I' || key == 'A')) {
+        NormalModeOn();
+        BlockInsert(key == 'A');
+    }
+}
+void ProcessKey(int key) {
     // reset to normal mode when pressing Escape
     if (key == ESC) {
+        if (editor.mode == INSERT) 
+            FinishBlockInsert();
         NormalModeOn();
     }
 
@@ -1335,22 +7950,51 @@ void EditorProccessKey() {
         CommandProccessKey(key);
         break;
     case VISUAL:
+    case VISUAL_LINE:
+    case VISUAL_BLOCK:
         VisualProccessKey(key);
         break;
     default:
         break;
     }
-    
+}
+
+void EditorProccessKey() {
+    if (!WaitForInput()) return;
+    int key = EditorReadKey();
+
+    // no key was read
+    if (key == -1) return;
+
+    int recording = editor.recording;
+    TrackChangeStart(key);
+    ProcessKey(key);
+    TrackChangeEnd();
+
+    // keys that start or stop the recording are left out of it
+    if (recording >= 0 && editor.recording == recording) 
+        KeyListAppend(&editor.macros[recording], key);
 }
 
 void cleanup() {
+    FinishSave(1);
+    CancelWords();
+    // large files open where they were left the next time
+    FinishIndexCache();
+    for (size_t i = 0; i < editor.window_count; i++) {
+        BufferKeepView(editor.windows[i]);
+    }
+    BufferSave(editor.buffer);
+    for (size_t i = 0; i < editor.buffer_count; i++) {
+        StoreCachedView(editor.buffers[i]);
+    }
     ArrayDestroy(array_buffer);
     EditorDestroy();
     DisableRawMode();
 }
 
 void ShowHelpFile() {
-    FILE* fptr = fopen("help.txt", "r");
+    FILE* fptr = fopen("help.txt", "re");
     
     if (fptr == NULL) { // The file doesn't exist
         ShowError("Couldn't open help file");
@@ -1366,23 +8010,201 @@ void ShowHelpFile() {
     
 }
 
+// Batch mode: notvim -es [-c cmd]... files... runs the commands on every file without touching the terminal.
+// Files are spread over a pool of threads, each one with its own editor and buffer (both thread local)
+typedef struct
+{
+    const char* filename;
+    int failed;
+    double seconds;
+    char message[64]; // last status message of the file
+} BatchFile;
+
+typedef struct
+{
+    BatchFile* files;
+    size_t count;
+    atomic_size_t next;
+    char** commands;
+    int command_count;
+} BatchPool;
+
+void RunBatchFile(BatchFile* file, BatchPool* pool) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    EditorInit(1);
+    array_buffer = ArrayInit();
+    ReadFileToBuffer(file->filename);
+
+    // the commands aren't run on a file that couldn't be read
+    int unreadable = editor.command_failed;
+    for (int i = 0; i < pool->command_count && !editor.quit && !unreadable; i++) {
+        StringAssign(editor.command, pool->commands[i]);
+        ExecuteCommand();
+    }
+    if (!FinishSave(1)) 
+        editor.command_failed = 1;
+
+    file->failed = editor.command_failed;
+    snprintf(file->message, sizeof(file->message), "%s", editor.status_message->str);
+    ArrayDestroy(array_buffer);
+    free(array_buffer);
+    EditorDestroy();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    file->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void* BatchWorker(void* arg) {
+    BatchPool* pool = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        RunBatchFile(&pool->files[i], pool);
+    }
+    return NULL;
+}
+
+// Returns the exit status: 0 if every file went through, 1 if some command failed, 2 for bad arguments
+int RunBatch(int argc, char** argv) {
+    BatchPool pool;
+    pool.files = malloc(argc * sizeof(BatchFile));
+    pool.commands = malloc(argc * sizeof(char*));
+    if (pool.files == NULL || pool.commands == NULL) {
+        ShowError("Memory couldn't be allocated");
+    }
+    pool.count = 0;
+    pool.command_count = 0;
+    atomic_store(&pool.next, 0);
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "notvim: -c needs a command\n");
+                return 2;
+            }
+            pool.commands[pool.command_count++] = argv[++i];
+        } else {
+            pool.files[pool.count++].filename = argv[i];
+        }
+    }
+    if (pool.count == 0) {
+        fprintf(stderr, "usage: notvim -es [-c command]... file...\n");
+        return 2;
+    }
+
+    // a filter whose reader quits early must not kill the other files
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t workers[MAX_THREADS];
+    int threads = ThreadCount(pool.count, 1), started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, BatchWorker, &pool) == 0) 
+            started++;
+    }
+    BatchWorker(&pool);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < pool.count; i++) {
+        BatchFile* file = &pool.files[i];
+        printf("%s\t%s\t%.3fs\t%s\n", file->filename, file->failed ? "failed" : "ok", file->seconds, file->message);
+        if (file->failed) 
+            status = 1;
+    }
+    free(pool.files);
+    free(pool.commands);
+    return status;
+}
+
+size_t page_size; // for HandleBusError, sysconf can't be called in a signal handler
+
+// Lines may borrow their text from a mapping of a file that shrinks under the editor. HandleFileEvents copies it
+// out once it hears of it, a read past the new end before that raises SIGBUS. As a last resort a page of zeros
+// goes there and the mapping is marked damaged, so a save refuses to write the NULs as text
+void HandleBusError(int sig, siginfo_t* info, void* context) {
+    (void)context;
+    const char* addr = info->si_addr;
+    int count = min(atomic_load(&mapped_file_count), MAPPED_FILES);
+    for (int i = 0; info->si_code == BUS_ADRERR && i < count; i++) {
+        MappedFile* file = &mapped_files[i];
+        if (addr < file->start || addr >= file->start + file->size) 
+            continue;
+        file->damaged = 1;
+        void* start = (void*)((size_t)addr & ~(page_size - 1));
+        if (mmap(start, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) 
+            return;
+        break;
+    }
+    signal(sig, SIG_DFL);
+}
+
 int main(int argc, char** argv) {
     if (argc > 1 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)) {
         ShowHelpFile();
         return 0;
     }
-    EditorInit();
+    if (argc > 1 && strcmp(argv[1], "-es") == 0) {
+        return RunBatch(argc - 2, argv + 2);
+    }
+    // notvim -d a b shows the two files side by side in diff mode
+    int diff_files = (argc > 1 && strcmp(argv[1], "-d") == 0);
+    if (diff_files && argc != 4) {
+        fprintf(stderr, "usage: notvim -d file1 file2\n");
+        return 1;
+    }
+    if (diff_files) {
+        argc--;
+        argv++;
+    }
+    // notvim - reads the text from stdin, keys come from the terminal instead
+    int text_fd = -1;
+    if (argc > 1 && strcmp(argv[1], "-") == 0) {
+        text_fd = dup(STDIN_FILENO);
+        int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+        if (text_fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+            ShowError("Couldn't open the terminal");
+        }
+        close(tty);
+        fcntl(text_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    EditorInit(0);
+    page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction bus_error = {0};
+    bus_error.sa_sigaction = HandleBusError;
+    bus_error.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &bus_error, NULL);
+    // a compressor that exits early must not kill the editor with the save
+    signal(SIGPIPE, SIG_IGN);
     ChangeScreenBuffer();
     EnableRawMode();
     array_buffer = ArrayInit();
     atexit(cleanup);
-    if (argc > 1) {
+    if (text_fd != -1) {
+        s_ArrayAppend(array_buffer, "");
+        editor.from_stdin = 1;
+        editor.stdin_buffer = editor.buffer;
+        StartStdinReader(text_fd);
+    } else if (argc > 1) {
         ReadFileToBuffer(argv[1]);
+        RestoreView(editor.buffer);
     } else {
         s_ArrayAppend(array_buffer, "");
     }
+    TableAuto();
+    // the other files are only read when they're first shown
+    for (int i = 2; i < argc; i++) 
+        AddBuffer(argv[i]);
+    if (diff_files) {
+        ExDiff(argv[2]);
+        GoToWindow(editor.windows[0]);
+    }
     while (1) {
-        GetWindowSize(&editor.window_rows, &editor.window_cols);
+        GetWindowSize(&editor.screen_rows, &editor.screen_cols);
+        LayoutWindows();
         EditorClearScreen();
         EditorProccessKey();
     }